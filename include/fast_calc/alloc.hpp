@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// the memory fcalc allocates itself, the words from tokenize and the names
+// that don't fit in a SmolString, goes through here and is counted, so
+// allocations can be watched without hooking malloc. the counters belong to
+// the thread that allocates or frees, memory freed on another thread than
+// the one that allocated it leaves one side's live count off
+namespace fcalc {
+struct AllocStats {
+  uint64_t allocations{};
+  uint64_t frees{};
+  // total handed out, freeing doesn't take it back
+  uint64_t bytes{};
+  // allocated minus freed, negative if this thread freed more than it got
+  int64_t live{};
+  // highest live since the last reset
+  int64_t peak{};
+};
+
+// the calling thread's counters
+AllocStats alloc_stats() noexcept;
+// zeroes the counts, live is kept and peak starts over from it
+void reset_alloc_stats() noexcept;
+
+void *allocate(size_t size);
+void deallocate(void *p, size_t size) noexcept;
+
+template <typename T> struct Allocator {
+  static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+  using value_type = T;
+
+  Allocator() = default;
+  template <typename U> Allocator(const Allocator<U> &) noexcept {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(fcalc::allocate(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t n) noexcept {
+    fcalc::deallocate(p, n * sizeof(T));
+  }
+  friend bool operator==(Allocator, Allocator) noexcept { return true; }
+};
+} // namespace fcalc
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "fast_calc/eval.hpp"
+
+#include <complex>
+#include <cstddef>
+#include <span>
+
+namespace fcalc {
+class WorkPool;
+using Complex = std::complex<double>;
+
+// columns are kept as split real/imaginary arrays, so the kernels only ever
+// see plain doubles and vectorize like the real ones do
+struct ComplexColumn {
+  double *re;
+  double *im;
+};
+struct ComplexColumnView {
+  const double *re;
+  const double *im;
+};
+
+Complex evaluate_complex(std::span<const Word> s,
+                         std::span<const Binding<Complex>> vars = {});
+// one huge expression split across pool, see fork_join_walk
+Complex evaluate_complex(std::span<const Word> s, WorkPool &pool,
+                         std::span<const Binding<Complex>> vars = {},
+                         size_t cutoff = fork_cutoff);
+// vars are bound in the order of Program::variables
+void evaluate_complex(ProgramView p, std::span<const ComplexColumnView> vars,
+                      ComplexColumn out, size_t rows);
+} // namespace fcalc
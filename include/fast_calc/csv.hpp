@@ -0,0 +1,51 @@
+#pragma once
+
+#include "fast_calc/smol_str.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace fcalc {
+// rows per read when streaming a file through evaluation, a few MiB of
+// columns that get evaluated while they're still in cache
+inline constexpr size_t csv_rows = 64 << 10;
+
+// numeric csv from a memory mapped file, read straight into the columns a
+// program binds. the header names the columns and bind picks the ones for
+// Program::variables, the others are only skipped over. field and line
+// ends are found 64 bytes at a time with vector compares and the numbers
+// go through std::from_chars, nothing is copied into rows on the way.
+// fields aren't quoted, empty ones read as nan and \r\n works as well as \n
+class CsvReader {
+public:
+  // maps path and reads the header
+  explicit CsvReader(const std::string &path, char delimiter = ',');
+  CsvReader(const CsvReader &) = delete;
+  ~CsvReader();
+
+  // the column names in file order
+  std::span<const std::string> header() const noexcept { return names; }
+  // the columns read from now on, in the order of variables. throws if
+  // one isn't in the header
+  void bind(std::span<const SmolString> variables);
+  // up to rows more rows of the bound columns into out, one pointer per
+  // variable. returns how many were read, 0 at the end of the file. throws
+  // on a field that isn't a number or a line with the wrong field count
+  size_t read(std::span<double *const> out, size_t rows);
+
+private:
+  const char *base = nullptr;
+  const char *at = nullptr;
+  const char *end = nullptr;
+  // of at, counting from 1 for the header
+  size_t line = 1;
+  char delimiter;
+  std::vector<std::string> names;
+  // the variable each field goes to, or skip
+  std::vector<uint32_t> targets;
+  size_t bound = 0;
+};
+} // namespace fcalc
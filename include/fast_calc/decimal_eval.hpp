@@ -0,0 +1,31 @@
+#pragma once
+
+#include "fast_calc/eval.hpp"
+
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace fcalc {
+// fixed point decimals. x is held as x * 10^scale in a signed 128 bit
+// integer, so 0.1 + 0.2 is exactly 0.3 at any scale. mul, div, sqrt and
+// literals with more digits than the scale round half to even, anything
+// that doesn't fit in 128 bits throws
+using Decimal = __int128;
+// 10^scale has to fit in 64 bits for the fast paths
+inline constexpr unsigned max_decimal_scale = 18;
+
+Decimal to_decimal(const Number &n, unsigned scale);
+// [-]digits[.digits]
+Decimal to_decimal(std::string_view text, unsigned scale);
+// always prints scale fraction digits, 0.30 at scale 2
+std::string format_decimal(Decimal d, unsigned scale);
+
+// i has no decimal value and exponents have to be whole numbers
+Decimal evaluate_decimal(std::span<const Word> s, unsigned scale,
+                         std::span<const Binding<Decimal>> vars = {});
+// vars are bound in the order of Program::variables, already scaled
+void evaluate_decimal(ProgramView p, std::span<const Decimal *const> vars,
+                      Decimal *out, size_t rows, unsigned scale);
+} // namespace fcalc
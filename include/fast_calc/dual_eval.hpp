@@ -0,0 +1,22 @@
+#pragma once
+
+#include "fast_calc/eval.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace fcalc {
+// forward mode differentiation. every stack slot carries the value plus one
+// tangent lane per entry of wrt, so the value and the whole gradient come
+// out of one pass over the program. wrt holds Program::variables slots
+
+// gradient[k] receives d/d wrt[k], the value is returned
+double evaluate_gradient(ProgramView p, std::span<const double> vars,
+                         std::span<const uint32_t> wrt,
+                         std::span<double> gradient);
+// gradient[k] is the output column for wrt[k]
+void evaluate_gradient(ProgramView p, std::span<const double *const> vars,
+                       std::span<const uint32_t> wrt, double *value,
+                       std::span<double *const> gradient, size_t rows);
+} // namespace fcalc
@@ -0,0 +1,276 @@
+#pragma once
+
+#include "fast_calc/fcalc.hpp"
+#include "fast_calc/trace.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <numbers>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+namespace fcalc {
+// one postfix instruction. op holds the Constant::Types, Unary::Ops,
+// Binary::Ops or Function::Ops, arg indexes Program::numbers or
+// Program::variables. a Ternary comes after its condition and both arms
+struct Instr {
+  WordType type;
+  uint8_t op{};
+  uint32_t arg{};
+};
+
+// what the evaluators need from a program, without owning any of it. an
+// Image hands these out pointing straight into the mapped file
+struct ProgramView {
+  std::span<const Instr> code;
+  std::span<const Number> numbers;
+  // number of variable slots
+  uint32_t variables{};
+  uint32_t max_depth{};
+};
+
+// the prefix form flattened into postfix, so an instruction can be run over
+// a whole block of rows instead of walking the words again for every row
+struct Program {
+  std::vector<Instr> code;
+  std::vector<Number> numbers;
+  // variable slots in order of first appearance, columns are bound in the
+  // same order
+  std::vector<SmolString> variables;
+  // set for `v = ...`, the assignment itself is not part of the code
+  std::optional<SmolString> target;
+  uint32_t max_depth{};
+
+  std::optional<uint32_t> slot(std::string_view name) const noexcept {
+    for (uint32_t i = 0; i != variables.size(); ++i) {
+      if (variables[i].view() == name)
+        return i;
+    }
+    return std::nullopt;
+  }
+
+  operator ProgramView() const noexcept {
+    return {code, numbers, uint32_t(variables.size()), max_depth};
+  }
+};
+
+// s must already be parsed
+Program compile(std::span<const Word> s);
+
+// throws unless p is safe to run: every op is one the evaluators know, every
+// arg is in range and max_depth is the depth the code reaches. for programs
+// that come from outside, like an image
+void check_program(ProgramView p);
+
+// the highest whole power compile's strength reduction turns into squarings
+// and multiplications
+inline constexpr uint32_t max_power = 32;
+
+// what the strength reducing compile rewrote
+struct Rewrites {
+  // x ^ n for a whole 0 <= n <= max_power, as squarings and multiplications
+  // by x. x has to be a variable, number or constant unless n is a power
+  // of two, since the code has no way to reuse a value
+  uint32_t powers{};
+  // x / c as x * (1 / c) for a number c that is a power of two, where both
+  // round the same
+  uint32_t reciprocals{};
+  // sums of terms c * x ^ k in one variable x, with any c that doesn't
+  // depend on x, put in horner form
+  uint32_t polynomials{};
+
+  bool operator==(const Rewrites &) const = default;
+};
+
+// compile, then strength reduce what was compiled and count what was
+// rewritten in applied. multiplications round differently from pow and
+// horner form sums in a different order, so results can be a few ulp off
+// the plain program's. meant for the binary floating point evaluators, the
+// decimal ones round every multiplication to the scale
+Program compile(std::span<const Word> s, Rewrites &applied);
+
+// how a scalar walk treats the arms of a conditional. select evaluates
+// both and picks one without a branch, the same as the compiled columns,
+// so an arm that throws throws either way. short_circuit only evaluates
+// the arm it takes, which is faster on the walk even when the branch is a
+// coin flip
+enum struct Conditionals : uint8_t { select, short_circuit };
+
+template <typename T> struct Binding {
+  std::string_view name;
+  T value;
+};
+
+inline double to_double(const Number &n) noexcept {
+  return double(n.num) / double(n.den);
+}
+// i has no real value, modes that support it handle it themselves
+inline double to_double(Constant::Types t) noexcept {
+  switch (t) {
+    using enum Constant::Types;
+  case pi:
+    return std::numbers::pi;
+  case e:
+    return std::numbers::e;
+  case tau:
+    return 2 * std::numbers::pi;
+  case i:
+    break;
+  }
+  return std::numeric_limits<double>::quiet_NaN();
+}
+
+// how many rows run_blocks hands to a mode at once. small enough that
+// max_depth blocks stay in L1 for typical formulas
+inline constexpr size_t block_rows = 256;
+
+// words a subtree needs before fork_join_walk hands parts of it to other
+// threads, below that the fork costs more than the walk
+inline constexpr size_t fork_cutoff = 4096;
+
+namespace detail {
+template <typename Mode>
+auto walk_span(const Word *it, const Word *end, Mode &mode) ->
+    typename Mode::value_type;
+
+template <typename Mode>
+auto walk_item(const Word *&it, const Word *end, Mode &mode) ->
+    typename Mode::value_type {
+  const Word &w = *it++;
+  switch (w.type) {
+    using enum WordType;
+  case Number:
+    return mode.number(w.num);
+  case Constant:
+    return mode.constant(w.con.type);
+  case Variable:
+    return mode.variable(w.var);
+  case Unary: {
+    auto v = walk_item(it, end, mode);
+    return mode.unary(w.un.op, std::move(v));
+  }
+  case Binary: {
+    auto mid = &w + w.bin.second_arg;
+    if (mid <= &w || mid > end)
+      throw std::runtime_error("Malformed prefix expression");
+    it = end;
+    if (w.bin.op == Binary::Ops::assign)
+      return walk_span(mid, end, mode);
+    auto lhs = walk_span(&w + 1, mid, mode);
+    auto rhs = walk_span(mid, end, mode);
+    return mode.binary(w.bin.op, std::move(lhs), std::move(rhs));
+  }
+  case Function: {
+    auto close = &w + w.fn.size - 1;
+    if (close <= &w || close >= end)
+      throw std::runtime_error("Malformed function call");
+    it = close + 1;
+    if (Function::arity(w.fn.op) == 1)
+      return mode.function(w.fn.op, walk_span(&w + 1, close, mode));
+    auto mid = &w + w.fn.second_arg;
+    if (mid <= &w + 1 || mid >= close)
+      throw std::runtime_error("Malformed function call");
+    auto a = walk_span(&w + 1, mid - 1, mode);
+    auto b = walk_span(mid, close, mode);
+    return mode.function(w.fn.op, std::move(a), std::move(b));
+  }
+  case Ternary: {
+    auto a = &w + w.ter.second_arg, b = &w + w.ter.third_arg;
+    if (a <= &w + 1 || b <= a + 1 || b >= end)
+      throw std::runtime_error("Malformed conditional");
+    it = end;
+    auto cond = walk_span(&w + 1, a, mode);
+    // modes with short_circuit set only walk the arm they take
+    if constexpr (requires { mode.short_circuit; }) {
+      if (mode.short_circuit)
+        return mode.truth(cond) ? walk_span(a, b - 1, mode)
+                                : walk_span(b, end, mode);
+    }
+    auto then = walk_span(a, b - 1, mode);
+    auto other = walk_span(b, end, mode);
+    return mode.select(std::move(cond), std::move(then), std::move(other));
+  }
+  case Token:
+    break;
+  }
+  throw std::runtime_error("Unparsed token in expression");
+}
+
+// juxtaposed terms multiply, a Binary takes the rest of the span as its
+// second argument
+template <typename Mode>
+auto walk_span(const Word *it, const Word *end, Mode &mode) ->
+    typename Mode::value_type {
+  if (it == end)
+    throw std::runtime_error("Empty term in expression");
+  auto result = walk_item(it, end, mode);
+  while (it != end) {
+    auto next = walk_item(it, end, mode);
+    result = mode.binary(Binary::Ops::mul, std::move(result), std::move(next));
+  }
+  return result;
+}
+} // namespace detail
+
+// evaluates the prefix form directly, one word at a time. Mode supplies
+// number, constant, variable, unary, binary, function (with one or two
+// arguments) and select(cond, a, b) for its value_type. both arms of a
+// conditional are evaluated unless the mode has a short_circuit member
+// that is set, then only the arm truth(cond) picks is
+template <typename Mode>
+auto walk(std::span<const Word> s, Mode &mode) -> typename Mode::value_type {
+  FCALC_TRACE_SCOPE(evaluate);
+  return detail::walk_span(s.data(), s.data() + s.size(), mode);
+}
+
+// runs p over rows a block at a time. stack slot n of the program maps to
+// slot n of the mode, binary ops leave their result in the lower slot and
+// the result of every block ends up in slot 0. functions find their
+// arguments in slot s and up and leave the result in s, select finds the
+// condition in s and the arms in s + 1 and s + 2
+template <typename Mode>
+void run_blocks(ProgramView p, size_t rows, Mode &mode) {
+  FCALC_TRACE_SCOPE(evaluate);
+  for (size_t row = 0; row < rows; row += block_rows) {
+    size_t n = std::min(block_rows, rows - row);
+    uint32_t top = 0;
+    for (auto &ins : p.code) {
+      switch (ins.type) {
+        using enum WordType;
+      case Number:
+        mode.number(top++, p.numbers[ins.arg], n);
+        break;
+      case Constant:
+        mode.constant(top++, Constant::Types(ins.op), n);
+        break;
+      case Variable:
+        mode.variable(top++, ins.arg, row, n);
+        break;
+      case Unary:
+        mode.unary(Unary::Ops(ins.op), top - 1, n);
+        break;
+      case Binary:
+        --top;
+        mode.binary(Binary::Ops(ins.op), top - 1, top, n);
+        break;
+      case Function:
+        top -= Function::arity(Function::Ops(ins.op)) - 1;
+        mode.function(Function::Ops(ins.op), top - 1, n);
+        break;
+      case Ternary:
+        top -= 2;
+        mode.select(top - 1, n);
+        break;
+      case Token:
+        break;
+      }
+    }
+    mode.store(row, n);
+  }
+}
+} // namespace fcalc
@@ -1,10 +1,14 @@
 #pragma once
 
+#include "fast_calc/alloc.hpp"
 #include "fast_calc/smol_str.hpp"
 #include <cstdint>
+#include <expected>
 #include <fmt/format.h>
 #include <span>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 #include <vector>
 
 namespace fcalc {
@@ -63,15 +67,21 @@ struct Variable {
   Variable(std::string_view s) : s(s) {}
   bool operator==(const Variable &t) const noexcept { return s == t.s; }
 };
+// square is never parsed, compile's strength reduction makes it for powers
 struct Unary {
-  enum struct Ops { minus, sqrt } op;
+  enum struct Ops { minus, sqrt, square } op;
   Unary() = default;
   Unary(Ops t) : op(t) {}
   bool operator==(const Unary &t) const noexcept { return op == t.op; }
 };
+// precedence follows the order of Ops, the comparisons bind looser than
+// anything arithmetic and give 1 or 0
 struct Binary {
   enum struct Ops : uint8_t {
     assign,
+    eq,
+    lt,
+    gt,
     add,
     sub,
     mul,
@@ -84,6 +94,12 @@ struct Binary {
     switch (o) {
     case assign:
       return "assign";
+    case eq:
+      return "eq";
+    case lt:
+      return "lt";
+    case gt:
+      return "gt";
     case add:
       return "add";
     case sub:
@@ -101,12 +117,61 @@ struct Binary {
 
   // this is an offset that points to the second argument
   // ie + 2e 1, second_arg = 3
-  uint8_t second_arg{};
+  uint32_t second_arg{};
   Binary() = default;
   Binary(Ops t) : op(t) {}
   bool operator==(const Binary &t) const noexcept { return op == t.op; }
 };
 
+// a call like min(a, b) runs from the Function word through the ")" token
+// that closes it, size words in all. the arguments are parsed in place in
+// between, separated by "," tokens, and second_arg is the offset of the
+// second one like it is for Binary
+struct Function {
+  enum struct Ops : uint8_t { sin, cos, log, exp, abs, min, max } op;
+  uint32_t second_arg{};
+  uint32_t size{};
+
+  static constexpr uint8_t arity(Ops o) noexcept {
+    return o == Ops::min || o == Ops::max ? 2 : 1;
+  }
+  friend inline std::string_view format_as(Ops o) noexcept {
+    switch (o) {
+    case Ops::sin:
+      return "sin";
+    case Ops::cos:
+      return "cos";
+    case Ops::log:
+      return "log";
+    case Ops::exp:
+      return "exp";
+    case Ops::abs:
+      return "abs";
+    case Ops::min:
+      return "min";
+    case Ops::max:
+      return "max";
+    }
+    return "unknown";
+  }
+
+  Function() = default;
+  Function(Ops t) : op(t) {}
+  bool operator==(const Function &t) const noexcept { return op == t.op; }
+};
+
+// cond ? a : b, looser than every Binary but assign and right associative.
+// the "?" becomes this word in front of the condition, a starts at
+// second_arg and runs up to the ":" token in front of third_arg, and b
+// takes the rest of the span like the rhs of a Binary. a condition is true
+// when it isn't 0, nan included
+struct Ternary {
+  uint32_t second_arg{};
+  uint32_t third_arg{};
+  Ternary() = default;
+  bool operator==(const Ternary &) const noexcept { return true; }
+};
+
 struct Word {
   Word() : num{0, 0}, type(WordType::Number) {}
 
@@ -126,7 +191,7 @@ struct Word {
   case Type:                                                                   \
     new (&member) struct Type(w.member);                                       \
     break;
-  Word(const Word &w) : type(w.type) {
+  Word(const Word &w) : type(w.type), offset(w.offset) {
     switch (type) {
       using enum WordType;
 #include "wordTypeX"
@@ -137,7 +202,7 @@ struct Word {
   case Type:                                                                   \
     new (&member) struct Type(std::move(w.member));                            \
     break;
-  Word(Word &&w) : type(std::move(w.type)) {
+  Word(Word &&w) : type(std::move(w.type)), offset(w.offset) {
     switch (type) {
       using enum WordType;
 #include "wordTypeX"
@@ -167,6 +232,7 @@ struct Word {
     a.type = b.type;
     std::memcpy(&b._raw, tmp, 16);
     b.type = tmp_type;
+    std::swap(a.offset, b.offset);
   }
 
   Word &operator=(Word other) {
@@ -193,6 +259,8 @@ struct Word {
     Variable var;
     Unary un;
     Binary bin;
+    Function fn;
+    Ternary ter;
     // this exists to avoid Wclass-memaccess
     char _raw[sizeof(tok)];
   };
@@ -200,10 +268,77 @@ struct Word {
   static_assert(sizeof(Token) == 16, "Token size has changed");
 
   WordType type;
+  // byte offset in the text it was tokenized from, for error messages. it
+  // sits in what would otherwise be padding
+  uint32_t offset{};
 };
-std::vector<Word> tokenize(std::string_view);
+static_assert(sizeof(Word) == 24, "Word size has changed");
+// counted through alloc.hpp
+using Words = std::vector<Word, Allocator<Word>>;
+
+Words tokenize(std::string_view);
 void parse(std::span<Word> s);
 void resolve(std::span<Word> s);
+
+// what the try_ functions return instead of throwing. it's a code and an
+// offset, the text is only put together if someone asks for it
+struct ParseError {
+  enum struct Code : uint8_t {
+    empty,
+    // doesn't fit in 64 bits
+    bad_number,
+    // parentheses only come with function calls
+    unexpected_token,
+    // an operator with nothing to apply to on one side
+    missing_operand,
+    // = only works as "variable = expression"
+    misplaced_assign,
+    // min(1) or sin(1, 2)
+    bad_arity,
+    unclosed_call,
+    // a "?" without its ":" or the other way around
+    unmatched_conditional,
+  } code;
+  // byte offset into the input. try_parse takes it from the offending
+  // Word::offset, so it's only meaningful for words from a tokenizer
+  uint32_t offset;
+
+  friend const char *format_as(Code c) noexcept {
+    switch (c) {
+    case Code::empty:
+      return "empty expression";
+    case Code::bad_number:
+      return "number out of range";
+    case Code::unexpected_token:
+      return "unexpected token";
+    case Code::missing_operand:
+      return "missing operand";
+    case Code::misplaced_assign:
+      return "can only assign to a single variable";
+    case Code::bad_arity:
+      return "wrong number of arguments";
+    case Code::unclosed_call:
+      return "unclosed function call";
+    case Code::unmatched_conditional:
+      return "? and : don't match";
+    }
+    return "unknown error";
+  }
+  // pass the input to quote the text around offset
+  std::string message(std::string_view input = {}) const;
+};
+
+std::expected<Words, ParseError> try_tokenize(std::string_view);
+// the same, reusing the storage of words
+std::expected<void, ParseError> try_tokenize(std::string_view,
+                                             Words &words);
+// also checks that every operator has its operands, which parse assumes
+std::expected<void, ParseError> try_parse(std::span<Word> s);
+// try_tokenize and try_parse in one
+std::expected<Words, ParseError> try_read(std::string_view);
+// the same, reusing the storage of words
+std::expected<void, ParseError> try_read(std::string_view,
+                                         Words &words);
 } // namespace fcalc
 
 #ifdef FCALC_FMT_FORMAT
@@ -268,6 +403,9 @@ template <> struct fmt::formatter<fcalc::Unary> : formatter<std::string_view> {
     case fcalc::Unary::Ops::sqrt:
       result = "√";
       break;
+    case fcalc::Unary::Ops::square:
+      result = "²";
+      break;
     }
     return formatter<std::string_view>::format(result, ctx);
   }
@@ -297,11 +435,28 @@ template <> struct fmt::formatter<fcalc::Binary> : formatter<std::string_view> {
     case assign:
       result = "=";
       break;
+    case eq:
+      result = "==";
+      break;
+    case lt:
+      result = "<";
+      break;
+    case gt:
+      result = ">";
+      break;
     }
     return formatter<std::string_view>::format(result, ctx);
   }
 };
 
+template <>
+struct fmt::formatter<fcalc::Function> : formatter<std::string_view> {
+  constexpr auto format(const fcalc::Function &f, format_context &ctx) const
+      -> format_context::iterator {
+    return formatter<std::string_view>::format(format_as(f.op), ctx);
+  }
+};
+
 template <> struct fmt::formatter<fcalc::Word> : formatter<std::string_view> {
   constexpr auto format(const fcalc::Word &w, format_context &ctx) const
       -> format_context::iterator {
@@ -319,6 +474,10 @@ template <> struct fmt::formatter<fcalc::Word> : formatter<std::string_view> {
       return fmt::format_to(ctx.out(), "{}", w.un);
     case Binary:
       return fmt::format_to(ctx.out(), "{}", w.bin);
+    case Function:
+      return fmt::format_to(ctx.out(), "{}", w.fn);
+    case Ternary:
+      return fmt::format_to(ctx.out(), "?");
     }
     return fmt::format_to(ctx.out(), "?");
   }
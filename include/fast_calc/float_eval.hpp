@@ -0,0 +1,56 @@
+#pragma once
+
+#include "fast_calc/eval.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace fcalc {
+// the kernels evaluate_float runs, picked once from what the cpu supports.
+// generic is whatever the build targets, sse2 on plain x86-64. they all
+// give the same bits, and a cpu that runs one runs the ones before it
+enum struct FloatIsa : uint8_t { generic, avx2, avx512 };
+FloatIsa float_isa() noexcept;
+// floats per vector
+unsigned float_lanes(FloatIsa isa) noexcept;
+
+inline const char *format_as(FloatIsa isa) noexcept {
+  switch (isa) {
+  case FloatIsa::generic:
+    return "generic";
+  case FloatIsa::avx2:
+    return "avx2";
+  case FloatIsa::avx512:
+    return "avx512";
+  }
+  return "unknown";
+}
+
+// the block evaluation in single precision, twice the rows per vector of
+// the double one. numbers and constants are rounded to float once, every
+// operation rounds to float. sin, cos, log and exp are done in double on
+// the block and rounded back. vars are bound in the order of
+// Program::variables
+void evaluate_float(ProgramView p, std::span<const float *const> vars,
+                    float *out, size_t rows);
+// the same on the kernels for isa, which can't be past float_isa()
+void evaluate_float(ProgramView p, std::span<const float *const> vars,
+                    float *out, size_t rows, FloatIsa isa);
+
+// how far float results were from double on the rows that were checked.
+// a row where double gives exactly 0 and float doesn't counts as inf, and
+// so does a nan on only one side
+struct FloatError {
+  double max_relative = 0;
+  size_t worst_row = 0;
+  size_t samples = 0;
+
+  void merge(const FloatError &o) noexcept;
+};
+
+// evaluate_float, then every sample_every-th row again in double from the
+// same float inputs. sample_every = 1 checks every row
+FloatError evaluate_float(ProgramView p, std::span<const float *const> vars,
+                          float *out, size_t rows, size_t sample_every);
+} // namespace fcalc
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "fast_calc/eval.hpp"
+#include "fast_calc/work_pool.hpp"
+
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+namespace fcalc {
+namespace detail {
+template <typename Mode>
+auto fork_join_span(const Word *begin, const Word *end, Mode &mode,
+                    WorkPool &pool, size_t cutoff) ->
+    typename Mode::value_type;
+
+// a run of operands evaluated by halves on the pool, until the words left
+// are under the cutoff
+template <typename Mode, typename Operand, typename T>
+void fork_join_operands(std::span<const Operand> operands, std::span<T> values,
+                        Mode &mode, WorkPool &pool, size_t cutoff) {
+  if (operands.size() == 1 ||
+      size_t(operands.front().end - operands.back().begin) <= cutoff) {
+    for (size_t k = 0; k != operands.size(); ++k)
+      values[k] = fork_join_span(operands[k].begin, operands[k].end, mode,
+                                 pool, cutoff);
+    return;
+  }
+  size_t half = operands.size() / 2;
+  pool.invoke(
+      [&] {
+        fork_join_operands(operands.first(half), values.first(half), mode,
+                           pool, cutoff);
+      },
+      [&] {
+        fork_join_operands(operands.subspan(half), values.subspan(half), mode,
+                           pool, cutoff);
+      });
+}
+
+// parsed chains lean left, so a + b - c + d is a spine of Binary words each
+// holding the rest of the chain as lhs and one operand as rhs. the rhs
+// operands never depend on each other, so they are gathered off the spine,
+// evaluated in parallel and folded back together in order
+template <typename Mode>
+auto fork_join_span(const Word *begin, const Word *end, Mode &mode,
+                    WorkPool &pool, size_t cutoff) ->
+    typename Mode::value_type {
+  using T = typename Mode::value_type;
+  auto splits = [&](const Word *b, const Word *e) {
+    return size_t(e - b) > cutoff && b->type == WordType::Binary &&
+           b->bin.op != Binary::Ops::assign;
+  };
+  if (size_t(end - begin) > cutoff && begin->type == WordType::Binary &&
+      begin->bin.op == Binary::Ops::assign) {
+    auto mid = begin + begin->bin.second_arg;
+    if (mid <= begin || mid > end)
+      throw std::runtime_error("Malformed prefix expression");
+    return fork_join_span(mid, end, mode, pool, cutoff);
+  }
+  if (!splits(begin, end))
+    return walk_span(begin, end, mode);
+
+  // a Binary always takes the rest of its span, so each lhs that starts
+  // with one is that Binary and nothing else
+  struct Operand {
+    const Word *begin, *end;
+  };
+  std::vector<const Word *> spine;
+  // the rhs of each spine word from the top down, then the innermost lhs
+  std::vector<Operand> operands;
+  for (const Word *node = begin, *node_end = end;;) {
+    auto mid = node + node->bin.second_arg;
+    if (mid <= node || mid > node_end)
+      throw std::runtime_error("Malformed prefix expression");
+    spine.push_back(node);
+    operands.push_back({mid, node_end});
+    if (!splits(node + 1, mid)) {
+      operands.push_back({node + 1, mid});
+      break;
+    }
+    node_end = mid;
+    ++node;
+  }
+  std::vector<T> values(operands.size());
+  fork_join_operands(std::span<const Operand>(operands), std::span<T>(values),
+                     mode, pool, cutoff);
+
+  T result = std::move(values.back());
+  for (size_t k = spine.size(); k-- != 0;)
+    result = mode.binary(spine[k]->bin.op, std::move(result),
+                         std::move(values[k]));
+  return result;
+}
+} // namespace detail
+
+// walk on a WorkPool. spans past cutoff words are split, smaller ones are
+// walked on whichever thread picked them up, so mode gets called from
+// several threads at once and has to be fine with that
+template <typename Mode>
+auto fork_join_walk(std::span<const Word> s, Mode &mode, WorkPool &pool,
+                    size_t cutoff = fork_cutoff) -> typename Mode::value_type {
+  FCALC_TRACE_SCOPE(evaluate);
+  return detail::fork_join_span(s.data(), s.data() + s.size(), mode, pool,
+                                cutoff);
+}
+} // namespace fcalc
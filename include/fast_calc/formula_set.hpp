@@ -0,0 +1,60 @@
+#pragma once
+
+#include "fast_calc/eval.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace fcalc {
+// many formulas over the same rows in one pass. every formula is compiled
+// into steps that read their operands straight from the variable columns,
+// from a shared set of temporary blocks or as constants folded in at
+// compile time, so a row block is loaded once and then stays in cache
+// while every formula runs over it
+struct FormulaSet {
+  struct Operand {
+    enum struct Kind : uint8_t { temp, variable, immediate } kind;
+    // temp block or variable slot
+    uint32_t index{};
+    double value{};
+  };
+  // dst = a op b, b is unused for unary ops and one argument functions.
+  // a Ternary is dst = a ? b : c
+  struct Step {
+    WordType type;
+    uint8_t op{};
+    uint32_t dst{};
+    Operand a, b, c;
+  };
+  struct Result {
+    // one past the formula's last step
+    uint32_t end{};
+    Operand value;
+  };
+  std::vector<Step> steps;
+  // one per formula, in order
+  std::vector<Result> results;
+  // the variables of every formula in order of first appearance, columns
+  // are bound in the same order
+  std::vector<SmolString> variables;
+  uint32_t temps{};
+};
+
+// each formula must already be parsed, throws if one can't have a real
+// value. assignments are evaluated for their right hand side
+FormulaSet compile_set(std::span<const std::span<const Word>> formulas);
+
+enum struct Layout : uint8_t {
+  // out[row * formulas + f]
+  row_major,
+  // out[f * rows + row]
+  column_major,
+};
+
+// vars are bound in the order of FormulaSet::variables. the results are
+// the same bits evaluate gives for each formula's Program
+void evaluate(const FormulaSet &set, std::span<const double *const> vars,
+              double *out, size_t rows, Layout layout);
+} // namespace fcalc
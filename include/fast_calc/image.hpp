@@ -0,0 +1,110 @@
+#pragma once
+
+#include "fast_calc/eval.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace fcalc {
+// compiled programs in one flat file that is used straight from mmap.
+// everything is addressed by byte offsets from the start of the file, so
+// nothing needs fixing up after mapping. the layout is native endian and
+// every section starts 8 byte aligned
+namespace image {
+inline constexpr char magic[8] = {'F', 'C', 'A', 'L', 'C', 'I', 'M', 'G'};
+// 2 added the comparisons, which renumbered Binary::Ops
+inline constexpr uint32_t version = 2;
+inline constexpr uint32_t byte_order = 0x01020304;
+inline constexpr uint32_t no_symbol = ~uint32_t{};
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t size;
+  uint32_t formula_count;
+  uint32_t symbol_count;
+  // Formula[formula_count]
+  uint64_t formulas;
+  // Symbol[symbol_count]
+  uint64_t symbols;
+  // checksum of everything after the header, checked by Image::verify
+  uint64_t payload_checksum;
+  // checksum of the header up to here, checked on every load
+  uint64_t header_checksum;
+};
+
+struct Formula {
+  // Instr[code_size]
+  uint64_t code;
+  // Number[number_count]
+  uint64_t numbers;
+  // uint32_t symbol ids [variable_count], in Program::variables order
+  uint64_t variables;
+  uint32_t code_size;
+  uint32_t number_count;
+  uint32_t variable_count;
+  uint32_t max_depth;
+  uint32_t target;
+  uint32_t _pad;
+};
+
+struct Symbol {
+  uint64_t offset;
+  uint64_t size;
+};
+
+uint64_t checksum(std::span<const char> data) noexcept;
+} // namespace image
+
+// interns every variable name across programs and writes the image
+void write_image(const std::string &path, std::span<const Program> programs);
+
+class Image {
+public:
+  // maps path and checks the header, the rest is only read when it's used
+  explicit Image(const std::string &path);
+  Image(Image &&other) noexcept;
+  Image &operator=(Image other) noexcept;
+  ~Image();
+
+  size_t size() const noexcept { return header().formula_count; }
+  // checked with check_program the first time it's asked for, throws if
+  // it's not safe to run
+  ProgramView program(size_t i) const;
+  // symbol ids of program(i)'s variable slots
+  std::span<const uint32_t> variables(size_t i) const;
+  std::optional<std::string_view> target(size_t i) const;
+  std::string_view symbol(uint32_t id) const;
+
+  // checksums the whole payload the first time, which touches every page
+  // of the file, and remembers the answer
+  bool verify() const noexcept;
+
+  friend void swap(Image &a, Image &b) noexcept {
+    std::swap(a.base, b.base);
+    std::swap(a.bytes, b.bytes);
+    std::swap(a.checked, b.checked);
+  }
+
+private:
+  const char *base{};
+  size_t bytes{};
+  // what verify and program have found so far, shared by every thread
+  struct Checked;
+  std::unique_ptr<Checked> checked;
+
+  const image::Header &header() const noexcept {
+    return *reinterpret_cast<const image::Header *>(base);
+  }
+  const image::Formula &formula(size_t i) const;
+  template <typename T>
+  std::span<const T> section(uint64_t offset, uint64_t count) const;
+};
+} // namespace fcalc
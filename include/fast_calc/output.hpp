@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace fcalc {
+enum struct OutputFormat : uint8_t {
+  // a line per row with the columns separated by spaces, each value in the
+  // shortest form that reads back to the same double
+  text,
+  // every column's doubles as they are, little endian, one column after
+  // another for each write. nothing records how many rows a write had, so
+  // with more than one column a reader has to know that to split them
+  binary,
+  // an arrow ipc stream with a non-nullable float64 field per column and a
+  // record batch per write, which arrow readers take without parsing
+  arrow,
+};
+
+// text is buffered up to this before it's written out
+inline constexpr size_t output_buffer = 1 << 20;
+
+// results going out in bulk, instead of a formatted print per value. text
+// goes through std::to_chars into one reused buffer, binary and arrow write
+// the columns straight from where they are
+class ResultWriter {
+public:
+  // a name per column, only arrow puts them anywhere
+  ResultWriter(std::FILE *out, OutputFormat format,
+               std::span<const std::string_view> names);
+  ResultWriter(const ResultWriter &) = delete;
+  // finishes if that wasn't done yet, ignoring errors
+  ~ResultWriter();
+
+  // rows of every column, in the order of names. for binary with more than
+  // one column the reader has to be told rows, see OutputFormat::binary
+  void write(std::span<const double *const> columns, size_t rows);
+  // writes what's buffered and, for arrow, the end of the stream. throws if
+  // anything couldn't be written
+  void finish();
+
+private:
+  void put(const void *data, size_t size);
+  void flush();
+
+  std::FILE *out;
+  OutputFormat format;
+  size_t columns;
+  bool finished = false;
+  std::vector<char> buffer;
+  size_t used = 0;
+};
+
+// the parse side of OutputFormat, for command lines. throws on anything else
+OutputFormat output_format(std::string_view name);
+} // namespace fcalc
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string_view>
+
+namespace fcalc {
+// lines per batch handed from one stage to the next, and batches a queue
+// holds before the stage feeding it has to wait
+inline constexpr size_t pipeline_batch = 256;
+inline constexpr size_t pipeline_depth = 8;
+
+struct StageStats {
+  std::string_view name;
+  uint64_t batches = 0;
+  // times the stage waited for input, and for room in its output queue
+  uint64_t starved = 0;
+  uint64_t blocked = 0;
+  // batches already waiting in the output queue, summed over every push.
+  // over batches it's the mean occupancy, near the depth means whatever
+  // comes next is the bottleneck
+  uint64_t queued = 0;
+  // time spent on the batches, not counting the waits
+  std::chrono::nanoseconds busy{};
+};
+
+struct PipelineResult {
+  size_t lines = 0;
+  size_t failed = 0;
+  // read, tokenize, parse, evaluate and write
+  std::array<StageStats, 5> stages;
+};
+
+// calc's file job with every phase on its own thread: lines are read,
+// tokenized, parsed, evaluated and written out in batches that pass
+// through bounded single producer single consumer queues, so a stage that
+// gets ahead waits instead of piling up batches. the throughput is that of
+// the slowest stage rather than the sum of them. empty lines are skipped,
+// everything else gets a line of output in input order, the same as
+// evaluating the lines one by one. batches are handed back to the reader
+// once written, so the line buffers and words get reused, but compiling
+// still builds a program per line and a failure formats its message. an
+// exception in any stage ends the run, and is rethrown here once every
+// thread has stopped
+PipelineResult run_pipeline(std::istream &in, std::ostream &out,
+                            size_t batch = pipeline_batch,
+                            size_t depth = pipeline_depth);
+} // namespace fcalc
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "fast_calc/eval.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+namespace fcalc {
+class WorkPool;
+
+// plain double evaluation, i is rejected since it has no real value
+double evaluate(std::span<const Word> s,
+                std::span<const Binding<double>> vars = {},
+                Conditionals conditionals = Conditionals::select);
+// one huge expression split across pool, see fork_join_walk
+double evaluate(std::span<const Word> s, WorkPool &pool,
+                std::span<const Binding<double>> vars = {},
+                size_t cutoff = fork_cutoff);
+// vars are bound in the order of Program::variables
+void evaluate(ProgramView p, std::span<const double *const> vars,
+              double *out, size_t rows);
+// the same bits, with the rows split into chunks spread over pool. each
+// thread runs a chunk with its own scratch, and chunks start on a cache
+// line of out so no two threads write the same line. 0 takes chunk_rows(p)
+void evaluate(ProgramView p, std::span<const double *const> vars,
+              double *out, size_t rows, WorkPool &pool, size_t chunk = 0);
+// rows per chunk so that its columns fit in a 1 MiB L2, in whole blocks
+size_t chunk_rows(ProgramView p) noexcept;
+
+// a program for evaluating one row at a time. numbers are already doubles
+// and subtrees without variables are folded, with the same arithmetic as
+// the walk so the results match it to the bit
+struct ScalarProgram {
+  struct Op {
+    WordType type;
+    uint8_t op{};
+    // variable slot
+    uint32_t arg{};
+    double value{};
+  };
+  std::vector<Op> code;
+  // same order as Program::variables
+  std::vector<SmolString> variables;
+  uint32_t max_depth{};
+};
+
+// s must already be parsed, throws if it can't have a real value
+ScalarProgram compile_scalar(std::span<const Word> s);
+// vars are bound in the order of ScalarProgram::variables
+double evaluate(const ScalarProgram &p, std::span<const double> vars);
+
+// reductions of a formula over its rows that never write an output column.
+// each block is reduced while it is still in L1 and only the partials are
+// kept, the pool versions give every thread a range of rows and combine
+// what they come back with
+struct Summary {
+  double sum = 0;
+  double min = std::numeric_limits<double>::infinity();
+  double max = -std::numeric_limits<double>::infinity();
+  size_t count = 0;
+
+  double mean() const noexcept { return sum / double(count); }
+  void merge(const Summary &o) noexcept;
+};
+
+// counts is bins even buckets over [lo, hi)
+struct Histogram {
+  double lo{}, hi{};
+  std::vector<uint64_t> counts;
+  uint64_t below = 0, above = 0, nan = 0;
+
+  void merge(const Histogram &o) noexcept;
+};
+
+Summary summarize(ProgramView p, std::span<const double *const> vars,
+                  size_t rows);
+Summary summarize(ProgramView p, std::span<const double *const> vars,
+                  size_t rows, WorkPool &pool);
+Histogram histogram(ProgramView p, std::span<const double *const> vars,
+                    size_t rows, double lo, double hi, size_t bins);
+Histogram histogram(ProgramView p, std::span<const double *const> vars,
+                    size_t rows, double lo, double hi, size_t bins,
+                    WorkPool &pool);
+} // namespace fcalc
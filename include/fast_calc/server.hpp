@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fcalc {
+// calc --serve speaks length-prefixed frames over a unix or tcp socket. a
+// frame is a native endian uint32_t byte count of what follows, then a kind
+// (or a status, for responses) byte and the body. responses come back in
+// request order, so a client can pipeline as many requests as it likes.
+// an address is tcp:<ipv4>:<port> for tcp, anything else is a socket path
+namespace serve {
+enum struct Kind : uint8_t {
+  // u32 count, then count times u32 length and the expression
+  batch,
+  // the expression, which is kept as a formula for rows requests
+  define,
+  // u32 formula, u32 rows, then rows doubles for each variable in turn
+  rows,
+  // u32 formula, which a later define may then reuse
+  forget,
+};
+
+enum struct Status : uint8_t {
+  ok,
+  // u8 ParseError::Code, u32 offset
+  parse_error,
+  // the rest of the frame is a message
+  error,
+};
+// ok bodies:
+//   batch:  count results of u8 Status and 8 bytes, holding the double for
+//           ok, code and offset for parse_error and nothing for error
+//   define: u32 formula, u32 variable count, then u32 length and the name
+//           of each variable in column order
+//   rows:   rows doubles
+//   forget: nothing
+
+inline constexpr uint32_t max_frame = 64 << 20;
+// the most rows a rows request can ask for, so the answer fits in a frame
+inline constexpr uint32_t max_rows = (max_frame - 1) / sizeof(double);
+// formulas stay defined until they're forgotten or the connection closes,
+// a connection can have this many at once
+inline constexpr uint32_t max_formulas = 1024;
+inline constexpr size_t result_size = 9;
+
+// request builders for clients, each appends one frame to out
+void put_batch(std::vector<char> &out,
+               std::span<const std::string_view> expressions);
+void put_define(std::vector<char> &out, std::string_view expression);
+void put_rows(std::vector<char> &out, uint32_t formula, size_t rows,
+              std::span<const double *const> columns);
+void put_forget(std::vector<char> &out, uint32_t formula);
+
+// blocking client side. connect returns a socket descriptor the caller
+// closes, the others throw once the server has gone away
+int connect(const std::string &address);
+void write_all(int fd, std::span<const char> bytes);
+// the next response into frame, without its length
+void read_frame(int fd, std::vector<char> &frame);
+} // namespace serve
+
+// an epoll loop that owns the socket and reads requests, and a fixed pool
+// of workers that answer them. a connection is with at most one worker at
+// a time, which handles every whole frame it has buffered and writes the
+// responses out in one go
+class Server {
+public:
+  // listens on address, replacing whatever socket file is there. port 0
+  // takes any free port
+  Server(const std::string &address, unsigned workers);
+  Server(const Server &) = delete;
+  ~Server();
+
+  // where clients connect, with the port filled in
+  const std::string &address() const noexcept;
+
+  // returns once stop() is called
+  void run();
+  // safe to call from another thread or a signal handler
+  void stop() noexcept;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+};
+} // namespace fcalc
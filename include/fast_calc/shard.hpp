@@ -0,0 +1,61 @@
+#pragma once
+
+#include "fast_calc/fcalc.hpp"
+#include "fast_calc/server.hpp"
+
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fcalc {
+// expressions per batch and rows per rows request, big enough that a
+// frame's round trip is small next to the work in it
+inline constexpr size_t shard_lines = 4096;
+inline constexpr size_t shard_rows = 64 << 10;
+// shards a connection has sent ahead of the reply it's waiting for, enough
+// to keep a worker busy through the round trip
+inline constexpr size_t shard_depth = 4;
+
+struct ShardResult {
+  serve::Status status;
+  // for ok
+  double value{};
+  // for parse_error, with a byte offset into the expression
+  ParseError error{};
+};
+
+// splits work over calc --serve workers in other processes or on other
+// machines, and puts the answers back together in input order. shards go
+// round robin and every connection keeps shard_depth of them in flight, so
+// neither side stalls and neither holds more than that window of the job.
+// after a throw the connections are out of step, so start over with a new
+// coordinator
+class Coordinator {
+public:
+  // connects to every address, throws if one can't be reached
+  explicit Coordinator(std::span<const std::string> addresses);
+  Coordinator(const Coordinator &) = delete;
+  ~Coordinator();
+
+  size_t size() const noexcept { return fds.size(); }
+
+  // one result per expression. a shard holds up to lines expressions, fewer
+  // when that many wouldn't fit in a frame, and an expression too long for
+  // a frame on its own throws before anything is sent
+  std::vector<ShardResult>
+  evaluate(std::span<const std::string_view> expressions,
+           size_t lines = shard_lines);
+  // formula over rows, columns holds one column per name, in shards of up to
+  // shard rows and no more than fit in a frame. throws on a parse error, a
+  // variable without a column or anything a worker reports
+  std::vector<double> evaluate(std::string_view formula,
+                               std::span<const std::string_view> names,
+                               std::span<const double *const> columns,
+                               size_t rows, size_t shard = shard_rows);
+
+private:
+  std::vector<int> fds;
+};
+} // namespace fcalc
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "fast_calc/alloc.hpp"
+
 #include <cstddef>
 #include <cstring>
 #include <fmt/core.h>
@@ -14,7 +16,7 @@ public:
     if (is_buffer(sv.size())) {
       std::memcpy(buffer, sv.data(), sv.size());
     } else {
-      str = static_cast<char *>(::operator new(sv.size()));
+      str = static_cast<char *>(allocate(sv.size()));
       std::memcpy(str, sv.data(), sv.size());
     }
     _size = sv.size();
@@ -24,7 +26,7 @@ public:
     if (s.is_buffer()) {
       std::memcpy(buffer, s.buffer, sizeof(buffer));
     } else {
-      str = static_cast<char *>(::operator new(s.size()));
+      str = static_cast<char *>(allocate(s.size()));
       std::memcpy(str, s.str, s.size());
     }
     _size = s.size();
@@ -64,16 +66,14 @@ public:
   constexpr bool operator==(SmolString const &other) const noexcept {
     if (size() != other.size())
       return false;
-    if (is_buffer())
-      return std::memcmp(buffer, other.buffer, sizeof(buffer));
-    return std::memcmp(str, other.str, size());
+    return std::memcmp(data(), other.data(), size()) == 0;
   }
 
   constexpr operator std::string_view() const noexcept { return view(); }
 
   constexpr ~SmolString() {
     if (!is_buffer()) {
-      ::operator delete(str);
+      deallocate(str, size());
     }
   }
 
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "fast_calc/eval.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+
+namespace fcalc {
+struct ScalarProgram;
+
+// calls before a formula gets compiled, most formulas never get there
+inline constexpr uint64_t tier_up_calls = 1000;
+
+// runs formulas on the prefix walk until they have been called hot_calls
+// times, then compiles them to a ScalarProgram on a background thread and
+// switches over once it's ready. the walk costs nothing up front and the
+// compiled form gives the same results, so callers can't tell which one
+// they got
+class TieredEvaluator {
+  struct State;
+
+public:
+  // 0 compiles every formula as soon as it's loaded
+  explicit TieredEvaluator(uint64_t hot_calls = tier_up_calls);
+  TieredEvaluator(const TieredEvaluator &) = delete;
+  // formulas still waiting to be compiled stay on the walk
+  ~TieredEvaluator();
+
+  // a parsed formula, cheap to copy and safe to call from several threads.
+  // it must not outlive the evaluator that loaded it
+  class Formula {
+  public:
+    double operator()(std::span<const Binding<double>> vars = {}) const;
+    // calls made on the walk, counting stops once it's compiled
+    uint64_t calls() const noexcept;
+    bool compiled() const noexcept;
+
+  private:
+    friend class TieredEvaluator;
+    Formula(std::shared_ptr<State> state, TieredEvaluator *owner)
+        : state(std::move(state)), owner(owner) {}
+    std::shared_ptr<State> state;
+    TieredEvaluator *owner;
+  };
+
+  // throws on a parse error
+  Formula load(std::string_view formula);
+  // waits until everything that went hot so far is compiled
+  void drain();
+
+private:
+  void promote(std::shared_ptr<State> state);
+
+  uint64_t hot_calls;
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+};
+} // namespace fcalc
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+// phase tracing for the pipeline. build with -DFCALC_TRACE to compile the
+// FCALC_TRACE_SCOPE markers in, then turn recording on and off at runtime
+// with set_enabled. while disabled a marker costs one relaxed load
+namespace fcalc::trace {
+enum struct Phase : uint8_t { tokenize, parse, compile, evaluate };
+
+inline const char *format_as(Phase p) noexcept {
+  switch (p) {
+  case Phase::tokenize:
+    return "tokenize";
+  case Phase::parse:
+    return "parse";
+  case Phase::compile:
+    return "compile";
+  case Phase::evaluate:
+    return "evaluate";
+  }
+  return "unknown";
+}
+
+extern std::atomic<bool> enabled_flag;
+inline bool enabled() noexcept {
+  return enabled_flag.load(std::memory_order_relaxed);
+}
+void set_enabled(bool on) noexcept;
+
+inline uint64_t now() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// appends to this thread's ring buffer, events are dropped while it's full
+void record(Phase p, uint64_t begin, uint64_t end) noexcept;
+
+// drains every thread's buffer into chrome trace event json, which loads in
+// chrome://tracing or perfetto. otherData.dropped counts the events lost
+// since the last flush
+std::string flush();
+// events lost to full buffers since the last flush
+uint64_t dropped() noexcept;
+
+struct Scope {
+  explicit Scope(Phase p) noexcept : phase(p), active(enabled()) {
+    if (active)
+      begin = now();
+  }
+  Scope(const Scope &) = delete;
+  ~Scope() {
+    if (active)
+      record(phase, begin, now());
+  }
+
+  Phase phase;
+  bool active;
+  uint64_t begin{};
+};
+} // namespace fcalc::trace
+
+#ifdef FCALC_TRACE
+#define FCALC_TRACE_SCOPE(phase)                                               \
+  ::fcalc::trace::Scope fcalc_trace_scope_(::fcalc::trace::Phase::phase)
+#else
+#define FCALC_TRACE_SCOPE(phase)
+#endif
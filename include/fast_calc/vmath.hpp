@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+// exp, log, sin and cos without calling into libm per element. the kernels
+// are branch free polynomials written once for double and once for a vector
+// of four, so the column versions run four rows per step and give the same
+// bits as the scalar ones. they stay within a couple of ulp of libm, sin
+// and cos hand |x| > 1e6 back to libm since the reduction runs out of bits
+namespace fcalc::vmath {
+double exp(double x) noexcept;
+double log(double x) noexcept;
+double sin(double x) noexcept;
+double cos(double x) noexcept;
+
+// in place over n values
+void exp(double *x, size_t n) noexcept;
+void log(double *x, size_t n) noexcept;
+void sin(double *x, size_t n) noexcept;
+void cos(double *x, size_t n) noexcept;
+} // namespace fcalc::vmath
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <type_traits>
+
+namespace fcalc {
+// fork-join on a fixed set of threads. every worker has its own deque, it
+// pushes and pops its forked jobs at the back while idle workers steal from
+// the front, so a thread mostly works on the subtree it forked itself.
+// threads outside the pool share one more deque and help while they wait
+class WorkPool {
+public:
+  // workers besides the calling thread, 0 runs everything inline
+  explicit WorkPool(unsigned workers);
+  WorkPool(const WorkPool &) = delete;
+  ~WorkPool();
+
+  // threads that can work on an invoke, counting the caller
+  unsigned size() const noexcept;
+
+  // runs a here and b wherever a thread is free, and returns once both are
+  // done. the first exception either of them throws is rethrown
+  template <typename A, typename B> void invoke(A &&a, B &&b) {
+    Forked<std::remove_reference_t<B>> job(b);
+    push(job);
+    std::exception_ptr error;
+    try {
+      a();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    join(job);
+    if (!error)
+      error = job.error;
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+private:
+  struct Job {
+    explicit Job(void (*run)(Job &)) : run(run) {}
+    void (*run)(Job &);
+    std::atomic<bool> done{false};
+    std::exception_ptr error;
+  };
+  template <typename F> struct Forked : Job {
+    F &f;
+    explicit Forked(F &f)
+        : Job([](Job &j) { static_cast<Forked &>(j).f(); }), f(f) {}
+  };
+
+  void push(Job &job);
+  // runs job here if nobody took it yet, or helps out until it's done
+  void join(Job &job);
+
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+};
+} // namespace fcalc
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <span>
 #include <string_view>
 #include <utility>
 
@@ -8,6 +11,7 @@ namespace re {
 namespace detail {
 typedef void PatternPtr;
 typedef void MatchPtr;
+typedef void JitStackPtr;
 } // namespace detail
 
 enum struct Options : unsigned {
@@ -70,6 +74,30 @@ inline Options &operator^=(Options &lhs, Options rhs) {
   return lhs;
 }
 
+enum struct Jit : bool { off, on };
+
+// machine stack for JIT matching. without one pcre2 runs JIT code on 32K of
+// the calling thread's stack, which heavy backtracking can run out of. a
+// stack must only be used by one thread at a time
+struct JitStack {
+  JitStack(size_t start_size, size_t max_size);
+  JitStack(const JitStack &) = delete;
+  JitStack &operator=(const JitStack &) = delete;
+  ~JitStack();
+
+  detail::JitStackPtr *internal{};
+};
+
+// offsets of one capture group in the subject. a group that took no part
+// in the match has both set to npos
+struct Match {
+  size_t begin, end;
+  bool matched() const noexcept { return begin != std::string_view::npos; }
+  std::string_view in(std::string_view subject) const noexcept {
+    return matched() ? subject.substr(begin, end - begin) : std::string_view{};
+  }
+};
+
 struct MatchEnd {
   MatchEnd() = default;
   ~MatchEnd() = default;
@@ -114,7 +142,8 @@ private:
 struct Matches {
   ~Matches();
   Matches(Matches &&other)
-      : internal{other.internal}, pattern(other.pattern), string(other.string) {
+      : internal{other.internal}, pattern(other.pattern), string(other.string),
+        stack(other.stack), jit(other.jit) {
     other.internal = nullptr;
     other.pattern = nullptr;
   }
@@ -125,19 +154,57 @@ private:
   detail::MatchPtr *internal{};
   detail::PatternPtr *pattern{};
   std::string_view string;
+  JitStack *stack{};
+  bool jit{};
   Matches(detail::MatchPtr *i, detail::PatternPtr *pattern,
-          std::string_view string)
-      : internal{i}, pattern{pattern}, string{string} {}
+          std::string_view string, JitStack *stack, bool jit)
+      : internal{i}, pattern{pattern}, string{string}, stack{stack}, jit{jit} {
+  }
 
   friend struct Pattern;
   friend struct MatchIterator;
 };
 
 struct Pattern {
-  Pattern(std::string_view pattern, Options options = Options::null);
+  // with Jit::on the pattern is also JIT compiled, falling back to the
+  // interpreter where pcre2 was built without JIT support. JIT matching
+  // skips pcre2's utf check of the subject, so with Options::utf the input
+  // has to be valid utf-8
+  Pattern(std::string_view pattern, Options options = Options::null,
+          Jit jit = Jit::on);
+  Pattern(const Pattern &) = delete;
+  Pattern &operator=(const Pattern &) = delete;
   ~Pattern();
-  Matches match(std::string_view str);
+  // the match data comes from a per-thread pool and goes back to it when
+  // the Matches is destroyed, so matching doesn't allocate once warm
+  Matches match(std::string_view str, JitStack *stack = nullptr);
+
+  // the bulk versions write groups() Matches per match, group 0 first, so
+  // out[k * groups() + g] is group g of match k. no allocation happens and
+  // nothing is written past out. both throw if out can't hold one match
+
+  // every match from offset on, until out is full. offset is left where
+  // the next call should carry on, or npos once the subject is used up.
+  // returns the number of matches written
+  size_t match_all(std::string_view subject, std::span<Match> out,
+                   size_t &offset, JitStack *stack = nullptr);
+  // every match of each subject, back to back. ends[i] is one past the
+  // last match of subjects[i]. stops before the first subject whose
+  // matches don't fit in out and returns how many subjects were finished
+  size_t match_all(std::span<const std::string_view> subjects,
+                   std::span<Match> out, std::span<size_t> ends,
+                   JitStack *stack = nullptr);
+
+  bool jitted() const noexcept { return jit; }
+  uint32_t groups() const noexcept { return pairs; }
 
   detail::PatternPtr *internal{};
+
+private:
+  uint32_t pairs{};
+  bool jit{};
+  size_t scan(detail::MatchPtr *data, std::string_view subject,
+              std::span<Match> out, size_t &offset, JitStack *stack);
+  void check_room(std::span<Match> out) const;
 };
 } // namespace re
\ No newline at end of file
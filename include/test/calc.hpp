@@ -1,56 +1,109 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <new>
 #include <span>
 #include <string>
 #include <string_view>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <fmt/format.h>
 
 namespace calc {
+// bump allocator that every node of an expression lives in. nodes are
+// trivially destructible and strings are copied into the pool, so nothing
+// is freed one by one: the whole tree goes when the pool is reset or dies
+class Pool {
+public:
+  Pool() = default;
+  Pool(Pool &&other) noexcept
+      : chunks(std::move(other.chunks)), cur(std::exchange(other.cur, 0)),
+        end(std::exchange(other.end, 0)) {}
+  Pool &operator=(Pool &&other) noexcept {
+    chunks = std::move(other.chunks);
+    cur = std::exchange(other.cur, 0);
+    end = std::exchange(other.end, 0);
+    return *this;
+  }
+
+  template <typename T, typename... Args> T *make(Args &&...args) {
+    static_assert(std::is_trivially_destructible_v<T>);
+    return new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+  }
+  std::string_view copy(std::string_view s);
+  // drops every node but keeps the largest chunk for reuse
+  void reset() noexcept;
+
+private:
+  struct Chunk {
+    std::unique_ptr<std::byte[]> data;
+    size_t size;
+  };
+  std::vector<Chunk> chunks;
+  uintptr_t cur{}, end{};
+
+  void *allocate(size_t size, size_t align) {
+    uintptr_t p = (cur + align - 1) & ~(align - 1);
+    if (p + size > end)
+      return grow(size, align);
+    cur = p + size;
+    return reinterpret_cast<void *>(p);
+  }
+  void *grow(size_t size, size_t align);
+};
+
 struct Word;
-using WordPtr = std::unique_ptr<Word>;
+// nodes are owned by the Pool they were made in
+using WordPtr = Word *;
 struct Word {
-  Word() = default;
-  Word(WordPtr &&child) : child(std::move(child)) {}
-  virtual std::string format() const = 0;
-  virtual ~Word() = default;
-  WordPtr child;
+  // stands in for RTTI, see word_cast
+  enum struct Kind : uint8_t {
+    token,
+    number,
+    constant,
+    variable,
+    unary,
+    binary
+  } kind;
+  explicit Word(Kind k) noexcept : kind(k) {}
+  std::string format() const;
+  WordPtr child{};
 };
 
+template <typename T> T *word_cast(Word *w) noexcept {
+  return w && w->kind == T::tag ? static_cast<T *>(w) : nullptr;
+}
+template <typename T> const T *word_cast(const Word *w) noexcept {
+  return w && w->kind == T::tag ? static_cast<const T *>(w) : nullptr;
+}
+
 struct Token : Word {
-  std::string s;
-  Token(std::string &&s) : s(std::move(s)) {}
-  Token(std::string_view s) : s(std::move(s)) {}
-  Token(Token &&other) : s(std::move(other.s)) {}
-  Token &operator=(Token &&t) {
-    std::swap(s, t.s);
-    return *this;
-  }
-  Token &operator=(const Token &t) {
-    s = t.s;
-    return *this;
-  }
+  static constexpr Kind tag = Kind::token;
+  std::string_view s;
+  Token(std::string_view s) noexcept : Word(tag), s(s) {}
   bool operator==(const Token &t) const noexcept { return s == t.s; }
-  std::string format() const override final { return s; }
+  std::string format() const { return std::string(s); }
 };
 
 struct Number : Word {
-  Number(int32_t num) noexcept : num(num), den(1) {
+  static constexpr Kind tag = Kind::number;
+  Number(int32_t num) noexcept : Word(tag), num(num), den(1) {
     if (num < 0)
       den = -1;
   }
-  Number(uint64_t num, int64_t den) noexcept : num(num), den(den) {}
-  Number() = default;
-  Number(Number &&n) : Word(std::move(n.child)), num(n.num), den(n.den) {}
+  Number(uint64_t num, int64_t den) noexcept : Word(tag), num(num), den(den) {}
+  Number() noexcept : Word(tag) {}
   uint64_t num;
   int64_t den;
   bool operator==(const Number &t) const noexcept {
     return num == t.num && den == t.den;
   }
-  std::string format() const override final {
+  std::string format() const {
     if (den % 10 == 0 || den == 1)
       return fmt::format("{}", double(num) / double(den));
     else
@@ -59,13 +112,12 @@ struct Number : Word {
 };
 
 struct Constant : Word {
+  static constexpr Kind tag = Kind::constant;
   enum struct Types { pi, e, tau, i } type;
-  Constant() = default;
-  Constant(WordPtr child) : Word(std::move(child)) {}
-  Constant(Constant &&n) : Word(std::move(n.child)), type(n.type) {}
-  Constant(Types t) : type(t) {}
+  Constant() noexcept : Word(tag) {}
+  Constant(Types t) noexcept : Word(tag), type(t) {}
   bool operator==(const Constant &t) const noexcept { return type == t.type; }
-  std::string format() const override final {
+  std::string format() const {
     std::string result = "unknown constant";
     switch (type) {
       using enum Types;
@@ -87,30 +139,20 @@ struct Constant : Word {
 };
 
 struct Variable : Word {
-  std::string s;
-  Variable(std::string &&s) : s(std::move(s)) {}
-  Variable(std::string_view s) : s(std::move(s)) {}
-  Variable(Token &&other) : s(std::move(other.s)) {}
-  Variable &operator=(Variable &&t) {
-    std::swap(s, t.s);
-    return *this;
-  }
-
-  Variable &operator=(const Variable &t) {
-    s = t.s;
-    return *this;
-  }
+  static constexpr Kind tag = Kind::variable;
+  std::string_view s;
+  Variable(std::string_view s) noexcept : Word(tag), s(s) {}
   bool operator==(const Variable &t) const noexcept { return s == t.s; }
-  std::string format() const override final { return fmt::format("({})", s); }
+  std::string format() const { return fmt::format("({})", s); }
 };
 
 struct Unary : Word {
+  static constexpr Kind tag = Kind::unary;
   enum struct Ops { minus, sqrt } op;
-  Unary() = default;
-  Unary(Ops t) : op(t) {}
-  Unary(Unary &&n) : Word(std::move(n.child)), op(n.op) {}
+  Unary() noexcept : Word(tag) {}
+  Unary(Ops t) noexcept : Word(tag), op(t) {}
   bool operator==(const Unary &t) const noexcept { return op == t.op; }
-  std::string format() const override final {
+  std::string format() const {
     std::string result = "unknown constant";
     switch (op) {
     case Ops::minus:
@@ -125,6 +167,7 @@ struct Unary : Word {
 };
 
 struct Binary : Word {
+  static constexpr Kind tag = Kind::binary;
   enum struct Ops : int8_t {
     assign,
     add,
@@ -134,12 +177,11 @@ struct Binary : Word {
     exp,
   } op;
 
-  Binary() = default;
-  Binary(Ops t) : op(t) {}
-  Binary(Binary &&n) : Word(std::move(n.child)), op(n.op) {}
+  Binary() noexcept : Word(tag) {}
+  Binary(Ops t) noexcept : Word(tag), op(t) {}
   bool operator==(const Binary &t) const noexcept { return op == t.op; }
-  WordPtr lhs, rhs;
-  std::string format() const override final {
+  WordPtr lhs{}, rhs{};
+  std::string format() const {
     std::string result = "unknown constant";
     switch (op) {
       using enum Ops;
@@ -166,7 +208,26 @@ struct Binary : Word {
   }
 };
 
-std::vector<WordPtr> tokenize(std::string_view);
+inline std::string Word::format() const {
+  switch (kind) {
+  case Kind::token:
+    return static_cast<const Token *>(this)->format();
+  case Kind::number:
+    return static_cast<const Number *>(this)->format();
+  case Kind::constant:
+    return static_cast<const Constant *>(this)->format();
+  case Kind::variable:
+    return static_cast<const Variable *>(this)->format();
+  case Kind::unary:
+    return static_cast<const Unary *>(this)->format();
+  case Kind::binary:
+    return static_cast<const Binary *>(this)->format();
+  }
+  return "unknown word";
+}
+
+// the returned words, and the tree parse builds out of them, live in pool
+std::vector<WordPtr> tokenize(std::string_view, Pool &pool);
 WordPtr parse(std::vector<WordPtr> s);
 WordPtr resolve(WordPtr s);
 } // namespace calc
@@ -190,15 +251,6 @@ template <> struct fmt::formatter<calc::Word *> : fmt::formatter<std::string> {
   }
 };
 
-template <> struct fmt::formatter<calc::WordPtr> : fmt::formatter<std::string> {
-  auto format(calc::WordPtr const &a, format_context &ctx) const {
-    if (a)
-      return fmt::formatter<std::string>::format(a->format(), ctx);
-    else
-      return fmt::formatter<std::string>::format("", ctx);
-  }
-};
-
 template <>
 struct fmt::formatter<calc::Binary::Ops> : fmt::formatter<std::string_view> {
   constexpr auto format(calc::Binary::Ops a, format_context &ctx) const {
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <fast_calc/fcalc.hpp>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// random inputs shared by the benchmarks
+template <typename T> using int_dist = std::uniform_int_distribution<T>;
+
+inline const char *ops[] = {"-", "+", "*", "/", "^"};
+const char *rand_op(auto &r) {
+  std::uniform_int_distribution<uint32_t> rand(0, 4);
+  return ops[rand(r)];
+}
+inline const char *constants[] = {"pi", "tau", "i"};
+const char *rand_con(auto &r) {
+  std::uniform_int_distribution<uint32_t> rand(0, 2);
+  return constants[rand(r)];
+}
+void rand_term(std::string &expression, auto &r, uint32_t term_max) {
+  std::uniform_int_distribution<uint32_t> rand(1, term_max);
+  uint32_t term_length = rand(r);
+  std::uniform_int_distribution<uint32_t> rbool(0, 1);
+  for (uint32_t i = 0; i != term_length; ++i) {
+    if (rbool(r)) {
+      expression.append(rand_con(r));
+    } else {
+      std::uniform_int_distribution<uint32_t> i(1, 50);
+      expression.append(std::to_string(i(r)));
+    }
+  }
+}
+
+inline std::string gen_expression(uint32_t terms, uint32_t term_max) {
+  std::random_device r;
+  std::default_random_engine e(r());
+  std::string expression;
+  expression.reserve(3 * term_max / 2 * terms);
+  for (uint32_t i = 0; i != terms - 1; i++) {
+    rand_term(expression, e, term_max);
+    expression.append(rand_op(e));
+  }
+  rand_term(expression, e, term_max);
+  return expression;
+}
+
+// single character variable names for gen_formula, none of them lex as an
+// operator, a delimiter or a constant
+inline constexpr std::string_view var_names =
+    "abcdfghjklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ!#$%&;@[]_{}|~";
+
+// like gen_expression, but every term is one of the first `vars` var_names
+// or a small number, so the result can be evaluated over columns
+inline std::string gen_formula(uint32_t terms, uint32_t vars,
+                               std::string_view ops = "+-*/") {
+  std::random_device r;
+  std::default_random_engine e(r());
+  int_dist<uint32_t> rop(0, ops.size() - 1);
+  int_dist<uint32_t> rvar(0, vars - 1);
+  int_dist<uint32_t> rnum(1, 50);
+  int_dist<uint32_t> rterm(0, 3);
+  std::string expression;
+  for (uint32_t i = 0; i != terms; i++) {
+    if (i != 0) {
+      expression.push_back(' ');
+      expression.push_back(ops[rop(e)]);
+      expression.push_back(' ');
+    }
+    if (rterm(e) != 0)
+      expression.push_back(var_names[rvar(e)]);
+    else
+      expression.append(std::to_string(rnum(e)));
+  }
+  return expression;
+}
+
+namespace f_gen {
+
+fcalc::Word ran_op(auto &r) {
+  int_dist<uint32_t> t(1, 5);
+  using enum fcalc::Binary::Ops;
+  return fcalc::Binary(fcalc::Binary::Ops(t(r)));
+}
+
+fcalc::Word ran_val(auto &r) {
+  int_dist<uint32_t> rbool(0, 1);
+  if (rbool(r)) {
+    int_dist<uint32_t> i(1, 100);
+    return fcalc::Number(i(r));
+  } else {
+    int_dist<uint32_t> t(1, 4);
+    switch (t(r)) {
+      using enum fcalc::Constant::Types;
+    case 1:
+      return fcalc::Constant(pi);
+    case 2:
+      return fcalc::Constant(e);
+    case 3:
+      return fcalc::Constant(tau);
+    case 4:
+      return fcalc::Constant(i);
+    default:
+      return fcalc::Constant(pi);
+    }
+  }
+}
+inline auto gen_exp(uint32_t terms, uint32_t term_size) {
+  std::vector<fcalc::Word> w;
+  w.reserve(terms * term_size);
+  std::random_device _r;
+  std::default_random_engine r(_r());
+  auto gen_term = [&]() {
+    for (uint32_t i = 0; i != term_size; ++i) {
+      w.push_back(ran_val(r));
+    }
+  };
+  for (uint32_t i = 0; i != terms - 1; ++i) {
+    gen_term();
+    w.push_back(ran_op(r));
+  }
+  gen_term();
+  return w;
+}
+} // namespace f_gen
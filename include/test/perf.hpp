@@ -0,0 +1,103 @@
+#pragma once
+
+#include <array>
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <linux/perf_event.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace perf_events {
+struct Event {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+constexpr uint64_t cache_miss(uint64_t cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+// cycles and instructions have to stay first, report() uses them for IPC
+inline constexpr std::array<Event, 5> events{{
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1d-misses", PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D)},
+    {"LLC-misses", PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_LL)},
+}};
+} // namespace perf_events
+
+// hardware counters around a benchmark loop through perf_event_open. every
+// event is opened on its own, so a machine that lacks one (LLC in most VMs)
+// still reports the rest, and when perf is off entirely (containers,
+// perf_event_paranoid) nothing is reported at all
+class PerfCounters {
+public:
+  PerfCounters() {
+    for (size_t i = 0; i != events.size(); ++i) {
+      perf_event_attr attr{};
+      attr.size = sizeof(attr);
+      attr.type = events[i].type;
+      attr.config = events[i].config;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format =
+          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+  }
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+  ~PerfCounters() {
+    for (int fd : fds) {
+      if (fd >= 0)
+        close(fd);
+    }
+  }
+
+  void start() {
+    for (int fd : fds) {
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+  }
+  void stop() {
+    for (int fd : fds) {
+      if (fd >= 0)
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+
+  // counts per byte and per token of input, per iteration. pass 0 for
+  // whichever one doesn't apply
+  void report(benchmark::State &state, double bytes, double tokens) {
+    double iter = double(state.iterations());
+    double counts[events.size()]{};
+    bool have[events.size()]{};
+    for (size_t i = 0; i != events.size(); ++i) {
+      uint64_t value[3];
+      if (fds[i] < 0 || read(fds[i], value, sizeof(value)) != sizeof(value) ||
+          value[2] == 0)
+        continue;
+      // scale up if the kernel had to multiplex the counters
+      counts[i] = double(value[0]) * double(value[1]) / double(value[2]);
+      have[i] = true;
+      std::string name = events[i].name;
+      if (bytes != 0)
+        state.counters[name + "/byte"] = counts[i] / iter / bytes;
+      if (tokens != 0)
+        state.counters[name + "/token"] = counts[i] / iter / tokens;
+    }
+    if (have[0] && have[1] && counts[0] != 0)
+      state.counters["IPC"] = counts[1] / counts[0];
+  }
+
+private:
+  static constexpr auto &events = perf_events::events;
+  std::array<int, events.size()> fds;
+};
@@ -0,0 +1,34 @@
+#include "alloc.hpp"
+
+#include <algorithm>
+#include <new>
+
+namespace fcalc {
+namespace {
+// trivially constructible, so access needs no init guard
+thread_local AllocStats stats;
+} // namespace
+
+AllocStats alloc_stats() noexcept { return stats; }
+
+void reset_alloc_stats() noexcept {
+  stats = {.live = stats.live, .peak = stats.live};
+}
+
+void *allocate(size_t size) {
+  void *p = ::operator new(size);
+  ++stats.allocations;
+  stats.bytes += size;
+  stats.live += int64_t(size);
+  stats.peak = std::max(stats.peak, stats.live);
+  return p;
+}
+
+void deallocate(void *p, size_t size) noexcept {
+  if (!p)
+    return;
+  ::operator delete(p, size);
+  ++stats.frees;
+  stats.live -= int64_t(size);
+}
+} // namespace fcalc
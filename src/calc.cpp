@@ -4,9 +4,9 @@
 #include <charconv>
 #include <cstdint>
 #include <exception>
+#include <memory>
 #include <ranges>
 #include <stdexcept>
-#include <type_traits>
 #include <utility>
 
 #include <ctre-unicode.hpp>
@@ -14,7 +14,7 @@
 
 namespace calc {
 namespace {
-Binary *bin_cast(WordPtr &w) { return dynamic_cast<Binary *>(w.get()); }
+Binary *bin_cast(WordPtr w) { return word_cast<Binary>(w); }
 inline auto str_cast(std::u8string_view str) noexcept {
   return std::string_view(reinterpret_cast<const char *>(str.data()),
                           str.size());
@@ -23,58 +23,48 @@ inline auto str_cast(std::string_view str) noexcept {
   return std::u8string_view(reinterpret_cast<const char8_t *>(str.data()),
                             str.size());
 }
-auto makeWordPtr(auto &&tok) {
-  using T = std::remove_cvref_t<decltype(tok)>;
-  return WordPtr(new T(std::move(tok)));
-};
-WordPtr makeCon(std::string_view tok) {
+WordPtr makeCon(std::string_view tok, Pool &pool) {
   if (tok == "pi" || tok == "π") {
-    return makeWordPtr(Constant(Constant::Types::pi));
+    return pool.make<Constant>(Constant::Types::pi);
   } else if (tok == "e") {
-    return makeWordPtr(Constant(Constant::Types::e));
+    return pool.make<Constant>(Constant::Types::e);
   } else if (tok == "tau" || tok == "τ") {
-    return makeWordPtr(Constant(Constant::Types::tau));
+    return pool.make<Constant>(Constant::Types::tau);
   } else if (tok == "i") {
-    return makeWordPtr(Constant(Constant::Types::i));
+    return pool.make<Constant>(Constant::Types::i);
   }
   throw std::runtime_error("Unexpected token");
 }
-WordPtr makeOp(std::string_view tok) {
+WordPtr makeOp(std::string_view tok, Pool &pool) {
   if (tok == "+") {
-    return makeWordPtr(Binary(Binary::Ops::add));
+    return pool.make<Binary>(Binary::Ops::add);
   } else if (tok == "-") {
-    return makeWordPtr(Binary(Binary::Ops::sub));
+    return pool.make<Binary>(Binary::Ops::sub);
   } else if (tok == "/") {
-    return makeWordPtr(Binary(Binary::Ops::div));
+    return pool.make<Binary>(Binary::Ops::div);
   } else if (tok == "*") {
-    return makeWordPtr(Binary(Binary::Ops::mul));
+    return pool.make<Binary>(Binary::Ops::mul);
   } else if (tok == "^") {
-    return makeWordPtr(Binary(Binary::Ops::exp));
+    return pool.make<Binary>(Binary::Ops::exp);
   } else if (tok == "=") {
-    return makeWordPtr(Binary(Binary::Ops::assign));
+    return pool.make<Binary>(Binary::Ops::assign);
   } else if (tok == "√") {
-    return makeWordPtr(Unary(Unary::Ops::sqrt));
+    return pool.make<Unary>(Unary::Ops::sqrt);
   }
   throw std::runtime_error("Unexpected token");
 }
-WordPtr makeVar(std::string_view tok) { return WordPtr(new Variable(tok)); }
-WordPtr makeNum(std::string_view num) {
+WordPtr makeVar(std::string_view tok, Pool &pool) {
+  return pool.make<Variable>(pool.copy(tok));
+}
+WordPtr makeNum(std::string_view num, Pool &pool) {
   uint64_t val;
   auto result = std::from_chars(num.data(), num.data() + num.size(), val);
   if (result.ec != std::errc{}) {
     throw std::runtime_error("number parsing failed");
   }
-  return WordPtr(new Number(val, 1));
+  return pool.make<Number>(val, 1);
 }
 
-int decimal_places(uint64_t i) {
-  int dec = 0;
-  while (i != 0) {
-    i %= 10;
-    ++dec;
-  }
-  return dec;
-}
 uint64_t ipow10(uint64_t b, uint64_t e) {
   while (e != 0) {
     b *= 10;
@@ -82,7 +72,7 @@ uint64_t ipow10(uint64_t b, uint64_t e) {
   }
   return b;
 }
-WordPtr makeDec(std::string_view num, std::string_view den) {
+WordPtr makeDec(std::string_view num, std::string_view den, Pool &pool) {
   uint64_t n;
   auto result = std::from_chars(num.data(), num.data() + num.size(), n);
   if (result.ec != std::errc{}) {
@@ -93,12 +83,39 @@ WordPtr makeDec(std::string_view num, std::string_view den) {
   if (result.ec != std::errc{}) {
     throw std::runtime_error("number parsing failed");
   }
-  auto dec = decimal_places(d);
-  return WordPtr(new Number(ipow10(n, dec) + d, dec));
+  return pool.make<Number>(ipow10(n, den.size()) + d,
+                           int64_t(ipow10(1, den.size())));
 }
 } // namespace
 
-std::vector<WordPtr> tokenize(std::string_view input) {
+std::string_view Pool::copy(std::string_view s) {
+  auto p = static_cast<char *>(allocate(s.size(), 1));
+  std::ranges::copy(s, p);
+  return {p, s.size()};
+}
+
+void Pool::reset() noexcept {
+  if (chunks.empty())
+    return;
+  auto largest = std::ranges::max_element(chunks, {}, &Chunk::size);
+  std::swap(*largest, chunks.front());
+  chunks.resize(1);
+  cur = reinterpret_cast<uintptr_t>(chunks.front().data.get());
+  end = cur + chunks.front().size;
+}
+
+void *Pool::grow(size_t size, size_t align) {
+  // chunks double so a big expression needs few of them
+  size_t chunk = chunks.empty() ? 4096 : chunks.back().size * 2;
+  while (chunk < size + align)
+    chunk *= 2;
+  chunks.push_back({std::make_unique_for_overwrite<std::byte[]>(chunk), chunk});
+  cur = reinterpret_cast<uintptr_t>(chunks.back().data.get());
+  end = cur + chunk;
+  return allocate(size, align);
+}
+
+std::vector<WordPtr> tokenize(std::string_view input, Pool &pool) {
   std::vector<WordPtr> result;
   constexpr auto tokenize =
       ctre::range<R"((\d+)(?:\.(\d+))?|([+\-*/^()=√])|(pi|tau|[ieπτ])|(\S))">;
@@ -107,16 +124,16 @@ std::vector<WordPtr> tokenize(std::string_view input) {
     if (auto num = match.get<1>()) {
       auto den = match.get<2>();
       if (!den) {
-        result.push_back(makeNum(str_cast(num)));
+        result.push_back(makeNum(str_cast(num), pool));
       } else {
-        result.push_back(makeDec(str_cast(num), str_cast(den)));
+        result.push_back(makeDec(str_cast(num), str_cast(den), pool));
       }
     } else if (auto op = match.get<3>()) {
-      result.push_back(makeOp(str_cast(op)));
+      result.push_back(makeOp(str_cast(op), pool));
     } else if (auto constant = match.get<4>()) {
-      result.push_back(makeCon(str_cast(constant)));
+      result.push_back(makeCon(str_cast(constant), pool));
     } else if (auto var = match.get<5>()) {
-      result.push_back(makeVar(str_cast(constant)));
+      result.push_back(makeVar(str_cast(var), pool));
     }
   }
   return result;
@@ -126,37 +143,44 @@ WordPtr parse(std::vector<WordPtr> s) {
   if (s.size() < 3) {
     return nullptr;
   }
+  // folds every op into its neighbours in one compacting pass: out is where
+  // the next surviving word goes, and the word before it is the lhs so far
   auto associate = [&](Binary::Ops op) {
+    size_t out = 0;
     for (size_t i = 0; i != s.size(); ++i) {
-      if (auto b = bin_cast(s[i]); b && b->op == op) {
-        b->rhs = std::move(s[i - 1]);
-        b->lhs = std::move(s[i + 1]);
-        s.erase(s.begin() + i + 1);
-        s.erase(s.begin() + i - 1);
-        --i;
+      if (auto b = bin_cast(s[i]);
+          b && b->op == op && out != 0 && i + 1 != s.size()) {
+        b->rhs = s[out - 1];
+        b->lhs = s[i + 1];
+        s[out - 1] = b;
+        ++i;
+      } else {
+        s[out++] = s[i];
       }
     }
+    s.resize(out);
   };
 
   std::ranges::reverse(s);
   associate(Binary::Ops::exp);
   std::ranges::reverse(s);
 
-  for (auto &&chunk : s | std::ranges::views::chunk_by([](auto &&a, auto &&b) {
-                        auto ab = bin_cast(a);
-                        auto a_b = !ab || ab->op == Binary::Ops::exp;
-                        auto bb = bin_cast(b);
-                        auto b_b = !bb || bb->op == Binary::Ops::exp;
-                        return a_b && b_b;
-                      })) {
-    Word *head = chunk.front().get();
-    for (auto &&word : chunk | std::views::drop(1)) {
-      head->child = std::move(word);
-      head = head->child.get();
+  // runs of values (exp counts as one by now) become chains through child
+  auto chains = [](WordPtr w) {
+    auto b = bin_cast(w);
+    return !b || b->op == Binary::Ops::exp;
+  };
+  size_t out = 0;
+  WordPtr tail = nullptr;
+  for (WordPtr w : s) {
+    if (tail && chains(tail) && chains(w)) {
+      tail->child = w;
+    } else {
+      s[out++] = w;
     }
+    tail = w;
   }
-  auto end = std::ranges::remove_if(s, [](auto &&a) { return !a.get(); });
-  s.erase(end.begin(), end.end());
+  s.resize(out);
 
   using enum Binary::Ops;
   std::ranges::reverse(s);
@@ -168,6 +192,6 @@ WordPtr parse(std::vector<WordPtr> s) {
   if (s.size() != 1) {
     throw std::runtime_error("Parsing error: more than one remains");
   }
-  return std::move(s.front());
+  return s.front();
 }
-} // namespace calc
\ No newline at end of file
+} // namespace calc
@@ -0,0 +1,318 @@
+#include "complex_eval.hpp"
+#include "fork_join.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fmt/format.h>
+#include <stdexcept>
+#include <vector>
+
+namespace fcalc {
+namespace {
+Complex complex_constant(Constant::Types t) noexcept {
+  if (t == Constant::Types::i)
+    return {0, 1};
+  return to_double(t);
+}
+
+// principal branches like std::complex, abs is the modulus
+Complex complex_function(Function::Ops op, Complex a) {
+  switch (op) {
+    using enum Function::Ops;
+  case sin:
+    return std::sin(a);
+  case cos:
+    return std::cos(a);
+  case log:
+    // same - 0 as √, log(- 1) should be πi
+    return std::log(Complex(a.real(), a.imag() + 0.0));
+  case exp:
+    return std::exp(a);
+  case abs:
+    return std::abs(a);
+  case min:
+  case max:
+    break;
+  }
+  throw std::runtime_error(
+      fmt::format("{} takes two arguments", format_as(op)));
+}
+// complex numbers have no order, min and max only take real ones
+Complex complex_function(Function::Ops op, Complex a, Complex b) {
+  if (op != Function::Ops::min && op != Function::Ops::max)
+    throw std::runtime_error(
+        fmt::format("{} takes one argument", format_as(op)));
+  if (a.imag() != 0 || b.imag() != 0)
+    throw std::runtime_error(
+        fmt::format("{} is only defined for real arguments", format_as(op)));
+  bool less = op == Function::Ops::min ? b.real() < a.real()
+                                       : a.real() < b.real();
+  return less ? b : a;
+}
+
+// == compares both parts, < and > only order real numbers
+Complex complex_compare(Binary::Ops op, Complex a, Complex b) {
+  if (op == Binary::Ops::eq)
+    return a == b ? 1 : 0;
+  if (a.imag() != 0 || b.imag() != 0)
+    throw std::runtime_error("< and > are only defined for real arguments");
+  bool r = op == Binary::Ops::lt ? a.real() < b.real() : a.real() > b.real();
+  return r ? 1 : 0;
+}
+
+struct ScalarMode {
+  using value_type = Complex;
+  std::span<const Binding<Complex>> vars;
+
+  Complex number(const Number &n) const noexcept { return to_double(n); }
+  Complex constant(Constant::Types t) const noexcept {
+    return complex_constant(t);
+  }
+  Complex variable(const Variable &v) const {
+    for (auto &b : vars) {
+      if (b.name == v.s.view())
+        return b.value;
+    }
+    throw std::runtime_error(fmt::format("Unbound variable: {}", v.s.view()));
+  }
+  Complex unary(Unary::Ops op, Complex a) const noexcept {
+    if (op == Unary::Ops::minus)
+      return -a;
+    if (op == Unary::Ops::square)
+      return a * a;
+    // + 0.0 turns -0 into 0, otherwise √-4 lands on the wrong side of the cut
+    return std::sqrt(Complex(a.real(), a.imag() + 0.0));
+  }
+  Complex binary(Binary::Ops op, Complex a, Complex b) const {
+    switch (op) {
+      using enum Binary::Ops;
+    case eq:
+    case lt:
+    case gt:
+      return complex_compare(op, a, b);
+    case add:
+      return a + b;
+    case sub:
+      return a - b;
+    case mul:
+      return a * b;
+    case div:
+      return a / b;
+    case exp:
+      return std::pow(a, b);
+    case assign:
+      break;
+    }
+    throw std::runtime_error("Unexpected assignment");
+  }
+  Complex function(Function::Ops op, Complex a) const {
+    return complex_function(op, a);
+  }
+  Complex function(Function::Ops op, Complex a, Complex b) const {
+    return complex_function(op, a, b);
+  }
+  Complex select(Complex c, Complex a, Complex b) const noexcept {
+    return c != Complex(0) ? a : b;
+  }
+};
+
+// the kernels below work on one block, the result goes into a. a and b are
+// always different stack slots so they never alias
+
+void add(double *__restrict ar, double *__restrict ai,
+         const double *__restrict br, const double *__restrict bi, size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    ar[i] += br[i];
+    ai[i] += bi[i];
+  }
+}
+void sub(double *__restrict ar, double *__restrict ai,
+         const double *__restrict br, const double *__restrict bi, size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    ar[i] -= br[i];
+    ai[i] -= bi[i];
+  }
+}
+void mul(double *__restrict ar, double *__restrict ai,
+         const double *__restrict br, const double *__restrict bi, size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    double re = ar[i] * br[i] - ai[i] * bi[i];
+    double im = ar[i] * bi[i] + ai[i] * br[i];
+    ar[i] = re;
+    ai[i] = im;
+  }
+}
+// textbook division without smith's rescaling, so |b| near the edges of the
+// double range overflows where std::complex would not
+void div(double *__restrict ar, double *__restrict ai,
+         const double *__restrict br, const double *__restrict bi, size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    double d = br[i] * br[i] + bi[i] * bi[i];
+    double re = (ar[i] * br[i] + ai[i] * bi[i]) / d;
+    double im = (ai[i] * br[i] - ar[i] * bi[i]) / d;
+    ar[i] = re;
+    ai[i] = im;
+  }
+}
+// there's no closed form worth vectorizing here, so pow stays per element
+void pow(double *__restrict ar, double *__restrict ai,
+         const double *__restrict br, const double *__restrict bi, size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    auto r = std::pow(Complex(ar[i], ai[i]), Complex(br[i], bi[i]));
+    ar[i] = r.real();
+    ai[i] = r.imag();
+  }
+}
+void neg(double *__restrict ar, double *__restrict ai, size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    ar[i] = -ar[i];
+    ai[i] = -ai[i];
+  }
+}
+// per element like pow, the complex functions don't vectorize either
+void function(Function::Ops op, double *__restrict ar, double *__restrict ai,
+              const double *__restrict br, const double *__restrict bi,
+              size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    Complex a(ar[i], ai[i]);
+    auto r = Function::arity(op) == 1
+                 ? complex_function(op, a)
+                 : complex_function(op, a, Complex(br[i], bi[i]));
+    ar[i] = r.real();
+    ai[i] = r.imag();
+  }
+}
+void compare(Binary::Ops op, double *__restrict ar, double *__restrict ai,
+             const double *__restrict br, const double *__restrict bi,
+             size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    auto r = complex_compare(op, {ar[i], ai[i]}, {br[i], bi[i]});
+    ar[i] = r.real();
+    ai[i] = r.imag();
+  }
+}
+// c is true where either part isn't 0
+void select(double *__restrict cr, double *__restrict ci,
+            const double *__restrict ar, const double *__restrict ai,
+            const double *__restrict br, const double *__restrict bi,
+            size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    bool take = cr[i] != 0 || ci[i] != 0;
+    cr[i] = take ? ar[i] : br[i];
+    ci[i] = take ? ai[i] : bi[i];
+  }
+}
+// mul with b = a, which restrict doesn't allow
+void square(double *__restrict ar, double *__restrict ai, size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    double re = ar[i] * ar[i] - ai[i] * ai[i];
+    double im = ar[i] * ai[i] + ai[i] * ar[i];
+    ar[i] = re;
+    ai[i] = im;
+  }
+}
+// principal root, same branch cut as ScalarMode::unary
+void sqrt(double *__restrict ar, double *__restrict ai, size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    double r = std::sqrt(ar[i] * ar[i] + ai[i] * ai[i]);
+    double re = std::sqrt((r + ar[i]) * 0.5);
+    double im = std::copysign(std::sqrt((r - ar[i]) * 0.5), ai[i] + 0.0);
+    ar[i] = re;
+    ai[i] = im;
+  }
+}
+
+struct BlockMode {
+  std::span<const ComplexColumnView> vars;
+  ComplexColumn out;
+  std::vector<double> scratch;
+
+  double *re(uint32_t slot) noexcept {
+    return scratch.data() + 2 * block_rows * slot;
+  }
+  double *im(uint32_t slot) noexcept { return re(slot) + block_rows; }
+
+  void fill(uint32_t s, Complex v, size_t n) {
+    std::fill_n(re(s), n, v.real());
+    std::fill_n(im(s), n, v.imag());
+  }
+  void number(uint32_t s, const Number &v, size_t n) {
+    fill(s, to_double(v), n);
+  }
+  void constant(uint32_t s, Constant::Types t, size_t n) {
+    fill(s, complex_constant(t), n);
+  }
+  void variable(uint32_t s, uint32_t var, size_t row, size_t n) {
+    std::copy_n(vars[var].re + row, n, re(s));
+    std::copy_n(vars[var].im + row, n, im(s));
+  }
+  void unary(Unary::Ops op, uint32_t s, size_t n) {
+    if (op == Unary::Ops::minus)
+      neg(re(s), im(s), n);
+    else if (op == Unary::Ops::square)
+      square(re(s), im(s), n);
+    else
+      sqrt(re(s), im(s), n);
+  }
+  void binary(Binary::Ops op, uint32_t a, uint32_t b, size_t n) {
+    switch (op) {
+      using enum Binary::Ops;
+    case eq:
+    case lt:
+    case gt:
+      return compare(op, re(a), im(a), re(b), im(b), n);
+    case add:
+      return fcalc::add(re(a), im(a), re(b), im(b), n);
+    case sub:
+      return fcalc::sub(re(a), im(a), re(b), im(b), n);
+    case mul:
+      return fcalc::mul(re(a), im(a), re(b), im(b), n);
+    case div:
+      return fcalc::div(re(a), im(a), re(b), im(b), n);
+    case exp:
+      return fcalc::pow(re(a), im(a), re(b), im(b), n);
+    case assign:
+      break;
+    }
+    throw std::runtime_error("Unexpected assignment");
+  }
+  void function(Function::Ops op, uint32_t s, size_t n) {
+    // slot s + 1 can be past the scratch for one argument, so it's only
+    // formed when there is a second one
+    if (Function::arity(op) == 1)
+      return fcalc::function(op, re(s), im(s), nullptr, nullptr, n);
+    fcalc::function(op, re(s), im(s), re(s + 1), im(s + 1), n);
+  }
+  void select(uint32_t s, size_t n) {
+    fcalc::select(re(s), im(s), re(s + 1), im(s + 1), re(s + 2), im(s + 2), n);
+  }
+  void store(size_t row, size_t n) {
+    std::copy_n(re(0), n, out.re + row);
+    std::copy_n(im(0), n, out.im + row);
+  }
+};
+} // namespace
+
+Complex evaluate_complex(std::span<const Word> s,
+                         std::span<const Binding<Complex>> vars) {
+  ScalarMode mode{vars};
+  return walk(s, mode);
+}
+
+Complex evaluate_complex(std::span<const Word> s, WorkPool &pool,
+                         std::span<const Binding<Complex>> vars,
+                         size_t cutoff) {
+  ScalarMode mode{vars};
+  return fork_join_walk(s, mode, pool, cutoff);
+}
+
+void evaluate_complex(ProgramView p, std::span<const ComplexColumnView> vars,
+                      ComplexColumn out, size_t rows) {
+  if (vars.size() < p.variables)
+    throw std::runtime_error(fmt::format("Expected {} variable columns, got {}",
+                                         p.variables, vars.size()));
+  BlockMode mode{vars, out,
+                 std::vector<double>(2 * block_rows * p.max_depth)};
+  run_blocks(p, rows, mode);
+}
+} // namespace fcalc
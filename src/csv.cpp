@@ -0,0 +1,181 @@
+#include "csv.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fmt/format.h>
+#include <limits>
+#include <stdexcept>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace fcalc {
+namespace {
+constexpr uint32_t skip = ~uint32_t{};
+
+// bit k is set where p[k] is the delimiter or a newline, for n <= 64. sse2
+// has no vector compare to bit mask in the generic vector extensions, so
+// it's done with intrinsics, anything else goes byte by byte
+uint64_t structural(const char *p, size_t n, char delimiter) {
+#if defined(__SSE2__)
+  if (n == 64) {
+    auto d = _mm_set1_epi8(delimiter);
+    auto newline = _mm_set1_epi8('\n');
+    uint64_t mask = 0;
+    for (int k = 0; k != 4; ++k) {
+      auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * k));
+      auto hit =
+          _mm_or_si128(_mm_cmpeq_epi8(v, d), _mm_cmpeq_epi8(v, newline));
+      mask |= uint64_t(uint32_t(_mm_movemask_epi8(hit))) << (16 * k);
+    }
+    return mask;
+  }
+#endif
+  uint64_t mask = 0;
+  for (size_t k = 0; k != n; ++k)
+    mask |= uint64_t(p[k] == delimiter || p[k] == '\n') << k;
+  return mask;
+}
+
+std::string_view trim(const char *first, const char *last) {
+  while (first != last && *first == ' ')
+    ++first;
+  while (first != last && (last[-1] == ' ' || last[-1] == '\r'))
+    --last;
+  return {first, size_t(last - first)};
+}
+} // namespace
+
+CsvReader::CsvReader(const std::string &path, char delimiter)
+    : delimiter(delimiter) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error(
+        fmt::format("Could not open {}: {}", path, std::strerror(errno)));
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    throw std::runtime_error(fmt::format("No header in {}", path));
+  }
+  auto mapped = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED)
+    throw std::runtime_error(
+        fmt::format("Could not map {}: {}", path, std::strerror(errno)));
+  // read once front to back, so the kernel can read ahead further
+  ::madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+  base = static_cast<const char *>(mapped);
+  end = base + st.st_size;
+
+  auto newline = std::find(base, end, '\n');
+  for (auto first = base;;) {
+    auto last = std::find(first, newline, delimiter);
+    auto name = trim(first, last);
+    if (name.size() >= 2 && name.front() == '"' && name.back() == '"')
+      name = name.substr(1, name.size() - 2);
+    names.emplace_back(name);
+    if (last == newline)
+      break;
+    first = last + 1;
+  }
+  targets.assign(names.size(), skip);
+  at = newline == end ? end : newline + 1;
+  line = 2;
+}
+
+CsvReader::~CsvReader() {
+  ::munmap(const_cast<char *>(base), end - base);
+}
+
+void CsvReader::bind(std::span<const SmolString> variables) {
+  std::ranges::fill(targets, skip);
+  for (uint32_t v = 0; v != variables.size(); ++v) {
+    auto it = std::ranges::find(names, variables[v].view());
+    if (it == names.end())
+      throw std::runtime_error(
+          fmt::format("No column for variable {}", variables[v].view()));
+    targets[it - names.begin()] = v;
+  }
+  bound = variables.size();
+}
+
+size_t CsvReader::read(std::span<double *const> out, size_t rows) {
+  if (out.size() != bound)
+    throw std::runtime_error(
+        fmt::format("Expected {} columns, got {}", bound, out.size()));
+  size_t row = 0;
+  size_t field = 0;
+  // of the field being read
+  const char *start = at;
+
+  // [start, p) is a field, p is the delimiter, a newline or the end
+  auto field_end = [&](const char *p) {
+    bool last = p == end || *p == '\n';
+    auto text = trim(start, p);
+    start = p + 1;
+    if (last && field == 0 && text.empty()) {
+      ++line;
+      return;
+    }
+    if (field == targets.size())
+      throw std::runtime_error(fmt::format("Line {} has more than {} fields",
+                                           line, targets.size()));
+    if (auto t = targets[field++]; t != skip) {
+      double value = std::numeric_limits<double>::quiet_NaN();
+      if (!text.empty() && text.front() == '+')
+        text.remove_prefix(1);
+      auto last_char = text.data() + text.size();
+      if (!text.empty() &&
+          std::from_chars(text.data(), last_char, value) !=
+              std::from_chars_result{last_char, std::errc{}})
+        throw std::runtime_error(
+            fmt::format("Line {}: {} is not a number", line, text));
+      out[t][row] = value;
+    }
+    if (!last)
+      return;
+    if (field != targets.size())
+      throw std::runtime_error(
+          fmt::format("Line {} has {} fields, the header has {}", line, field,
+                      targets.size()));
+    field = 0;
+    ++line;
+    ++row;
+  };
+
+  auto block = at;
+  auto mask = structural(block, std::min<ptrdiff_t>(64, end - block),
+                         delimiter);
+  while (row != rows) {
+    if (mask == 0) {
+      if (end - block <= 64) {
+        // the last line, without its newline. it can end in an empty field
+        // after a delimiter, which leaves nothing past start
+        if (field != 0 || start < end)
+          field_end(end);
+        start = end;
+        break;
+      }
+      block += 64;
+      mask = structural(block, std::min<ptrdiff_t>(64, end - block),
+                        delimiter);
+      continue;
+    }
+    auto p = block + std::countr_zero(mask);
+    mask &= mask - 1;
+    field_end(p);
+  }
+  at = start;
+  return row;
+}
+} // namespace fcalc
@@ -0,0 +1,537 @@
+#include "decimal_eval.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <fmt/format.h>
+#include <stdexcept>
+#include <vector>
+
+namespace fcalc {
+namespace {
+using u128 = unsigned __int128;
+
+constexpr auto powers_of_ten = [] {
+  std::array<uint64_t, 20> p{};
+  p[0] = 1;
+  for (size_t i = 1; i != p.size(); ++i)
+    p[i] = p[i - 1] * 10;
+  return p;
+}();
+
+constexpr u128 max_magnitude = ~u128(0) >> 1;
+
+[[noreturn]] void overflow() { throw std::runtime_error("Decimal overflow"); }
+
+uint64_t unit(unsigned scale) {
+  if (scale > max_decimal_scale)
+    throw std::runtime_error(
+        fmt::format("Decimal scale {} is over the maximum of {}", scale,
+                    max_decimal_scale));
+  return powers_of_ten[scale];
+}
+
+inline u128 magnitude(Decimal d) noexcept { return d < 0 ? -u128(d) : u128(d); }
+
+inline Decimal with_sign(u128 m, bool negative) {
+  if (m > max_magnitude)
+    overflow();
+  return negative ? -Decimal(m) : Decimal(m);
+}
+
+// n / d with at most two hardware divides, where __udivti3 would take the
+// general 128 bit route. the divisor is a power of ten or a 64 bit operand
+inline u128 divmod(u128 n, uint64_t d, uint64_t &r) noexcept {
+#if defined(__x86_64__)
+  uint64_t hi = n >> 64, lo = n, qhi = 0, qlo;
+  if (hi >= d) {
+    qhi = hi / d;
+    hi %= d;
+  }
+  asm("divq %[d]" : "=a"(qlo), "=d"(r) : [d] "r"(d), "a"(lo), "d"(hi));
+  return (u128(qhi) << 64) | qlo;
+#else
+  r = uint64_t(n % d);
+  return n / d;
+#endif
+}
+
+// q and r are the truncated quotient and remainder of a division by d
+inline u128 round_half_even(u128 q, u128 r, u128 d) noexcept {
+  u128 rest = d - r;
+  return q + (r > rest || (r == rest && (q & 1)));
+}
+
+// full 256 bit products and the divisions back down, for operands past 64
+// bits. everything on this side is out of line
+struct Wide {
+  u128 hi, lo;
+  friend bool operator<(const Wide &a, const Wide &b) noexcept {
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+  }
+};
+
+Wide mul_wide(u128 a, u128 b) noexcept {
+  uint64_t a0 = a, a1 = a >> 64, b0 = b, b1 = b >> 64;
+  u128 p00 = u128(a0) * b0, p01 = u128(a0) * b1, p10 = u128(a1) * b0,
+       p11 = u128(a1) * b1;
+  u128 mid = (p00 >> 64) + uint64_t(p01) + uint64_t(p10);
+  return {p11 + (p01 >> 64) + (p10 >> 64) + (mid >> 64),
+          (mid << 64) | uint64_t(p00)};
+}
+
+// the quotient has to come out below 2^127
+u128 divmod_wide(Wide n, u128 d, u128 &r) {
+  if (n.hi == 0) {
+    r = n.lo % d;
+    return n.lo / d;
+  }
+  if (n.hi >= d)
+    overflow();
+  u128 q = 0;
+  r = n.hi;
+  if ((d >> 64) == 0) {
+    // a 64 bit limb at a time, r < d keeps each quotient limb in range
+    for (uint64_t limb : {uint64_t(n.lo >> 64), uint64_t(n.lo)}) {
+      uint64_t rest;
+      q = (q << 64) | divmod((r << 64) | limb, uint64_t(d), rest);
+      r = rest;
+    }
+  } else {
+    for (int bit = 127; bit >= 0; --bit) {
+      bool carry = r >> 127;
+      r = (r << 1) | ((n.lo >> bit) & 1);
+      q <<= 1;
+      if (carry || r >= d) {
+        r -= d;
+        q |= 1;
+      }
+    }
+  }
+  if (q > max_magnitude)
+    overflow();
+  return q;
+}
+
+[[gnu::noinline]] Decimal div_wide(Wide n, u128 d, bool negative) {
+  u128 r;
+  u128 q = divmod_wide(n, d, r);
+  return with_sign(round_half_even(q, r, d), negative);
+}
+
+inline Decimal add(Decimal a, Decimal b) {
+  Decimal r;
+  if (__builtin_add_overflow(a, b, &r))
+    overflow();
+  return r;
+}
+
+inline Decimal sub(Decimal a, Decimal b) {
+  Decimal r;
+  if (__builtin_sub_overflow(a, b, &r))
+    overflow();
+  return r;
+}
+
+// both operands under 2^64 is the common case, one widening multiply and
+// one divide by the scale
+inline Decimal mul(Decimal a, Decimal b, uint64_t one) {
+  bool negative = (a < 0) != (b < 0);
+  u128 x = magnitude(a), y = magnitude(b);
+  if (((x | y) >> 64) != 0)
+    return div_wide(mul_wide(x, y), one, negative);
+  uint64_t r;
+  u128 q = divmod(u128(uint64_t(x)) * uint64_t(y), one, r);
+  return with_sign(round_half_even(q, r, one), negative);
+}
+
+inline Decimal div(Decimal a, Decimal b, uint64_t one) {
+  if (b == 0)
+    throw std::runtime_error("Decimal division by zero");
+  bool negative = (a < 0) != (b < 0);
+  u128 x = magnitude(a), y = magnitude(b);
+  if ((x >> 64) != 0)
+    return div_wide(mul_wide(x, one), y, negative);
+  u128 n = u128(uint64_t(x)) * one;
+  if ((y >> 64) != 0)
+    return with_sign(round_half_even(n / y, n % y, y), negative);
+  uint64_t r;
+  u128 q = divmod(n, uint64_t(y), r);
+  return with_sign(round_half_even(q, r, y), negative);
+}
+
+// 10^37, the finest unit a magnitude below one still fits in
+constexpr u128 guard_unit = u128(powers_of_ten[19]) * powers_of_ten[18];
+
+// m / (guard_unit * 10^shift) with m kept to 37 digits, so powers of a
+// magnitude below one keep their digits however small they get
+struct Guarded {
+  u128 m;
+  unsigned shift = 0;
+
+  Guarded(u128 m, unsigned shift = 0) : m(m), shift(shift) {
+    for (; this->m < guard_unit / 10; this->m *= 10)
+      // 10^shift alone is then past any decimal
+      if (++this->shift > 38)
+        overflow();
+  }
+
+  friend Guarded operator*(Guarded a, Guarded b) {
+    u128 r;
+    u128 q = divmod_wide(mul_wide(a.m, b.m), guard_unit, r);
+    return {round_half_even(q, r, guard_unit), a.shift + b.shift};
+  }
+};
+
+// a^-k for 0 < |a| < one. a^k rounded to the scale would leave few digits
+// to divide by, so it's taken with guard digits and divided into one once
+Decimal inverse_power(Decimal a, u128 k, uint64_t one) {
+  bool negative = a < 0 && (k & 1);
+  Guarded x(magnitude(a) * (guard_unit / one)), p(guard_unit);
+  for (; k != 0; k >>= 1) {
+    if (k & 1)
+      p = p * x;
+    if (k != 1)
+      x = x * x;
+  }
+  // one * 10^shift / a^k, with the guard unit on both sides
+  u128 n = one;
+  for (unsigned i = 0; i != p.shift; ++i) {
+    if (n > max_magnitude / 10)
+      overflow();
+    n *= 10;
+  }
+  return div_wide(mul_wide(n, guard_unit), p.m, negative);
+}
+
+Decimal power(Decimal a, Decimal b, uint64_t one) {
+  Decimal whole = b / Decimal(one);
+  if (whole * Decimal(one) != b)
+    throw std::runtime_error("Decimal exponents have to be whole numbers");
+  if (whole < 0 && a == 0)
+    throw std::runtime_error("Decimal division by zero");
+  if (whole < 0 && magnitude(a) < one)
+    return inverse_power(a, magnitude(whole), one);
+  Decimal result = one;
+  for (u128 k = magnitude(whole); k != 0; k >>= 1) {
+    if (k & 1)
+      result = mul(result, a, one);
+    if (k != 1)
+      a = mul(a, a, one);
+  }
+  // at least one in magnitude, so a^k keeps its digits for the division
+  return whole >= 0 ? result : div(one, result, one);
+}
+
+Decimal root(Decimal a, uint64_t one) {
+  if (a < 0)
+    throw std::runtime_error("Square root of a negative decimal");
+  if (a == 0)
+    return 0;
+  // the root of a * one is the root of a at the same scale. a long double
+  // guess nudged above it, then newton's method down to the floor
+  Wide n = mul_wide(u128(a), one);
+  long double guess =
+      std::sqrt(std::ldexp((long double)n.hi, 128) + (long double)n.lo);
+  u128 x = u128(guess);
+  x += (x >> 32) + 1;
+  for (;;) {
+    u128 r;
+    u128 y = (x + divmod_wide(n, x, r)) / 2;
+    if (y >= x)
+      break;
+    x = y;
+  }
+  // round to nearest, (x + 1/2)^2 < n exactly when x^2 + x < n
+  if (mul_wide(x, x + 1) < n)
+    ++x;
+  return Decimal(x);
+}
+
+// pi, e and tau scaled once per evaluation rather than parsed per use
+struct DecimalConstants {
+  std::array<Decimal, 3> values;
+
+  explicit DecimalConstants(unsigned scale)
+      : values{to_decimal("3.141592653589793238462643383279502884", scale),
+               to_decimal("2.718281828459045235360287471352662497", scale),
+               to_decimal("6.283185307179586476925286766559005768", scale)} {}
+
+  Decimal operator[](Constant::Types t) const {
+    if (t == Constant::Types::i)
+      throw std::runtime_error("i has no decimal value, use evaluate_complex");
+    return values[size_t(t)];
+  }
+};
+
+// only the functions that stay exact, b is ignored for abs
+Decimal decimal_function(Function::Ops op, Decimal a, Decimal b) {
+  switch (op) {
+    using enum Function::Ops;
+  case abs:
+    return a < 0 ? sub(0, a) : a;
+  case min:
+    return b < a ? b : a;
+  case max:
+    return a < b ? b : a;
+  case sin:
+  case cos:
+  case log:
+  case exp:
+    break;
+  }
+  throw std::runtime_error(
+      fmt::format("{} has no decimal implementation", format_as(op)));
+}
+
+// 1 or 0 at the current scale
+inline Decimal decimal_compare(Binary::Ops op, Decimal a, Decimal b,
+                               uint64_t one) noexcept {
+  bool r = op == Binary::Ops::eq ? a == b
+           : op == Binary::Ops::lt ? a < b
+                                   : a > b;
+  return r ? Decimal(one) : 0;
+}
+
+struct ScalarMode {
+  using value_type = Decimal;
+  // only the arm that's taken runs, so x == 0 ? 0 : 1 / x doesn't throw
+  static constexpr bool short_circuit = true;
+  unsigned scale;
+  uint64_t one;
+  DecimalConstants constants;
+  std::span<const Binding<Decimal>> vars;
+
+  Decimal number(const Number &n) const { return to_decimal(n, scale); }
+  Decimal constant(Constant::Types t) const { return constants[t]; }
+  Decimal variable(const Variable &v) const {
+    for (auto &b : vars) {
+      if (b.name == v.s.view())
+        return b.value;
+    }
+    throw std::runtime_error(fmt::format("Unbound variable: {}", v.s.view()));
+  }
+  Decimal unary(Unary::Ops op, Decimal a) const {
+    if (op == Unary::Ops::minus)
+      return sub(0, a);
+    if (op == Unary::Ops::square)
+      return fcalc::mul(a, a, one);
+    return root(a, one);
+  }
+  Decimal binary(Binary::Ops op, Decimal a, Decimal b) const {
+    switch (op) {
+      using enum Binary::Ops;
+    case eq:
+    case lt:
+    case gt:
+      return decimal_compare(op, a, b, one);
+    case add:
+      return fcalc::add(a, b);
+    case sub:
+      return fcalc::sub(a, b);
+    case mul:
+      return fcalc::mul(a, b, one);
+    case div:
+      return fcalc::div(a, b, one);
+    case exp:
+      return power(a, b, one);
+    case assign:
+      break;
+    }
+    throw std::runtime_error("Unexpected assignment");
+  }
+  Decimal function(Function::Ops op, Decimal a) const {
+    return decimal_function(op, a, 0);
+  }
+  Decimal function(Function::Ops op, Decimal a, Decimal b) const {
+    return decimal_function(op, a, b);
+  }
+  bool truth(Decimal c) const noexcept { return c != 0; }
+  Decimal select(Decimal c, Decimal a, Decimal b) const noexcept {
+    return c != 0 ? a : b;
+  }
+};
+
+struct BlockMode {
+  unsigned scale;
+  uint64_t one;
+  DecimalConstants constants;
+  std::span<const Decimal *const> vars;
+  Decimal *out;
+  std::vector<Decimal> scratch;
+
+  Decimal *slot(uint32_t s) noexcept {
+    return scratch.data() + block_rows * s;
+  }
+
+  void number(uint32_t s, const Number &v, size_t n) {
+    std::fill_n(slot(s), n, to_decimal(v, scale));
+  }
+  void constant(uint32_t s, Constant::Types t, size_t n) {
+    std::fill_n(slot(s), n, constants[t]);
+  }
+  void variable(uint32_t s, uint32_t var, size_t row, size_t n) {
+    std::copy_n(vars[var] + row, n, slot(s));
+  }
+  void unary(Unary::Ops op, uint32_t s, size_t n) {
+    Decimal *__restrict a = slot(s);
+    if (op == Unary::Ops::minus) {
+      bool over = false;
+      for (size_t i = 0; i != n; ++i)
+        over |= __builtin_sub_overflow(Decimal(0), a[i], &a[i]);
+      if (over)
+        overflow();
+    } else if (op == Unary::Ops::square) {
+      for (size_t i = 0; i != n; ++i)
+        a[i] = fcalc::mul(a[i], a[i], one);
+    } else {
+      for (size_t i = 0; i != n; ++i)
+        a[i] = root(a[i], one);
+    }
+  }
+  // add and sub check the whole block once instead of branching per row
+  void binary(Binary::Ops op, uint32_t sa, uint32_t sb, size_t n) {
+    Decimal *__restrict a = slot(sa);
+    const Decimal *__restrict b = slot(sb);
+    bool over = false;
+    switch (op) {
+      using enum Binary::Ops;
+    case eq:
+    case lt:
+    case gt:
+      for (size_t i = 0; i != n; ++i)
+        a[i] = decimal_compare(op, a[i], b[i], one);
+      return;
+    case add:
+      for (size_t i = 0; i != n; ++i)
+        over |= __builtin_add_overflow(a[i], b[i], &a[i]);
+      break;
+    case sub:
+      for (size_t i = 0; i != n; ++i)
+        over |= __builtin_sub_overflow(a[i], b[i], &a[i]);
+      break;
+    case mul:
+      for (size_t i = 0; i != n; ++i)
+        a[i] = fcalc::mul(a[i], b[i], one);
+      return;
+    case div:
+      for (size_t i = 0; i != n; ++i)
+        a[i] = fcalc::div(a[i], b[i], one);
+      return;
+    case exp:
+      for (size_t i = 0; i != n; ++i)
+        a[i] = power(a[i], b[i], one);
+      return;
+    case assign:
+      throw std::runtime_error("Unexpected assignment");
+    }
+    if (over)
+      overflow();
+  }
+  void function(Function::Ops op, uint32_t s, size_t n) {
+    Decimal *__restrict a = slot(s);
+    const Decimal *__restrict b = slot(s + 1);
+    bool pair = Function::arity(op) == 2;
+    for (size_t i = 0; i != n; ++i)
+      a[i] = decimal_function(op, a[i], pair ? b[i] : 0);
+  }
+  // both arms are already computed for every row, so a guard like
+  // x == 0 ? 0 : 1 / x still throws here
+  void select(uint32_t s, size_t n) {
+    Decimal *__restrict c = slot(s);
+    const Decimal *__restrict a = slot(s + 1);
+    const Decimal *__restrict b = slot(s + 2);
+    for (size_t i = 0; i != n; ++i)
+      c[i] = c[i] != 0 ? a[i] : b[i];
+  }
+  void store(size_t row, size_t n) { std::copy_n(slot(0), n, out + row); }
+};
+} // namespace
+
+Decimal to_decimal(const Number &n, unsigned scale) {
+  uint64_t one = unit(scale);
+  bool negative = n.den < 0;
+  uint64_t den = negative ? -uint64_t(n.den) : uint64_t(n.den);
+  if (den == 0)
+    throw std::runtime_error("Decimal division by zero");
+  uint64_t r;
+  u128 q = divmod(u128(n.num) * one, den, r);
+  return with_sign(round_half_even(q, r, den), negative);
+}
+
+Decimal to_decimal(std::string_view text, unsigned scale) {
+  unit(scale);
+  auto bad = [&] {
+    return std::runtime_error(fmt::format("Not a decimal: {}", text));
+  };
+  auto digits = text;
+  bool negative = digits.starts_with('-');
+  if (negative)
+    digits.remove_prefix(1);
+  auto dot = digits.find('.');
+  auto whole = digits.substr(0, dot);
+  auto fraction = dot == std::string_view::npos ? std::string_view{}
+                                                : digits.substr(dot + 1);
+  if (whole.empty() && fraction.empty())
+    throw bad();
+  auto digit = [](char c) { return c >= '0' && c <= '9'; };
+  if (!std::ranges::all_of(whole, digit) ||
+      !std::ranges::all_of(fraction, digit))
+    throw bad();
+
+  u128 m = 0;
+  auto push = [&](char c) {
+    if (m > (max_magnitude - 9) / 10)
+      overflow();
+    m = m * 10 + (c - '0');
+  };
+  for (char c : whole)
+    push(c);
+  for (unsigned k = 0; k != scale; ++k)
+    push(k < fraction.size() ? fraction[k] : '0');
+  // the digits past the scale only decide the rounding
+  if (fraction.size() > scale) {
+    auto rest = fraction.substr(scale);
+    bool tail = rest.find_first_not_of('0', 1) != std::string_view::npos;
+    if (rest[0] > '5' || (rest[0] == '5' && (tail || (m & 1))))
+      ++m;
+  }
+  return with_sign(m, negative);
+}
+
+std::string format_decimal(Decimal d, unsigned scale) {
+  unit(scale);
+  // built backwards, least significant digit first
+  std::string digits;
+  u128 m = magnitude(d);
+  do {
+    uint64_t r;
+    m = divmod(m, 10, r);
+    digits.push_back(char('0' + r));
+  } while (m != 0);
+  digits.resize(std::max<size_t>(digits.size(), scale + 1), '0');
+  if (d < 0)
+    digits.push_back('-');
+  std::ranges::reverse(digits);
+  if (scale != 0)
+    digits.insert(digits.end() - scale, '.');
+  return digits;
+}
+
+Decimal evaluate_decimal(std::span<const Word> s, unsigned scale,
+                         std::span<const Binding<Decimal>> vars) {
+  ScalarMode mode{scale, unit(scale), DecimalConstants(scale), vars};
+  return walk(s, mode);
+}
+
+void evaluate_decimal(ProgramView p, std::span<const Decimal *const> vars,
+                      Decimal *out, size_t rows, unsigned scale) {
+  if (vars.size() < p.variables)
+    throw std::runtime_error(fmt::format("Expected {} variable columns, got {}",
+                                         p.variables, vars.size()));
+  BlockMode mode{scale, unit(scale), DecimalConstants(scale), vars, out,
+                 std::vector<Decimal>(block_rows * p.max_depth)};
+  run_blocks(p, rows, mode);
+}
+} // namespace fcalc
@@ -0,0 +1,365 @@
+#include "dual_eval.hpp"
+#include "vmath.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fmt/format.h>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+
+namespace fcalc {
+namespace {
+// slot s holds lanes value, d/d wrt[0], d/d wrt[1], ... each stride long.
+// a slot only depends on a few of the variables in most formulas, so each
+// slot also tracks which tangent lanes can be nonzero and the kernels only
+// touch those. the rest are treated as zero and never written
+struct DualMode {
+  std::span<const double *const> vars;
+  double *value;
+  std::span<double *const> gradient;
+  // for each variable slot, which tangent lane it seeds or -1
+  std::vector<int32_t> seeds;
+  size_t stride;
+  size_t lanes;
+  std::vector<double> scratch;
+  std::vector<double> tmp;
+  // sorted tangent lanes (1 based) that are live in each slot
+  std::vector<std::vector<uint32_t>> live;
+  std::vector<uint32_t> merged;
+
+  DualMode(ProgramView p, std::span<const double *const> vars,
+           std::span<const uint32_t> wrt, double *value,
+           std::span<double *const> gradient, size_t rows)
+      : vars(vars), value(value), gradient(gradient),
+        seeds(p.variables, -1), stride(std::min(rows, block_rows)),
+        lanes(wrt.size() + 1), scratch(lanes * stride * p.max_depth),
+        tmp(2 * stride), live(p.max_depth) {
+    for (size_t k = 0; k != wrt.size(); ++k) {
+      if (wrt[k] >= seeds.size())
+        throw std::runtime_error(
+            fmt::format("No variable slot {} to differentiate by", wrt[k]));
+      seeds[wrt[k]] = k + 1;
+    }
+  }
+
+  double *lane(uint32_t s, size_t k) noexcept {
+    return scratch.data() + (s * lanes + k) * stride;
+  }
+  bool is_live(uint32_t s, uint32_t k) const noexcept {
+    return std::ranges::binary_search(live[s], k);
+  }
+
+  void number(uint32_t s, const Number &v, size_t n) {
+    std::fill_n(lane(s, 0), n, to_double(v));
+    live[s].clear();
+  }
+  void constant(uint32_t s, Constant::Types t, size_t n) {
+    if (t == Constant::Types::i)
+      throw std::runtime_error("i has no real value, use evaluate_complex");
+    std::fill_n(lane(s, 0), n, to_double(t));
+    live[s].clear();
+  }
+  void variable(uint32_t s, uint32_t var, size_t row, size_t n) {
+    std::copy_n(vars[var] + row, n, lane(s, 0));
+    live[s].clear();
+    if (seeds[var] >= 0) {
+      std::fill_n(lane(s, seeds[var]), n, 1.0);
+      live[s].push_back(seeds[var]);
+    }
+  }
+
+  void unary(Unary::Ops op, uint32_t s, size_t n) {
+    double *__restrict a = lane(s, 0);
+    if (op == Unary::Ops::minus) {
+      for (size_t i = 0; i != n; ++i)
+        a[i] = -a[i];
+      for (auto k : live[s]) {
+        double *__restrict d = lane(s, k);
+        for (size_t i = 0; i != n; ++i)
+          d[i] = -d[i];
+      }
+      return;
+    }
+    double *__restrict f = tmp.data();
+    if (op == Unary::Ops::square) {
+      for (size_t i = 0; i != n; ++i) {
+        f[i] = 2 * a[i];
+        a[i] *= a[i];
+      }
+    } else {
+      for (size_t i = 0; i != n; ++i) {
+        a[i] = std::sqrt(a[i]);
+        f[i] = 0.5 / a[i];
+      }
+    }
+    for (auto k : live[s]) {
+      double *__restrict d = lane(s, k);
+      for (size_t i = 0; i != n; ++i)
+        d[i] *= f[i];
+    }
+  }
+
+  // runs both(da, db), a_only(da) or b_only(da, db) on every lane that is
+  // live in either slot, after which the lanes of sa are the union
+  void each_lane(uint32_t sa, uint32_t sb, auto both, auto a_only,
+                 auto b_only) {
+    merged.clear();
+    std::ranges::set_union(live[sa], live[sb], std::back_inserter(merged));
+    for (auto k : merged) {
+      bool in_a = is_live(sa, k), in_b = is_live(sb, k);
+      if (in_a && in_b)
+        both(lane(sa, k), lane(sb, k));
+      else if (in_a)
+        a_only(lane(sa, k));
+      else
+        b_only(lane(sa, k), lane(sb, k));
+    }
+    std::swap(live[sa], merged);
+  }
+
+  // takes the value and every tangent of sb on the rows f marks, sa keeps
+  // its own on the rest
+  void pick(uint32_t sa, uint32_t sb, const double *__restrict f, size_t n) {
+    double *__restrict a = lane(sa, 0);
+    const double *__restrict b = lane(sb, 0);
+    each_lane(
+        sa, sb,
+        [&](double *__restrict da, const double *__restrict db) {
+          for (size_t i = 0; i != n; ++i)
+            da[i] = f[i] != 0 ? db[i] : da[i];
+        },
+        [&](double *__restrict da) {
+          for (size_t i = 0; i != n; ++i)
+            da[i] = f[i] != 0 ? 0.0 : da[i];
+        },
+        [&](double *__restrict da, const double *__restrict db) {
+          for (size_t i = 0; i != n; ++i)
+            da[i] = f[i] != 0 ? db[i] : 0.0;
+        });
+    for (size_t i = 0; i != n; ++i)
+      a[i] = f[i] != 0 ? b[i] : a[i];
+  }
+
+  void binary(Binary::Ops op, uint32_t sa, uint32_t sb, size_t n) {
+    double *__restrict a = lane(sa, 0);
+    const double *__restrict b = lane(sb, 0);
+    auto none = [](double *) {};
+    switch (op) {
+      using enum Binary::Ops;
+    case eq:
+    case lt:
+    case gt:
+      // a step function, flat on both sides
+      for (size_t i = 0; i != n; ++i)
+        a[i] = (op == eq ? a[i] == b[i] : op == lt ? a[i] < b[i] : a[i] > b[i])
+                   ? 1.0
+                   : 0.0;
+      live[sa].clear();
+      return;
+    case add:
+    case sub: {
+      double sign = op == add ? 1.0 : -1.0;
+      for (size_t i = 0; i != n; ++i)
+        a[i] += sign * b[i];
+      each_lane(
+          sa, sb,
+          [&](double *__restrict da, const double *__restrict db) {
+            for (size_t i = 0; i != n; ++i)
+              da[i] += sign * db[i];
+          },
+          none,
+          [&](double *__restrict da, const double *__restrict db) {
+            for (size_t i = 0; i != n; ++i)
+              da[i] = sign * db[i];
+          });
+      return;
+    }
+    case mul:
+      each_lane(
+          sa, sb,
+          [&](double *__restrict da, const double *__restrict db) {
+            for (size_t i = 0; i != n; ++i)
+              da[i] = da[i] * b[i] + a[i] * db[i];
+          },
+          [&](double *__restrict da) {
+            for (size_t i = 0; i != n; ++i)
+              da[i] *= b[i];
+          },
+          [&](double *__restrict da, const double *__restrict db) {
+            for (size_t i = 0; i != n; ++i)
+              da[i] = a[i] * db[i];
+          });
+      for (size_t i = 0; i != n; ++i)
+        a[i] *= b[i];
+      return;
+    case div:
+      for (size_t i = 0; i != n; ++i)
+        a[i] /= b[i];
+      each_lane(
+          sa, sb,
+          [&](double *__restrict da, const double *__restrict db) {
+            for (size_t i = 0; i != n; ++i)
+              da[i] = (da[i] - a[i] * db[i]) / b[i];
+          },
+          [&](double *__restrict da) {
+            for (size_t i = 0; i != n; ++i)
+              da[i] /= b[i];
+          },
+          [&](double *__restrict da, const double *__restrict db) {
+            for (size_t i = 0; i != n; ++i)
+              da[i] = -a[i] * db[i] / b[i];
+          });
+      return;
+    case exp: {
+      // d(a^b) = b a^(b-1) da + a^b ln(a) db. the ln term is only taken
+      // where db is nonzero, so constant exponents work for negative a
+      double *__restrict fa = tmp.data();
+      double *__restrict fb = tmp.data() + stride;
+      for (size_t i = 0; i != n; ++i) {
+        double v = std::pow(a[i], b[i]);
+        fa[i] = b[i] * std::pow(a[i], b[i] - 1);
+        fb[i] = v * std::log(a[i]);
+        a[i] = v;
+      }
+      each_lane(
+          sa, sb,
+          [&](double *__restrict da, const double *__restrict db) {
+            for (size_t i = 0; i != n; ++i)
+              da[i] = fa[i] * da[i] + (db[i] == 0 ? 0.0 : fb[i] * db[i]);
+          },
+          [&](double *__restrict da) {
+            for (size_t i = 0; i != n; ++i)
+              da[i] *= fa[i];
+          },
+          [&](double *__restrict da, const double *__restrict db) {
+            for (size_t i = 0; i != n; ++i)
+              da[i] = db[i] == 0 ? 0.0 : fb[i] * db[i];
+          });
+      return;
+    }
+    case assign:
+      break;
+    }
+    throw std::runtime_error("Unexpected assignment");
+  }
+
+  void function(Function::Ops op, uint32_t s, size_t n) {
+    double *__restrict a = lane(s, 0);
+    double *__restrict f = tmp.data();
+    if (Function::arity(op) == 2) {
+      // min and max take the value and every tangent of whichever side
+      // wins the row, f marks the rows b wins
+      const double *__restrict b = lane(s + 1, 0);
+      bool min = op == Function::Ops::min;
+      for (size_t i = 0; i != n; ++i)
+        f[i] = (min ? b[i] < a[i] : a[i] < b[i]) ? 1.0 : 0.0;
+      pick(s, s + 1, f, n);
+      return;
+    }
+    // f is the derivative at a, skipped when nothing depends on wrt
+    bool tangents = !live[s].empty();
+    switch (op) {
+      using enum Function::Ops;
+    case sin:
+    case cos:
+      if (tangents) {
+        std::copy_n(a, n, f);
+        if (op == sin) {
+          vmath::cos(f, n);
+        } else {
+          vmath::sin(f, n);
+          for (size_t i = 0; i != n; ++i)
+            f[i] = -f[i];
+        }
+      }
+      if (op == sin)
+        vmath::sin(a, n);
+      else
+        vmath::cos(a, n);
+      break;
+    case log:
+      for (size_t i = 0; i != n; ++i)
+        f[i] = 1 / a[i];
+      vmath::log(a, n);
+      break;
+    case exp:
+      vmath::exp(a, n);
+      std::copy_n(a, n, f);
+      break;
+    case abs:
+      for (size_t i = 0; i != n; ++i) {
+        f[i] = std::copysign(1.0, a[i]);
+        a[i] = std::abs(a[i]);
+      }
+      break;
+    case min:
+    case max:
+      break;
+    }
+    for (auto k : live[s]) {
+      double *__restrict d = lane(s, k);
+      for (size_t i = 0; i != n; ++i)
+        d[i] *= f[i];
+    }
+  }
+
+  // the derivative of the arm each row takes, the condition contributes
+  // none
+  void select(uint32_t s, size_t n) {
+    const double *__restrict c = lane(s, 0);
+    double *__restrict f = tmp.data();
+    for (size_t i = 0; i != n; ++i)
+      f[i] = c[i] != 0 ? 0.0 : 1.0;
+    pick(s + 1, s + 2, f, n);
+    std::copy_n(lane(s + 1, 0), n, lane(s, 0));
+    for (auto k : live[s + 1])
+      std::copy_n(lane(s + 1, k), n, lane(s, k));
+    live[s] = live[s + 1];
+  }
+
+  void store(size_t row, size_t n) {
+    std::copy_n(lane(0, 0), n, value + row);
+    for (size_t k = 1; k != lanes; ++k) {
+      if (is_live(0, k))
+        std::copy_n(lane(0, k), n, gradient[k - 1] + row);
+      else
+        std::fill_n(gradient[k - 1] + row, n, 0.0);
+    }
+  }
+};
+
+void check_sizes(ProgramView p, size_t vars, size_t wrt, size_t gradient) {
+  if (vars < p.variables)
+    throw std::runtime_error(fmt::format("Expected {} variables, got {}",
+                                         p.variables, vars));
+  if (gradient < wrt)
+    throw std::runtime_error(fmt::format(
+        "Gradient has room for {} entries, needs {}", gradient, wrt));
+}
+} // namespace
+
+double evaluate_gradient(ProgramView p, std::span<const double> vars,
+                         std::span<const uint32_t> wrt,
+                         std::span<double> gradient) {
+  check_sizes(p, vars.size(), wrt.size(), gradient.size());
+  std::vector<const double *> var_ptrs;
+  std::vector<double *> gradient_ptrs;
+  for (auto &v : vars)
+    var_ptrs.push_back(&v);
+  for (auto &g : gradient)
+    gradient_ptrs.push_back(&g);
+  double value;
+  DualMode mode(p, var_ptrs, wrt, &value, gradient_ptrs, 1);
+  run_blocks(p, 1, mode);
+  return value;
+}
+
+void evaluate_gradient(ProgramView p, std::span<const double *const> vars,
+                       std::span<const uint32_t> wrt, double *value,
+                       std::span<double *const> gradient, size_t rows) {
+  check_sizes(p, vars.size(), wrt.size(), gradient.size());
+  DualMode mode(p, vars, wrt, value, gradient, rows);
+  run_blocks(p, rows, mode);
+}
+} // namespace fcalc
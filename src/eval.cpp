@@ -0,0 +1,532 @@
+#include "eval.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <fmt/format.h>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+namespace fcalc {
+namespace {
+// mirrors detail::walk_span/walk_item, but emits postfix instead of values
+struct Compiler {
+  Program &p;
+  uint32_t depth = 0;
+
+  void push(Instr i) {
+    p.code.push_back(i);
+    p.max_depth = std::max(p.max_depth, ++depth);
+  }
+  void apply(Instr i) {
+    p.code.push_back(i);
+    if (i.type == WordType::Binary)
+      --depth;
+    else if (i.type == WordType::Function)
+      depth -= Function::arity(Function::Ops(i.op)) - 1;
+    else if (i.type == WordType::Ternary)
+      depth -= 2;
+  }
+
+  uint32_t variable(const Variable &v) {
+    if (auto s = p.slot(v.s.view()))
+      return *s;
+    p.variables.push_back(v.s);
+    return p.variables.size() - 1;
+  }
+
+  void item(const Word *&it, const Word *end) {
+    const Word &w = *it++;
+    switch (w.type) {
+      using enum WordType;
+    case Number:
+      p.numbers.push_back(w.num);
+      push({Number, 0, uint32_t(p.numbers.size() - 1)});
+      return;
+    case Constant:
+      push({Constant, uint8_t(w.con.type)});
+      return;
+    case Variable:
+      push({Variable, 0, variable(w.var)});
+      return;
+    case Unary:
+      item(it, end);
+      apply({Unary, uint8_t(w.un.op)});
+      return;
+    case Binary: {
+      auto mid = &w + w.bin.second_arg;
+      if (mid <= &w || mid > end)
+        throw std::runtime_error("Malformed prefix expression");
+      if (w.bin.op == Binary::Ops::assign)
+        throw std::runtime_error("Assignment is only allowed at the top");
+      span(&w + 1, mid);
+      span(mid, end);
+      apply({Binary, std::to_underlying(w.bin.op)});
+      it = end;
+      return;
+    }
+    case Function: {
+      auto close = &w + w.fn.size - 1;
+      if (close <= &w || close >= end)
+        throw std::runtime_error("Malformed function call");
+      if (Function::arity(w.fn.op) == 1) {
+        span(&w + 1, close);
+      } else {
+        auto mid = &w + w.fn.second_arg;
+        if (mid <= &w + 1 || mid >= close)
+          throw std::runtime_error("Malformed function call");
+        span(&w + 1, mid - 1);
+        span(mid, close);
+      }
+      apply({Function, std::to_underlying(w.fn.op)});
+      it = close + 1;
+      return;
+    }
+    case Ternary: {
+      auto a = &w + w.ter.second_arg, b = &w + w.ter.third_arg;
+      if (a <= &w + 1 || b <= a + 1 || b >= end)
+        throw std::runtime_error("Malformed conditional");
+      span(&w + 1, a);
+      span(a, b - 1);
+      span(b, end);
+      apply({Ternary});
+      it = end;
+      return;
+    }
+    case Token:
+      break;
+    }
+    throw std::runtime_error("Unparsed token in expression");
+  }
+
+  void span(const Word *it, const Word *end) {
+    if (it == end)
+      throw std::runtime_error("Empty term in expression");
+    item(it, end);
+    while (it != end) {
+      item(it, end);
+      apply({WordType::Binary, std::to_underlying(Binary::Ops::mul)});
+    }
+  }
+};
+
+constexpr uint32_t none = ~uint32_t{};
+
+// a compiled instruction with its operands, so the postfix can be looked at
+// as the tree it came from
+struct Node {
+  Instr ins;
+  std::array<uint32_t, 3> args{none, none, none};
+  // of the subtree, which is the code from first up to the node
+  uint32_t first;
+};
+
+std::vector<Node> tree(const Program &p) {
+  std::vector<Node> nodes;
+  std::vector<uint32_t> stack;
+  for (auto &ins : p.code) {
+    size_t arity = 0;
+    switch (ins.type) {
+      using enum WordType;
+    case Unary:
+      arity = 1;
+      break;
+    case Binary:
+      arity = 2;
+      break;
+    case Function:
+      arity = Function::arity(Function::Ops(ins.op));
+      break;
+    case Ternary:
+      arity = 3;
+      break;
+    default:
+      break;
+    }
+    if (stack.size() < arity)
+      throw std::runtime_error("Malformed program");
+    Node n{ins, {none, none, none}, uint32_t(nodes.size())};
+    std::copy(stack.end() - arity, stack.end(), n.args.begin());
+    stack.resize(stack.size() - arity);
+    if (arity != 0)
+      n.first = nodes[n.args[0]].first;
+    stack.push_back(nodes.size());
+    nodes.push_back(n);
+  }
+  if (stack.size() != 1)
+    throw std::runtime_error("Malformed program");
+  return nodes;
+}
+
+// a product in a sum that is a polynomial in one variable: sign * x ^
+// degree * the factors, which don't depend on x
+struct Term {
+  int sign = 1;
+  uint32_t degree = 0;
+  struct Factor {
+    uint32_t node;
+    // the term is divided by it
+    bool divide;
+  };
+  std::vector<Factor> factors;
+};
+
+// emits the tree again with powers, divisions and polynomials strength
+// reduced. it only ever emits what the tree already had, squarings and
+// numbers, so the depth bookkeeping is Compiler's
+struct Reducer {
+  // distinct variables tried as the x of a sum, past that it's left alone
+  static constexpr size_t candidates = 4;
+
+  const Program &from;
+  std::vector<Node> nodes;
+  Compiler out;
+  Rewrites &applied;
+  // whether a node depends on the variable being tried
+  std::vector<char> has;
+
+  bool leaf(uint32_t i) const noexcept {
+    auto t = nodes[i].ins.type;
+    return t == WordType::Number || t == WordType::Constant ||
+           t == WordType::Variable;
+  }
+  bool is(uint32_t i, WordType t, auto op) const noexcept {
+    return nodes[i].ins.type == t && nodes[i].ins.op == uint8_t(op);
+  }
+  // the value of a number node if it's a whole power to lower
+  std::optional<uint32_t> whole(uint32_t i) const noexcept {
+    if (nodes[i].ins.type != WordType::Number)
+      return std::nullopt;
+    double v = to_double(from.numbers[nodes[i].ins.arg]);
+    if (!(v >= 0 && v <= max_power) || v != std::floor(v))
+      return std::nullopt;
+    return uint32_t(v);
+  }
+  // 1 / c for a number node c that is a power of two, which is exact
+  std::optional<Number> reciprocal(uint32_t i) const noexcept {
+    if (nodes[i].ins.type != WordType::Number)
+      return std::nullopt;
+    auto &c = from.numbers[nodes[i].ins.arg];
+    int exponent;
+    double v = to_double(c);
+    if (!std::isnormal(v) || std::abs(std::frexp(v, &exponent)) != 0.5 ||
+        c.num > uint64_t(std::numeric_limits<int64_t>::max()))
+      return std::nullopt;
+    uint64_t den = c.den < 0 ? -uint64_t(c.den) : uint64_t(c.den);
+    Number r(den, c.den < 0 ? -int64_t(c.num) : int64_t(c.num));
+    if (!std::isnormal(to_double(r)) || to_double(r) != 1 / v)
+      return std::nullopt;
+    return r;
+  }
+
+  void number(Number n) {
+    out.p.numbers.push_back(n);
+    out.push({WordType::Number, 0, uint32_t(out.p.numbers.size() - 1)});
+  }
+  void unary(Unary::Ops op) {
+    out.apply({WordType::Unary, uint8_t(op)});
+  }
+  void binary(Binary::Ops op) {
+    out.apply({WordType::Binary, std::to_underlying(op)});
+  }
+
+  // base ^ n over the bits of n from the top, squaring for every bit and
+  // multiplying by base for the ones that are set
+  bool can_power(uint32_t base, uint32_t n) const noexcept {
+    return n <= 1 || leaf(base) || std::has_single_bit(n);
+  }
+  void power(uint32_t base, uint32_t n) {
+    if (n == 0)
+      return number(int64_t(1));
+    emit(base);
+    for (int bit = std::bit_width(n) - 2; bit >= 0; --bit) {
+      unary(Unary::Ops::square);
+      if (n >> bit & 1) {
+        emit(base);
+        binary(Binary::Ops::mul);
+      }
+    }
+  }
+  void divide_by(uint32_t i) {
+    if (auto r = reciprocal(i)) {
+      number(*r);
+      binary(Binary::Ops::mul);
+      ++applied.reciprocals;
+      return;
+    }
+    emit(i);
+    binary(Binary::Ops::div);
+  }
+
+  // in_sum is set below an add or sub, which has already been tried as a
+  // polynomial as a whole
+  void emit(uint32_t i, bool in_sum = false) {
+    auto &n = nodes[i];
+    if (n.ins.type == WordType::Binary) {
+      auto [a, b, _] = n.args;
+      switch (Binary::Ops(n.ins.op)) {
+        using enum Binary::Ops;
+      case add:
+      case sub:
+        if (!in_sum && polynomial(i))
+          return;
+        emit(a, true);
+        emit(b, true);
+        out.apply(n.ins);
+        return;
+      case div:
+        if (reciprocal(b)) {
+          emit(a);
+          divide_by(b);
+          return;
+        }
+        break;
+      case exp:
+        if (auto k = whole(b); k && can_power(a, *k)) {
+          power(a, *k);
+          ++applied.powers;
+          return;
+        }
+        break;
+      default:
+        break;
+      }
+    }
+    if (leaf(i))
+      return out.push(n.ins);
+    for (auto a : n.args) {
+      if (a != none)
+        emit(a);
+    }
+    out.apply(n.ins);
+  }
+
+  // the terms of the sum at i, false if one isn't c * x ^ k
+  bool terms(uint32_t i, int sign, std::vector<Term> &into) {
+    if (is(i, WordType::Binary, Binary::Ops::add) ||
+        is(i, WordType::Binary, Binary::Ops::sub)) {
+      auto [a, b, _] = nodes[i].args;
+      int second = is(i, WordType::Binary, Binary::Ops::sub) ? -sign : sign;
+      return terms(a, sign, into) && terms(b, second, into);
+    }
+    if (is(i, WordType::Unary, Unary::Ops::minus))
+      return terms(nodes[i].args[0], -sign, into);
+    into.push_back({sign, 0, {}});
+    return monomial(i, false, into.back());
+  }
+  bool monomial(uint32_t i, bool divide, Term &t) {
+    if (!has[i]) {
+      t.factors.push_back({i, divide});
+      return true;
+    }
+    // x / ... isn't a polynomial any more
+    if (divide)
+      return false;
+    auto [a, b, _] = nodes[i].args;
+    if (nodes[i].ins.type == WordType::Variable) {
+      ++t.degree;
+    } else if (is(i, WordType::Unary, Unary::Ops::minus)) {
+      t.sign = -t.sign;
+      return monomial(a, false, t);
+    } else if (is(i, WordType::Binary, Binary::Ops::mul)) {
+      return monomial(a, false, t) && monomial(b, false, t);
+    } else if (is(i, WordType::Binary, Binary::Ops::div)) {
+      return monomial(a, false, t) && monomial(b, true, t);
+    } else if (is(i, WordType::Binary, Binary::Ops::exp) &&
+               nodes[a].ins.type == WordType::Variable && whole(b)) {
+      t.degree += *whole(b);
+    } else {
+      return false;
+    }
+    return t.degree <= max_power;
+  }
+
+  // the sum at i in horner form, if it's a polynomial in one of its
+  // variables with at least two powers of it. x is tried for the bases of
+  // x ^ k in the sum
+  bool polynomial(uint32_t i) {
+    std::vector<uint32_t> bases;
+    for (uint32_t j = nodes[i].first; j != i; ++j) {
+      auto [a, b, _] = nodes[j].args;
+      if (!is(j, WordType::Binary, Binary::Ops::exp) ||
+          nodes[a].ins.type != WordType::Variable || whole(b).value_or(0) < 2)
+        continue;
+      auto same = [&](uint32_t k) {
+        return nodes[k].ins.arg == nodes[a].ins.arg;
+      };
+      if (std::ranges::none_of(bases, same))
+        bases.push_back(a);
+      if (bases.size() == candidates)
+        break;
+    }
+    std::vector<Term> sum;
+    for (auto x : bases) {
+      for (uint32_t j = nodes[i].first; j <= i; ++j) {
+        auto &n = nodes[j];
+        has[j] = n.ins.type == WordType::Variable &&
+                 n.ins.arg == nodes[x].ins.arg;
+        for (auto a : n.args)
+          has[j] |= a != none && has[a];
+      }
+      sum.clear();
+      if (!terms(i, 1, sum))
+        continue;
+      std::ranges::stable_sort(sum, std::greater{}, &Term::degree);
+      size_t powers = 0;
+      for (size_t t = 0; t != sum.size(); ++t)
+        powers += sum[t].degree != 0 &&
+                  (t == 0 || sum[t].degree != sum[t - 1].degree);
+      if (powers < 2)
+        continue;
+      horner(x, sum);
+      ++applied.polynomials;
+      return true;
+    }
+    return false;
+  }
+
+  void product(const Term &t) {
+    if (t.factors.empty() || t.factors.front().divide)
+      number(int64_t(1));
+    for (size_t f = 0; f != t.factors.size(); ++f) {
+      auto &factor = t.factors[f];
+      if (factor.divide) {
+        divide_by(factor.node);
+        continue;
+      }
+      emit(factor.node);
+      if (f != 0)
+        binary(Binary::Ops::mul);
+    }
+  }
+
+  // ((c_n * x ^ (n - m) + c_m) * x ^ (m - ...) + ...) * x ^ (lowest), the
+  // terms of a degree are added one by one and gaps are powers of x
+  void horner(uint32_t x, std::span<const Term> sum) {
+    auto first = sum.begin();
+    auto next = std::ranges::find_if(
+        sum, [&](const Term &t) { return t.degree != first->degree; });
+    auto gap = first->degree - next->degree;
+    if (next - first == 1 && first->factors.empty()) {
+      power(x, gap);
+      if (first->sign < 0)
+        unary(Unary::Ops::minus);
+    } else {
+      for (auto t = first; t != next; ++t) {
+        product(*t);
+        if (t != first)
+          binary(t->sign < 0 ? Binary::Ops::sub : Binary::Ops::add);
+        else if (t->sign < 0)
+          unary(Unary::Ops::minus);
+      }
+      power(x, gap);
+      binary(Binary::Ops::mul);
+    }
+    for (auto t = next; t != sum.end(); ++t) {
+      if (t != next && t->degree != t[-1].degree) {
+        power(x, t[-1].degree - t->degree);
+        binary(Binary::Ops::mul);
+      }
+      product(*t);
+      binary(t->sign < 0 ? Binary::Ops::sub : Binary::Ops::add);
+    }
+    if (auto lowest = sum.back().degree; lowest != 0) {
+      power(x, lowest);
+      binary(Binary::Ops::mul);
+    }
+  }
+};
+} // namespace
+
+Program compile(std::span<const Word> s) {
+  FCALC_TRACE_SCOPE(compile);
+  Program p;
+  auto begin = s.data(), end = s.data() + s.size();
+  if (!s.empty() && s.front().type == WordType::Binary &&
+      s.front().bin.op == Binary::Ops::assign) {
+    auto mid = begin + s.front().bin.second_arg;
+    if (mid != begin + 2 || begin[1].type != WordType::Variable)
+      throw std::runtime_error("Can only assign to a single variable");
+    p.target = begin[1].var.s;
+    begin = mid;
+  }
+  p.code.reserve(end - begin);
+  Compiler c{p};
+  c.span(begin, end);
+  return p;
+}
+
+void check_program(ProgramView p) {
+  uint32_t depth = 0, max_depth = 0;
+  for (size_t at = 0; at != p.code.size(); ++at) {
+    auto &ins = p.code[at];
+    auto bad = [&](std::string_view what) {
+      return std::runtime_error(
+          fmt::format("Instruction {}: {}", at, what));
+    };
+    uint32_t pops = 0;
+    bool known = true;
+    switch (ins.type) {
+      using enum WordType;
+    case Number:
+      if (ins.arg >= p.numbers.size())
+        throw bad("no such number");
+      break;
+    case Constant:
+      known = ins.op <= uint8_t(Constant::Types::i);
+      break;
+    case Variable:
+      if (ins.arg >= p.variables)
+        throw bad("no such variable");
+      break;
+    case Unary:
+      known = ins.op <= uint8_t(Unary::Ops::square);
+      pops = 1;
+      break;
+    case Binary:
+      // assignments never make it into the code
+      known = ins.op > uint8_t(Binary::Ops::assign) &&
+              ins.op <= uint8_t(Binary::Ops::exp);
+      pops = 2;
+      break;
+    case Function:
+      known = ins.op <= uint8_t(Function::Ops::max);
+      pops = known ? Function::arity(Function::Ops(ins.op)) : 0;
+      break;
+    case Ternary:
+      pops = 3;
+      break;
+    default:
+      throw bad("unknown instruction");
+    }
+    if (!known)
+      throw bad(fmt::format("unknown op {}", ins.op));
+    if (depth < pops)
+      throw bad("stack underflow");
+    depth = depth - pops + 1;
+    max_depth = std::max(max_depth, depth);
+  }
+  if (depth != 1)
+    throw std::runtime_error(
+        fmt::format("Program leaves {} values instead of 1", depth));
+  if (max_depth != p.max_depth)
+    throw std::runtime_error(fmt::format(
+        "Program reaches depth {}, says {}", max_depth, p.max_depth));
+}
+
+Program compile(std::span<const Word> s, Rewrites &applied) {
+  auto p = compile(s);
+  Program q;
+  q.numbers = p.numbers;
+  q.variables = p.variables;
+  q.target = p.target;
+  q.code.reserve(p.code.size());
+  Reducer r{p, tree(p), Compiler{q}, applied, {}};
+  r.has.resize(r.nodes.size());
+  r.emit(r.nodes.size() - 1);
+  return q;
+}
+} // namespace fcalc
@@ -1,5 +1,6 @@
 #include "fcalc.hpp"
 #include "ctre-unicode.hpp"
+#include "trace.hpp"
 
 #include <algorithm>
 #include <charconv>
@@ -22,7 +23,9 @@ inline auto str_cast(std::string_view str) noexcept {
                             str.size());
 }
 
-Word makeCon(std::string_view tok) {
+using Code = ParseError::Code;
+
+std::expected<Word, Code> makeCon(std::string_view tok) {
   if (tok == "pi" || tok == "π") {
     return Constant(Constant::Types::pi);
   } else if (tok == "e") {
@@ -32,9 +35,9 @@ Word makeCon(std::string_view tok) {
   } else if (tok == "i") {
     return Constant(Constant::Types::i);
   }
-  throw std::runtime_error("Unexpected token");
+  return std::unexpected(Code::unexpected_token);
 }
-Word makeOp(std::string_view tok) {
+std::expected<Word, Code> makeOp(std::string_view tok) {
   if (tok == "+") {
     return Binary(Binary::Ops::add);
   } else if (tok == "-") {
@@ -47,28 +50,41 @@ Word makeOp(std::string_view tok) {
     return Binary(Binary::Ops::exp);
   } else if (tok == "=") {
     return Binary(Binary::Ops::assign);
+  } else if (tok == "==") {
+    return Binary(Binary::Ops::eq);
+  } else if (tok == "<") {
+    return Binary(Binary::Ops::lt);
+  } else if (tok == ">") {
+    return Binary(Binary::Ops::gt);
+  } else if (tok == "?") {
+    return Ternary();
   } else if (tok == "√") {
     return Unary(Unary::Ops::sqrt);
+  } else if (tok == "," || tok == ")" || tok == ":") {
+    // kept as tokens, they delimit the arguments of calls and the arms of
+    // conditionals
+    return Token(tok);
+  }
+  return std::unexpected(Code::unexpected_token);
+}
+std::expected<Word, Code> makeFn(std::string_view name) {
+  constexpr std::string_view names[] = {"sin", "cos", "log", "exp",
+                                        "abs", "min", "max"};
+  for (uint8_t k = 0; k != std::size(names); ++k) {
+    if (name == names[k])
+      return Function(Function::Ops(k));
   }
-  throw std::runtime_error("Unexpected token");
+  return std::unexpected(Code::unexpected_token);
 }
-Word makeNum(std::string_view num) {
+std::expected<Word, Code> makeNum(std::string_view num) {
   uint64_t val;
   auto result = std::from_chars(num.data(), num.data() + num.size(), val);
   if (result.ec != std::errc{}) {
-    throw std::runtime_error(fmt::format("number parsing failed: {}", num));
+    return std::unexpected(Code::bad_number);
   }
   return Number(val, 1);
 }
 
-int decimal_places(uint64_t i) {
-  int dec = 0;
-  while (i != 0) {
-    i %= 10;
-    ++dec;
-  }
-  return dec;
-}
 uint64_t ipow10(uint64_t b, uint64_t e) {
   while (e != 0) {
     b *= 10;
@@ -76,47 +92,197 @@ uint64_t ipow10(uint64_t b, uint64_t e) {
   }
   return b;
 }
-Word makeDec(std::string_view num, std::string_view den) {
+std::expected<Word, Code> makeDec(std::string_view num, std::string_view den) {
   uint64_t n;
   auto result = std::from_chars(num.data(), num.data() + num.size(), n);
   if (result.ec != std::errc{}) {
-    throw std::runtime_error(
-        fmt::format("decimal integer parsing failed: {} . {}", num, den));
+    return std::unexpected(Code::bad_number);
   }
   uint64_t d;
-  result = std::from_chars(num.data(), num.data() + num.size(), d);
+  result = std::from_chars(den.data(), den.data() + den.size(), d);
   if (result.ec != std::errc{}) {
-    throw std::runtime_error(
-        fmt::format("decimal parsing failed: {} . {}", num, den));
+    return std::unexpected(Code::bad_number);
   }
-  auto dec = decimal_places(d);
-  return Number(ipow10(n, dec) + d, dec);
+  // the digit count rather than the value, so 0.05 keeps its leading zero
+  return Number(ipow10(n, den.size()) + d, ipow10(1, den.size()));
 }
-} // namespace
 
-std::vector<Word> tokenize(std::string_view input) {
-  std::vector<Word> result;
-  constexpr auto tokenize =
-      ctre::range<R"((\d+)(?:\.(\d+))?|([+\-*/^()=√])|(pi|tau|[ieπτ])|(\S))">;
+// the tokenizer behind every entry point, it reuses result's storage
+std::expected<void, ParseError> tokenize_into(std::string_view input,
+                                              Words &result) {
+  FCALC_TRACE_SCOPE(tokenize);
+  result.clear();
+  constexpr auto tokenize = ctre::range<
+      R"((\d+)(?:\.(\d+))?|(sin|cos|log|exp|abs|min|max)\(|(==|[+\-*/^()=√,<>?:])|(pi|tau|[ieπτ])|(\S))">;
   result.reserve(20);
+  // calls still waiting for their ")", by word index and byte offset
+  struct Open {
+    uint32_t word, offset;
+  };
+  std::vector<Open, Allocator<Open>> open;
   for (auto &&match : tokenize(str_cast(input))) {
+    std::expected<Word, Code> word;
     if (auto num = match.get<1>()) {
       auto den = match.get<2>();
       if (!den) {
-        result.push_back(makeNum(str_cast(num)));
+        word = makeNum(str_cast(num));
       } else {
-        result.push_back(makeDec(str_cast(num), str_cast(den)));
+        word = makeDec(str_cast(num), str_cast(den));
+      }
+    } else if (auto fn = match.get<3>()) {
+      word = makeFn(str_cast(fn));
+    } else if (auto op = match.get<4>()) {
+      word = makeOp(str_cast(op));
+    } else if (auto constant = match.get<5>()) {
+      word = makeCon(str_cast(constant));
+    } else if (auto var = match.get<6>()) {
+      word = Variable(str_cast(var));
+    }
+    uint32_t offset = str_cast(match.get<0>()).data() - input.data();
+    if (!word)
+      return std::unexpected(ParseError{word.error(), offset});
+    uint32_t index = result.size();
+    if (word->type == WordType::Function) {
+      open.push_back({index, offset});
+    } else if (word->type == WordType::Token && word->tok.s.view() != ":") {
+      if (open.empty())
+        return std::unexpected(ParseError{Code::unexpected_token, offset});
+      auto &call = result[open.back().word].fn;
+      bool pair = Function::arity(call.op) == 2;
+      if (word->tok.s.view() == ",") {
+        if (!pair || call.second_arg != 0)
+          return std::unexpected(ParseError{Code::bad_arity, offset});
+        call.second_arg = index + 1 - open.back().word;
+      } else {
+        if (pair && call.second_arg == 0)
+          return std::unexpected(ParseError{Code::bad_arity, offset});
+        call.size = index + 1 - open.back().word;
+        open.pop_back();
+      }
+    }
+    word->offset = offset;
+    result.push_back(std::move(*word));
+  }
+  if (!open.empty())
+    return std::unexpected(ParseError{Code::unclosed_call, open.back().offset});
+  return {};
+}
+
+// after tokenize the only tokens left are the "," and ")" of calls and the
+// ":" of conditionals
+bool is_separator(const Word &w) noexcept { return w.type == WordType::Token; }
+bool closes_call(const Word &w) noexcept {
+  return w.type == WordType::Token && w.tok.s.view() == ")";
+}
+bool is_colon(const Word &w) noexcept {
+  return w.type == WordType::Token && w.tok.s.view() == ":";
+}
+// whether an operand can end at w
+bool ends_operand(const Word &w) noexcept {
+  return is_value(w.type) || closes_call(w);
+}
+
+// steps over a whole call, so the operators inside its arguments stay out
+// of the expression around it
+std::span<Word>::iterator next_item(std::span<Word>::iterator it) noexcept {
+  if (it->type == WordType::Function)
+    return it + std::max<uint32_t>(it->fn.size, 1);
+  return it + 1;
+}
+
+// keeps the offset of the "-" it replaces
+void to_minus(Word &w) {
+  auto offset = w.offset;
+  w = Word(Unary::Ops::minus);
+  w.offset = offset;
+}
+
+void rewrite_minus(std::span<Word> s) {
+  if (s.size() >= 2) {
+    if (s.front() == Word(Binary::Ops::sub))
+      to_minus(s.front());
+    for (auto &&a : s | std::ranges::views::slide(2)) {
+      if (a[1] == Word(Binary::Ops::sub) && !ends_operand(a[0])) {
+        to_minus(a[1]);
       }
-    } else if (auto op = match.get<3>()) {
-      result.push_back(makeOp(str_cast(op)));
-    } else if (auto constant = match.get<4>()) {
-      result.push_back(makeCon(str_cast(constant)));
-    } else if (auto var = match.get<5>()) {
-      result.push_back(Variable(str_cast(var)));
     }
   }
+}
+
+// the shapes parse can't make sense of, checked once minus is sorted out.
+// gives the index of the offending word
+std::expected<void, ParseError> check(std::span<const Word> s) {
+  if (s.empty())
+    return std::unexpected(ParseError{Code::empty, 0});
+  for (uint32_t i = 0; i != s.size(); ++i) {
+    auto type = s[i].type;
+    // the end of the input or of a call argument
+    bool last = i + 1 == s.size() || is_separator(s[i + 1]);
+    // an operator, a call or a "," with nothing after it
+    if (type != WordType::Binary && !ends_operand(s[i]) && last)
+      return std::unexpected(ParseError{Code::missing_operand, i});
+    if (type != WordType::Binary && type != WordType::Ternary)
+      continue;
+    if (i == 0 || last || !ends_operand(s[i - 1]))
+      return std::unexpected(ParseError{Code::missing_operand, i});
+    if (type == WordType::Binary && s[i].bin.op == Binary::Ops::assign &&
+        (i != 1 || s[0].type != WordType::Variable))
+      return std::unexpected(ParseError{Code::misplaced_assign, i});
+  }
+  // every "?" needs a ":" within the same call argument. open holds the
+  // "?" still waiting, calls where each call's ones start
+  std::vector<uint32_t> open, calls;
+  for (uint32_t i = 0; i != s.size(); ++i) {
+    size_t base = calls.empty() ? 0 : calls.back();
+    if (s[i].type == WordType::Function) {
+      calls.push_back(open.size());
+    } else if (s[i].type == WordType::Ternary) {
+      open.push_back(i);
+    } else if (is_colon(s[i])) {
+      if (open.size() == base)
+        return std::unexpected(ParseError{Code::unmatched_conditional, i});
+      open.pop_back();
+    } else if (is_separator(s[i])) {
+      if (open.size() != base)
+        return std::unexpected(
+            ParseError{Code::unmatched_conditional, open.back()});
+      if (closes_call(s[i]))
+        calls.pop_back();
+    }
+  }
+  if (!open.empty())
+    return std::unexpected(
+        ParseError{Code::unmatched_conditional, open.back()});
+  return {};
+}
+} // namespace
+
+std::string ParseError::message(std::string_view input) const {
+  if (offset >= input.size())
+    return fmt::format("{} at {}", format_as(code), offset);
+  auto near = input.substr(offset, input.find(' ', offset) - offset);
+  return fmt::format("{} at {}: {}", format_as(code), offset,
+                     near.substr(0, 16));
+}
+
+Words tokenize(std::string_view input) {
+  Words result;
+  if (auto ok = tokenize_into(input, result); !ok)
+    throw std::runtime_error(ok.error().message(input));
+  return result;
+}
+std::expected<Words, ParseError>
+try_tokenize(std::string_view input) {
+  Words result;
+  if (auto ok = tokenize_into(input, result); !ok)
+    return std::unexpected(ok.error());
   return result;
 }
+std::expected<void, ParseError> try_tokenize(std::string_view input,
+                                             Words &words) {
+  return tokenize_into(input, words);
+}
+
 // the algorithm basically implements a binary-search-like pattern,
 // dividing it up from weakest operand to strongest
 inline void bin_prefix(std::span<Word> terms, std::span<Word>::iterator op,
@@ -129,9 +295,19 @@ inline void bin_prefix(std::span<Word> terms, std::span<Word>::iterator op,
     for (auto op_t = optype;
          to_underlying(op_t) < to_underlying(Binary::Ops::exp) + 1;
          op_t = static_cast<Binary::Ops>(to_underlying(op_t) + 1)) {
-      auto pivot = std::ranges::find_if(range, [&](auto &&t) {
+      auto is_op = [&](auto &&t) {
         return t.type == WordType::Binary && t.bin.op == op_t;
-      });
+      };
+      // exp is right associative so it splits at the first one, everything
+      // else splits at the last one to stay left associative
+      auto pivot = range.end();
+      for (auto it = range.begin(); it != range.end(); it = next_item(it)) {
+        if (is_op(*it)) {
+          pivot = it;
+          if (op_t == Binary::Ops::exp)
+            break;
+        }
+      }
       if (pivot != range.end()) {
         bin_prefix(range, pivot, op_t);
         break;
@@ -145,37 +321,124 @@ inline void bin_prefix(std::span<Word> terms, std::span<Word>::iterator op,
     op->bin.second_arg = std::distance(terms.begin(), op) + 1;
     std::ranges::rotate(std::span(terms.begin(), op + 1), op);
   } else {
-    op->bin.second_arg = 2;
-    std::swap(*op, op[-1]);
+    // the lhs of ^ is the one item before it, a whole call if that ends in
+    // a ")"
+    auto lhs = op - 1;
+    if (closes_call(*lhs)) {
+      while (lhs->type != WordType::Function || lhs + lhs->fn.size != op)
+        --lhs;
+    }
+    op->bin.second_arg = std::distance(lhs, op) + 1;
+    std::ranges::rotate(std::span(lhs, op + 1), op);
   }
 }
 auto find_smallest(std::span<Word> s) {
-  std::span<Word>::iterator smallest = s.begin() + 1;
-  for (auto it = s.begin() + 1; it != s.end(); ++it) {
+  auto smallest = s.end();
+  for (auto it = next_item(s.begin()); it != s.end(); it = next_item(it)) {
     if (it->type == WordType::Binary) {
-      if (smallest->type != WordType::Binary) {
+      if (smallest == s.end()) {
         smallest = it;
       } else if (std::to_underlying(it->bin.op) <
-                 std::to_underlying(smallest->bin.op))
+                     std::to_underlying(smallest->bin.op) ||
+                 (it->bin.op == smallest->bin.op &&
+                  it->bin.op != Binary::Ops::exp))
         smallest = it;
     }
   }
   return smallest;
 }
-void parse(std::span<Word> s) {
-  if (s.size() >= 2) {
-    if (s.front() == Word(Binary::Ops::sub))
-      s.front() = Word(Unary::Ops::minus);
-    for (auto &&a : s | std::ranges::views::slide(2)) {
-      if (a[1] == Word(Binary::Ops::sub) && !is_value(a[0].type)) {
-        a[1] = Word(Unary::Ops::minus);
-      }
-    }
+void to_prefix(std::span<Word> s);
+
+// the first "?" outside of calls is the outermost conditional, the
+// condition can't hold another one. it moves in front of the condition,
+// both arms stay where they are and each part is parsed on its own
+bool conditional_prefix(std::span<Word> s) {
+  auto q = s.begin();
+  while (q != s.end() && q->type != WordType::Ternary)
+    q = next_item(q);
+  if (q == s.end())
+    return false;
+  // "v = c ? a : b" assigns the whole conditional
+  if (s.size() > 2 && s[1].type == WordType::Binary &&
+      s[1].bin.op == Binary::Ops::assign) {
+    s[1].bin.second_arg = 2;
+    std::swap(s[0], s[1]);
+    to_prefix(s.subspan(2));
+    return true;
   }
+  auto colon = q + 1;
+  for (uint32_t depth = 0; colon != s.end(); colon = next_item(colon)) {
+    if (colon->type == WordType::Ternary)
+      ++depth;
+    else if (is_colon(*colon) && depth-- == 0)
+      break;
+  }
+  if (colon == s.end())
+    return false;
+  auto cond = std::distance(s.begin(), q);
+  auto mid = std::distance(s.begin(), colon);
+  std::ranges::rotate(std::span(s.begin(), q + 1), q);
+  s[0].ter.second_arg = cond + 1;
+  s[0].ter.third_arg = mid + 1;
+  to_prefix(s.subspan(1, cond));
+  to_prefix(s.subspan(cond + 1, mid - cond - 1));
+  to_prefix(s.subspan(mid + 1));
+  return true;
+}
+
+void to_prefix(std::span<Word> s) {
+  if (conditional_prefix(s))
+    return;
   if (s.size() >= 3) {
     auto smallest = find_smallest(s);
-    bin_prefix(s, smallest, smallest->bin.op);
+    if (smallest != s.end())
+      bin_prefix(s, smallest, smallest->bin.op);
   }
+  // calls get moved around whole, then their arguments are parsed on their
+  // own
+  for (auto it = s.begin(); it != s.end(); it = next_item(it)) {
+    if (it->type != WordType::Function)
+      continue;
+    auto close = it + it->fn.size - 1;
+    if (it->fn.second_arg == 0) {
+      to_prefix(std::span(it + 1, close));
+    } else {
+      auto mid = it + it->fn.second_arg;
+      to_prefix(std::span(it + 1, mid - 1));
+      to_prefix(std::span(mid, close));
+    }
+  }
+}
+void parse(std::span<Word> s) {
+  FCALC_TRACE_SCOPE(parse);
+  rewrite_minus(s);
+  to_prefix(s);
+}
+std::expected<void, ParseError> try_parse(std::span<Word> s) {
+  FCALC_TRACE_SCOPE(parse);
+  rewrite_minus(s);
+  if (auto ok = check(s); !ok) {
+    // check gives the word, the word knows where it came from
+    auto error = ok.error();
+    if (error.offset < s.size())
+      error.offset = s[error.offset].offset;
+    return std::unexpected(error);
+  }
+  to_prefix(s);
+  return {};
+}
+std::expected<void, ParseError> try_read(std::string_view input,
+                                         Words &words) {
+  if (auto ok = tokenize_into(input, words); !ok)
+    return ok;
+  return try_parse(words);
+}
+std::expected<Words, ParseError>
+try_read(std::string_view input) {
+  Words words;
+  if (auto ok = try_read(input, words); !ok)
+    return std::unexpected(ok.error());
+  return words;
 }
 void resolve(std::span<Word> s);
 } // namespace fcalc
\ No newline at end of file
@@ -0,0 +1,259 @@
+#include "float_eval.hpp"
+#include "real_eval.hpp"
+#include "vmath.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fmt/format.h>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace fcalc {
+namespace {
+float float_constant(Constant::Types t) {
+  if (t == Constant::Types::i)
+    throw std::runtime_error("i has no real value, use evaluate_complex");
+  return float(to_double(t));
+}
+
+// a[i] = f(a[i], b[i]) over a whole block. the pointers are restrict
+// parameters because restrict locals are lost once the mode is inlined
+// into run_blocks, and the loop isn't vectorized without it
+template <typename F>
+void combine(float *__restrict a, const float *__restrict b, F f) noexcept {
+  for (size_t i = 0; i != block_rows; ++i)
+    a[i] = f(a[i], b[i]);
+}
+
+// c[i] = c[i] ? a[i] : b[i], with both arms loaded first so there is no
+// branch left to convert
+void blend(float *__restrict c, const float *__restrict a,
+           const float *__restrict b) noexcept {
+  for (size_t i = 0; i != block_rows; ++i) {
+    float x = a[i], y = b[i];
+    c[i] = c[i] != 0 ? x : y;
+  }
+}
+
+// BlockMode over floats. the loops are plain so that they vectorize to
+// whatever the run_ function they are flattened into targets. the cheap
+// ones run over the whole block even when fewer rows are left: -O2 only
+// vectorizes loops with a known trip count, and rows past n are never
+// stored. sqrt and pow call libm per row either way
+struct FloatMode {
+  std::span<const float *const> vars;
+  float *out;
+  std::vector<float> scratch;
+  // functions go through vmath in double
+  std::vector<double> wide;
+
+  float *slot(uint32_t s) noexcept { return scratch.data() + block_rows * s; }
+
+  void number(uint32_t s, const Number &v, size_t n) {
+    std::fill_n(slot(s), n, float(to_double(v)));
+  }
+  void constant(uint32_t s, Constant::Types t, size_t n) {
+    std::fill_n(slot(s), n, float_constant(t));
+  }
+  void variable(uint32_t s, uint32_t var, size_t row, size_t n) {
+    std::copy_n(vars[var] + row, n, slot(s));
+  }
+  void unary(Unary::Ops op, uint32_t s, size_t n) {
+    float *__restrict a = slot(s);
+    if (op == Unary::Ops::minus) {
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] = -a[i];
+    } else if (op == Unary::Ops::square) {
+      for (size_t i = 0; i != n; ++i)
+        a[i] *= a[i];
+    } else {
+      for (size_t i = 0; i != n; ++i)
+        a[i] = std::sqrt(a[i]);
+    }
+  }
+  void binary(Binary::Ops op, uint32_t sa, uint32_t sb, size_t n) {
+    float *__restrict a = slot(sa);
+    const float *__restrict b = slot(sb);
+    switch (op) {
+      using enum Binary::Ops;
+    case eq:
+      return combine(a, b,
+                     [](float x, float y) { return x == y ? 1.0f : 0.0f; });
+    case lt:
+      return combine(a, b,
+                     [](float x, float y) { return x < y ? 1.0f : 0.0f; });
+    case gt:
+      return combine(a, b,
+                     [](float x, float y) { return x > y ? 1.0f : 0.0f; });
+    case add:
+      return combine(a, b, [](float x, float y) { return x + y; });
+    case sub:
+      return combine(a, b, [](float x, float y) { return x - y; });
+    case mul:
+      return combine(a, b, [](float x, float y) { return x * y; });
+    case div:
+      return combine(a, b, [](float x, float y) { return x / y; });
+    case exp:
+      for (size_t i = 0; i != n; ++i)
+        a[i] = std::pow(a[i], b[i]);
+      return;
+    case assign:
+      break;
+    }
+    throw std::runtime_error("Unexpected assignment");
+  }
+  template <typename F> void widened(float *__restrict a, size_t n, F f) {
+    double *__restrict w = wide.data();
+    for (size_t i = 0; i != block_rows; ++i)
+      w[i] = a[i];
+    f(w, n);
+    for (size_t i = 0; i != block_rows; ++i)
+      a[i] = float(w[i]);
+  }
+  void function(Function::Ops op, uint32_t s, size_t n) {
+    float *__restrict a = slot(s);
+    const float *__restrict b = slot(s + 1);
+    switch (op) {
+      using enum Function::Ops;
+    case sin:
+      return widened(a, n, [](double *w, size_t n) { vmath::sin(w, n); });
+    case cos:
+      return widened(a, n, [](double *w, size_t n) { vmath::cos(w, n); });
+    case log:
+      return widened(a, n, [](double *w, size_t n) { vmath::log(w, n); });
+    case exp:
+      return widened(a, n, [](double *w, size_t n) { vmath::exp(w, n); });
+    case abs:
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] = std::abs(a[i]);
+      return;
+    case min:
+      return combine(a, b, [](float x, float y) { return y < x ? y : x; });
+    case max:
+      return combine(a, b, [](float x, float y) { return x < y ? y : x; });
+    }
+  }
+  void select(uint32_t s, size_t) {
+    blend(slot(s), slot(s + 1), slot(s + 2));
+  }
+  void store(size_t row, size_t n) { std::copy_n(slot(0), n, out + row); }
+};
+
+// one copy of run_blocks and everything it calls per instruction set.
+// flatten inlines the whole call tree, so none of it falls back to the
+// baseline target. avx2 and avx512 have fma, this file is built with
+// -ffp-contract=off so that a multiply and an add are never fused into one
+// and every copy gives the same bits
+[[gnu::flatten]] void run_generic(ProgramView p, size_t rows,
+                                  FloatMode &mode) {
+  run_blocks(p, rows, mode);
+}
+[[gnu::flatten, gnu::target("avx2,fma")]] void
+run_avx2(ProgramView p, size_t rows, FloatMode &mode) {
+  run_blocks(p, rows, mode);
+}
+// without prefer-vector-width gcc sticks to ymm registers on avx512
+[[gnu::flatten, gnu::target("avx512f,prefer-vector-width=512")]] void
+run_avx512(ProgramView p, size_t rows, FloatMode &mode) {
+  run_blocks(p, rows, mode);
+}
+
+FloatIsa detect() noexcept {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return FloatIsa::avx512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return FloatIsa::avx2;
+  return FloatIsa::generic;
+}
+
+double relative_error(float got, double want) noexcept {
+  if (got == want || (std::isnan(got) && std::isnan(want)))
+    return 0;
+  if (std::isnan(got) || std::isnan(want) || want == 0)
+    return std::numeric_limits<double>::infinity();
+  return std::abs((double(got) - want) / want);
+}
+} // namespace
+
+FloatIsa float_isa() noexcept {
+  static const FloatIsa isa = detect();
+  return isa;
+}
+
+unsigned float_lanes(FloatIsa isa) noexcept {
+  switch (isa) {
+  case FloatIsa::generic:
+    break;
+  case FloatIsa::avx2:
+    return 8;
+  case FloatIsa::avx512:
+    return 16;
+  }
+  return 4;
+}
+
+void FloatError::merge(const FloatError &o) noexcept {
+  if (o.max_relative > max_relative) {
+    max_relative = o.max_relative;
+    worst_row = o.worst_row;
+  }
+  samples += o.samples;
+}
+
+void evaluate_float(ProgramView p, std::span<const float *const> vars,
+                    float *out, size_t rows) {
+  evaluate_float(p, vars, out, rows, float_isa());
+}
+
+void evaluate_float(ProgramView p, std::span<const float *const> vars,
+                    float *out, size_t rows, FloatIsa isa) {
+  if (isa > float_isa())
+    throw std::runtime_error(
+        fmt::format("This cpu can't run the {} kernels", format_as(isa)));
+  if (vars.size() < p.variables)
+    throw std::runtime_error(fmt::format("Expected {} variable columns, got {}",
+                                         p.variables, vars.size()));
+  FloatMode mode{vars, out, std::vector<float>(block_rows * p.max_depth),
+                 std::vector<double>(block_rows)};
+  switch (isa) {
+  case FloatIsa::generic:
+    return run_generic(p, rows, mode);
+  case FloatIsa::avx2:
+    return run_avx2(p, rows, mode);
+  case FloatIsa::avx512:
+    return run_avx512(p, rows, mode);
+  }
+}
+
+FloatError evaluate_float(ProgramView p, std::span<const float *const> vars,
+                          float *out, size_t rows, size_t sample_every) {
+  if (sample_every == 0)
+    throw std::runtime_error("sample_every has to be at least 1");
+  evaluate_float(p, vars, out, rows);
+  // the sampled rows gathered into double columns and run through the
+  // double block evaluation
+  size_t samples = (rows + sample_every - 1) / sample_every;
+  std::vector<double> inputs(samples * p.variables);
+  std::vector<const double *> columns(p.variables);
+  for (uint32_t v = 0; v != p.variables; ++v) {
+    double *column = inputs.data() + samples * v;
+    for (size_t k = 0; k != samples; ++k)
+      column[k] = vars[v][k * sample_every];
+    columns[v] = column;
+  }
+  std::vector<double> want(samples);
+  evaluate(p, columns, want.data(), samples);
+
+  FloatError error{0, 0, samples};
+  for (size_t k = 0; k != samples; ++k) {
+    double e = relative_error(out[k * sample_every], want[k]);
+    if (e > error.max_relative) {
+      error.max_relative = e;
+      error.worst_row = k * sample_every;
+    }
+  }
+  return error;
+}
+} // namespace fcalc
@@ -0,0 +1,384 @@
+#include "formula_set.hpp"
+#include "trace.hpp"
+#include "vmath.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fmt/format.h>
+#include <stdexcept>
+#include <vector>
+
+namespace fcalc {
+namespace {
+using Operand = FormulaSet::Operand;
+using Kind = Operand::Kind;
+
+Operand immediate(double v) noexcept { return {Kind::immediate, 0, v}; }
+
+double real_constant(Constant::Types t) {
+  if (t == Constant::Types::i)
+    throw std::runtime_error("i has no real value, use evaluate_complex");
+  return to_double(t);
+}
+
+// constants folded at compile time, with the same operations as the block
+// kernels below so a folded step gives the bits running it would
+double fold(WordType type, uint8_t op, double a, double b) {
+  if (type == WordType::Unary) {
+    switch (Unary::Ops(op)) {
+    case Unary::Ops::minus:
+      return -a;
+    case Unary::Ops::square:
+      return a * a;
+    case Unary::Ops::sqrt:
+      break;
+    }
+    return std::sqrt(a);
+  }
+  if (type == WordType::Binary) {
+    switch (Binary::Ops(op)) {
+      using enum Binary::Ops;
+    case eq:
+      return a == b ? 1 : 0;
+    case lt:
+      return a < b ? 1 : 0;
+    case gt:
+      return a > b ? 1 : 0;
+    case add:
+      return a + b;
+    case sub:
+      return a - b;
+    case mul:
+      return a * b;
+    case div:
+      return a / b;
+    case exp:
+      return std::pow(a, b);
+    case assign:
+      break;
+    }
+    throw std::runtime_error("Unexpected assignment");
+  }
+  switch (Function::Ops(op)) {
+    using enum Function::Ops;
+  case sin:
+    return vmath::sin(a);
+  case cos:
+    return vmath::cos(a);
+  case log:
+    return vmath::log(a);
+  case exp:
+    return vmath::exp(a);
+  case abs:
+    return std::abs(a);
+  case min:
+    return b < a ? b : a;
+  case max:
+    return a < b ? b : a;
+  }
+  return a;
+}
+
+// the value a step leaves is put at its stack position, so temps are
+// shared between formulas and only as many as the deepest one needs
+void apply(FormulaSet &set, std::vector<Operand> &stack, WordType type,
+           uint8_t op, uint32_t arity) {
+  Operand b{};
+  if (arity == 2) {
+    b = stack.back();
+    stack.pop_back();
+  }
+  Operand a = stack.back();
+  stack.pop_back();
+  if (a.kind == Kind::immediate &&
+      (arity == 1 || b.kind == Kind::immediate)) {
+    stack.push_back(immediate(fold(type, op, a.value, b.value)));
+    return;
+  }
+  auto dst = uint32_t(stack.size());
+  set.temps = std::max(set.temps, dst + 1);
+  set.steps.push_back({type, op, dst, a, b, {}});
+  stack.push_back({Kind::temp, dst});
+}
+
+// a constant condition picks its arm at compile time, the other one's
+// steps still run but nothing reads them. a temp arm still goes through
+// the step, which moves it down to this stack position
+void conditional(FormulaSet &set, std::vector<Operand> &stack) {
+  Operand c = stack.back();
+  stack.pop_back();
+  Operand b = stack.back();
+  stack.pop_back();
+  Operand a = stack.back();
+  stack.pop_back();
+  Operand taken = a.value != 0 ? b : c;
+  if (a.kind == Kind::immediate && taken.kind != Kind::temp) {
+    stack.push_back(taken);
+    return;
+  }
+  auto dst = uint32_t(stack.size());
+  set.temps = std::max(set.temps, dst + 1);
+  set.steps.push_back({WordType::Ternary, 0, dst, a, b, c});
+  stack.push_back({Kind::temp, dst});
+}
+
+uint32_t variable_slot(FormulaSet &set, const SmolString &name) {
+  auto it = std::ranges::find(set.variables, name);
+  if (it != set.variables.end())
+    return it - set.variables.begin();
+  set.variables.push_back(name);
+  return set.variables.size() - 1;
+}
+
+struct Broadcast {
+  double v;
+  double operator[](size_t) const noexcept { return v; }
+};
+
+// runs the steps a block at a time. every loop covers the whole block so
+// -O2 vectorizes it, the last block reads its variables from a padded copy
+// and the rows past the end are never written out
+struct Runner {
+  const FormulaSet &set;
+  std::span<const double *const> vars;
+  std::vector<double> temps;
+  std::vector<double> tail;
+  size_t row = 0;
+  bool padded = false;
+
+  double *temp(uint32_t t) noexcept { return temps.data() + block_rows * t; }
+  const double *column(uint32_t v) const noexcept {
+    return padded ? tail.data() + block_rows * v : vars[v] + row;
+  }
+  const double *pointer(const Operand &o) noexcept {
+    return o.kind == Kind::temp ? temp(o.index) : column(o.index);
+  }
+
+  void start_block(size_t r, size_t n) {
+    row = r;
+    padded = n != block_rows;
+    if (padded) {
+      tail.assign(block_rows * set.variables.size(), 0);
+      for (uint32_t v = 0; v != set.variables.size(); ++v)
+        std::copy_n(vars[v] + row, n, tail.data() + block_rows * v);
+    }
+  }
+
+  template <typename B>
+  void binary(Binary::Ops op, double *__restrict a, B b) {
+    switch (op) {
+      using enum Binary::Ops;
+    case eq:
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] = a[i] == b[i] ? 1.0 : 0.0;
+      return;
+    case lt:
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] = a[i] < b[i] ? 1.0 : 0.0;
+      return;
+    case gt:
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] = a[i] > b[i] ? 1.0 : 0.0;
+      return;
+    case add:
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] += b[i];
+      return;
+    case sub:
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] -= b[i];
+      return;
+    case mul:
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] *= b[i];
+      return;
+    case div:
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] /= b[i];
+      return;
+    case exp:
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] = std::pow(a[i], b[i]);
+      return;
+    case assign:
+      break;
+    }
+    throw std::runtime_error("Unexpected assignment");
+  }
+  template <typename B>
+  void function(Function::Ops op, double *__restrict a, B b) {
+    switch (op) {
+      using enum Function::Ops;
+    case sin:
+      return vmath::sin(a, block_rows);
+    case cos:
+      return vmath::cos(a, block_rows);
+    case log:
+      return vmath::log(a, block_rows);
+    case exp:
+      return vmath::exp(a, block_rows);
+    case abs:
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] = std::abs(a[i]);
+      return;
+    case min:
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] = b[i] < a[i] ? b[i] : a[i];
+      return;
+    case max:
+      for (size_t i = 0; i != block_rows; ++i)
+        a[i] = a[i] < b[i] ? b[i] : a[i];
+      return;
+    }
+  }
+  // both arms are loaded first so the loop is a blend, not a branch
+  template <typename B, typename C>
+  void select(double *__restrict a, B b, C c) {
+    for (size_t i = 0; i != block_rows; ++i) {
+      double x = b[i], y = c[i];
+      a[i] = a[i] != 0 ? x : y;
+    }
+  }
+  template <typename B> void run(const FormulaSet::Step &s, double *a, B b) {
+    switch (s.type) {
+      using enum WordType;
+    case Unary:
+      if (Unary::Ops(s.op) == Unary::Ops::minus) {
+        for (size_t i = 0; i != block_rows; ++i)
+          a[i] = -a[i];
+      } else if (Unary::Ops(s.op) == Unary::Ops::square) {
+        for (size_t i = 0; i != block_rows; ++i)
+          a[i] *= a[i];
+      } else {
+        for (size_t i = 0; i != block_rows; ++i)
+          a[i] = std::sqrt(a[i]);
+      }
+      return;
+    case Binary:
+      return binary(Binary::Ops(s.op), a, b);
+    case Function:
+      return function(Function::Ops(s.op), a, b);
+    default:
+      throw std::runtime_error("Unexpected step in formula set");
+    }
+  }
+
+  // the first operand is moved into dst and the op applied in place, like
+  // the stack slots of BlockMode
+  // calls f with an operand as something to index, without a branch in
+  // the loop for immediates
+  template <typename F> void with(const Operand &o, F f) {
+    if (o.kind == Kind::immediate)
+      f(Broadcast{o.value});
+    else
+      f(pointer(o));
+  }
+
+  void step(const FormulaSet::Step &s) {
+    double *dst = temp(s.dst);
+    if (s.a.kind == Kind::immediate)
+      std::fill_n(dst, block_rows, s.a.value);
+    else if (s.a.kind != Kind::temp || s.a.index != s.dst)
+      std::copy_n(pointer(s.a), block_rows, dst);
+    if (s.type == WordType::Ternary)
+      with(s.b, [&](auto b) { with(s.c, [&](auto c) { select(dst, b, c); }); });
+    else
+      with(s.b, [&](auto b) { run(s, dst, b); });
+  }
+
+  void store(const Operand &value, double *out, size_t n) {
+    if (value.kind == Kind::immediate)
+      std::fill_n(out, n, value.value);
+    else
+      std::copy_n(pointer(value), n, out);
+  }
+};
+
+// row major results go through a block per formula_group formulas, which
+// is written out a cache line per row instead of a double per row
+constexpr size_t formula_group = 8;
+} // namespace
+
+FormulaSet compile_set(std::span<const std::span<const Word>> formulas) {
+  FCALC_TRACE_SCOPE(compile);
+  FormulaSet set;
+  std::vector<Operand> stack;
+  std::vector<uint32_t> slots;
+  for (auto words : formulas) {
+    auto p = compile(words);
+    slots.clear();
+    for (auto &v : p.variables)
+      slots.push_back(variable_slot(set, v));
+    stack.clear();
+    for (auto &ins : p.code) {
+      switch (ins.type) {
+        using enum WordType;
+      case Number:
+        stack.push_back(immediate(to_double(p.numbers[ins.arg])));
+        break;
+      case Constant:
+        stack.push_back(immediate(real_constant(Constant::Types(ins.op))));
+        break;
+      case Variable:
+        stack.push_back({Kind::variable, slots[ins.arg]});
+        break;
+      case Unary:
+        apply(set, stack, Unary, ins.op, 1);
+        break;
+      case Binary:
+        apply(set, stack, Binary, ins.op, 2);
+        break;
+      case Function:
+        apply(set, stack, Function, ins.op,
+              Function::arity(Function::Ops(ins.op)));
+        break;
+      case Ternary:
+        conditional(set, stack);
+        break;
+      case Token:
+        break;
+      }
+    }
+    set.results.push_back({uint32_t(set.steps.size()), stack.back()});
+  }
+  return set;
+}
+
+void evaluate(const FormulaSet &set, std::span<const double *const> vars,
+              double *out, size_t rows, Layout layout) {
+  FCALC_TRACE_SCOPE(evaluate);
+  if (vars.size() < set.variables.size())
+    throw std::runtime_error(fmt::format("Expected {} variable columns, got {}",
+                                         set.variables.size(), vars.size()));
+  Runner runner{set, vars, std::vector<double>(block_rows * set.temps), {}};
+  size_t formulas = set.results.size();
+  std::vector<double> group;
+  if (layout == Layout::row_major)
+    group.resize(block_rows * formula_group);
+  for (size_t row = 0; row < rows; row += block_rows) {
+    size_t n = std::min(block_rows, rows - row);
+    runner.start_block(row, n);
+    uint32_t begin = 0;
+    for (size_t f = 0; f != formulas; ++f) {
+      auto &result = set.results[f];
+      for (uint32_t s = begin; s != result.end; ++s)
+        runner.step(set.steps[s]);
+      begin = result.end;
+      if (layout == Layout::column_major) {
+        runner.store(result.value, out + f * rows + row, n);
+        continue;
+      }
+      size_t k = f % formula_group;
+      runner.store(result.value, group.data() + block_rows * k, n);
+      if (k + 1 != formula_group && f + 1 != formulas)
+        continue;
+      size_t first = f - k;
+      for (size_t i = 0; i != n; ++i) {
+        double *line = out + (row + i) * formulas + first;
+        for (size_t j = 0; j <= k; ++j)
+          line[j] = group[block_rows * j + i];
+      }
+    }
+  }
+}
+} // namespace fcalc
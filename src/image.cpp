@@ -0,0 +1,249 @@
+#include "image.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace fcalc {
+namespace image {
+// fnv-1a
+uint64_t checksum(std::span<const char> data) noexcept {
+  uint64_t h = 0xcbf29ce484222325;
+  for (char c : data) {
+    h ^= uint8_t(c);
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+} // namespace image
+
+namespace {
+uint64_t align8(uint64_t n) noexcept { return (n + 7) & ~uint64_t{7}; }
+
+struct Builder {
+  std::vector<char> bytes;
+
+  // copies data in at the next 8 byte boundary and returns its offset
+  template <typename T> uint64_t append(std::span<const T> data) {
+    bytes.resize(align8(bytes.size()));
+    uint64_t offset = bytes.size();
+    auto raw = reinterpret_cast<const char *>(data.data());
+    bytes.insert(bytes.end(), raw, raw + data.size_bytes());
+    return offset;
+  }
+};
+} // namespace
+
+void write_image(const std::string &path, std::span<const Program> programs) {
+  std::vector<std::string_view> names;
+  std::unordered_map<std::string_view, uint32_t> ids;
+  auto intern = [&](std::string_view name) {
+    auto [it, inserted] = ids.try_emplace(name, uint32_t(names.size()));
+    if (inserted)
+      names.push_back(name);
+    return it->second;
+  };
+
+  Builder b;
+  b.bytes.resize(sizeof(image::Header));
+  // the index goes first, it gets filled in once the offsets are known
+  std::vector<image::Formula> formulas(programs.size());
+  auto formulas_offset = b.append(std::span<const image::Formula>(formulas));
+  std::vector<uint32_t> vars;
+  std::vector<char> code;
+  for (size_t i = 0; i != programs.size(); ++i) {
+    auto &p = programs[i];
+    auto &f = formulas[i];
+    vars.clear();
+    for (auto &v : p.variables)
+      vars.push_back(intern(v.view()));
+    // field by field into zeroed bytes, so the padding is zero too and the
+    // same programs always give the same image
+    code.assign(p.code.size() * sizeof(Instr), 0);
+    for (size_t k = 0; k != p.code.size(); ++k) {
+      auto at = code.data() + k * sizeof(Instr);
+      auto &ins = p.code[k];
+      std::memcpy(at + offsetof(Instr, type), &ins.type, sizeof(ins.type));
+      std::memcpy(at + offsetof(Instr, op), &ins.op, sizeof(ins.op));
+      std::memcpy(at + offsetof(Instr, arg), &ins.arg, sizeof(ins.arg));
+    }
+    f.code = b.append(std::span<const char>(code));
+    f.numbers = b.append(std::span(p.numbers));
+    f.variables = b.append(std::span<const uint32_t>(vars));
+    f.code_size = p.code.size();
+    f.number_count = p.numbers.size();
+    f.variable_count = vars.size();
+    f.max_depth = p.max_depth;
+    f.target = p.target ? intern(p.target->view()) : image::no_symbol;
+  }
+  std::vector<image::Symbol> symbols;
+  for (auto name : names)
+    symbols.push_back({b.append(std::span(name)), name.size()});
+  auto symbols_offset = b.append(std::span<const image::Symbol>(symbols));
+  b.bytes.resize(align8(b.bytes.size()));
+  std::memcpy(b.bytes.data() + formulas_offset, formulas.data(),
+              formulas.size() * sizeof(image::Formula));
+
+  image::Header h{};
+  std::memcpy(h.magic, image::magic, sizeof(h.magic));
+  h.version = image::version;
+  h.byte_order = image::byte_order;
+  h.size = b.bytes.size();
+  h.formula_count = formulas.size();
+  h.symbol_count = symbols.size();
+  h.formulas = formulas_offset;
+  h.symbols = symbols_offset;
+  h.payload_checksum =
+      image::checksum(std::span(b.bytes).subspan(sizeof(image::Header)));
+  h.header_checksum =
+      image::checksum(std::span(reinterpret_cast<const char *>(&h),
+                                offsetof(image::Header, header_checksum)));
+  std::memcpy(b.bytes.data(), &h, sizeof(h));
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(b.bytes.data(), b.bytes.size());
+  if (!out)
+    throw std::runtime_error(fmt::format("Could not write image {}", path));
+}
+
+struct Image::Checked {
+  // 0 until verify has run, then 1 for a match and -1 for a mismatch
+  std::atomic<int8_t> payload{0};
+  std::unique_ptr<std::atomic<bool>[]> programs;
+};
+
+Image::Image(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error(
+        fmt::format("Could not open image {}: {}", path, std::strerror(errno)));
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(image::Header)) {
+    ::close(fd);
+    throw std::runtime_error(
+        fmt::format("{} is too small to be an image", path));
+  }
+  auto mapped = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED)
+    throw std::runtime_error(
+        fmt::format("Could not map image {}: {}", path, std::strerror(errno)));
+  base = static_cast<const char *>(mapped);
+  bytes = st.st_size;
+
+  auto fail = [&](std::string_view why) {
+    ::munmap(mapped, bytes);
+    throw std::runtime_error(fmt::format("Bad image {}: {}", path, why));
+  };
+  auto &h = header();
+  if (std::memcmp(h.magic, image::magic, sizeof(h.magic)) != 0)
+    fail("not an fcalc image");
+  if (h.byte_order != image::byte_order)
+    fail("written with a different byte order");
+  if (h.version != image::version)
+    fail(fmt::format("version {}, expected {}", h.version, image::version));
+  auto header_bytes = std::span(base, offsetof(image::Header, header_checksum));
+  if (h.header_checksum != image::checksum(header_bytes))
+    fail("header checksum mismatch");
+  if (h.size != bytes)
+    fail("size does not match the header");
+  try {
+    section<image::Formula>(h.formulas, h.formula_count);
+    section<image::Symbol>(h.symbols, h.symbol_count);
+  } catch (std::out_of_range &) {
+    fail("index out of bounds");
+  }
+  checked = std::make_unique<Checked>();
+  checked->programs = std::make_unique<std::atomic<bool>[]>(h.formula_count);
+}
+
+Image::Image(Image &&other) noexcept { swap(*this, other); }
+
+Image &Image::operator=(Image other) noexcept {
+  swap(*this, other);
+  return *this;
+}
+
+Image::~Image() {
+  if (base)
+    ::munmap(const_cast<char *>(base), bytes);
+}
+
+template <typename T>
+std::span<const T> Image::section(uint64_t offset, uint64_t count) const {
+  if (offset % alignof(T) != 0 || offset > bytes ||
+      count > (bytes - offset) / sizeof(T))
+    throw std::out_of_range("Image section out of bounds");
+  return std::span(reinterpret_cast<const T *>(base + offset), count);
+}
+
+const image::Formula &Image::formula(size_t i) const {
+  if (i >= size())
+    throw std::out_of_range(
+        fmt::format("Image has {} formulas, asked for {}", size(), i));
+  return section<image::Formula>(header().formulas, size())[i];
+}
+
+ProgramView Image::program(size_t i) const {
+  auto &f = formula(i);
+  ProgramView p{section<Instr>(f.code, f.code_size),
+                section<Number>(f.numbers, f.number_count), f.variable_count,
+                f.max_depth};
+  // the checksum only catches accidents, evaluating trusts the code. two
+  // threads may both check it the first time, which is harmless
+  auto &ok = checked->programs[i];
+  if (ok.load(std::memory_order_acquire))
+    return p;
+  try {
+    check_program(p);
+  } catch (std::runtime_error &e) {
+    throw std::runtime_error(fmt::format("Bad formula {} in image: {}", i,
+                                         e.what()));
+  }
+  ok.store(true, std::memory_order_release);
+  return p;
+}
+
+std::span<const uint32_t> Image::variables(size_t i) const {
+  auto &f = formula(i);
+  return section<uint32_t>(f.variables, f.variable_count);
+}
+
+std::optional<std::string_view> Image::target(size_t i) const {
+  auto id = formula(i).target;
+  if (id == image::no_symbol)
+    return std::nullopt;
+  return symbol(id);
+}
+
+std::string_view Image::symbol(uint32_t id) const {
+  auto &h = header();
+  if (id >= h.symbol_count)
+    throw std::out_of_range(fmt::format("No symbol {} in image", id));
+  auto &s = section<image::Symbol>(h.symbols, h.symbol_count)[id];
+  auto chars = section<char>(s.offset, s.size);
+  return std::string_view(chars.data(), chars.size());
+}
+
+bool Image::verify() const noexcept {
+  auto &payload = checked->payload;
+  auto known = payload.load(std::memory_order_relaxed);
+  if (known == 0) {
+    auto sum =
+        image::checksum(std::span(base, bytes).subspan(sizeof(image::Header)));
+    known = sum == header().payload_checksum ? 1 : -1;
+    payload.store(known, std::memory_order_relaxed);
+  }
+  return known > 0;
+}
+} // namespace fcalc
@@ -1,11 +1,36 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
 #include <fmt/format.h>
+#include <fstream>
+#include <iostream>
+#include <optional>
 #include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fast_calc/csv.hpp"
+#include "fast_calc/decimal_eval.hpp"
 #include "fast_calc/fcalc.hpp"
+#include "fast_calc/image.hpp"
+#include "fast_calc/output.hpp"
+#include "fast_calc/pipeline.hpp"
+#include "fast_calc/real_eval.hpp"
+#include "fast_calc/server.hpp"
+#include "fast_calc/shard.hpp"
 
-void main_fun(std::span<std::string_view> args);
+int main_fun(std::span<std::string_view> args);
 int main(int argc, char *argv[]) {
   std::vector<std::string_view> args;
   args.reserve(argc);
@@ -13,12 +38,434 @@ int main(int argc, char *argv[]) {
     args.push_back(std::string_view(argv[i]));
   }
 
-  main_fun(args);
+  return main_fun(std::span(args).subspan(1));
+}
+
+namespace {
+void usage() {
+  fmt::print("usage: calc <file>                   evaluate every line\n"
+             "       calc --stats <file>           the same, with how each "
+             "stage did\n"
+             "       calc --decimal <scale> <file> evaluate every line in "
+             "fixed point\n"
+             "       calc --compile <file> <image> compile every line into an "
+             "image\n"
+             "       calc --image <image>          evaluate every formula in "
+             "an image\n"
+             "       calc --serve <address>        answer requests on a unix "
+             "socket, or tcp:<ip>:<port>\n"
+             "       calc --shard <workers> <file> evaluate every line on "
+             "workers\n"
+             "       calc --rows <formula> <rows>  evaluate formula for every "
+             "row\n"
+             "       calc --shard <workers> <formula> <rows>\n"
+             "                                     the same on workers\n"
+             "       calc --csv <formula> <csv>    evaluate formula for every "
+             "row of a csv file\n"
+             "workers is a count of local processes or a comma separated list "
+             "of addresses.\n"
+             "rows starts with a line of variable names, then a line of "
+             "values per row.\n"
+             "--output text|binary|arrow in front of --rows, --csv or --shard "
+             "picks how\n"
+             "results are written: a line each, raw little endian doubles or "
+             "an arrow ipc\n"
+             "stream. these evaluate powers and polynomials with "
+             "multiplications, which can\n"
+             "differ from pow in the last bits.\n");
+}
+
+std::vector<std::string> read_lines(std::string_view path) {
+  std::ifstream in{std::string(path)};
+  if (!in)
+    throw std::runtime_error(fmt::format("Could not open {}", path));
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(in, line);) {
+    if (!line.empty())
+      lines.push_back(std::move(line));
+  }
+  return lines;
+}
+
+void print_result(std::optional<std::string_view> target, const auto &value) {
+  if (target)
+    fmt::print("{} = {}\n", *target, value);
+  else
+    fmt::print("{}\n", value);
+}
+
+// in decimal, one line after another
+int run_decimal(std::string_view path, unsigned scale) {
+  int failed = 0;
+  for (auto &line : read_lines(path)) {
+    auto a = fcalc::try_read(line);
+    if (!a) {
+      fmt::print("{}: {}\n", line, a.error().message(line));
+      ++failed;
+      continue;
+    }
+    try {
+      auto p = fcalc::compile(*a);
+      if (!p.variables.empty()) {
+        fmt::print("{}: unbound variables\n", line);
+        ++failed;
+        continue;
+      }
+      auto target =
+          p.target ? std::optional(p.target->view()) : std::nullopt;
+      fcalc::Decimal value;
+      fcalc::evaluate_decimal(p, {}, &value, 1, scale);
+      print_result(target, fcalc::format_decimal(value, scale));
+    } catch (std::exception &e) {
+      fmt::print("{}: {}\n", line, e.what());
+      ++failed;
+    }
+  }
+  return failed != 0;
+}
+
+// in double, reading, parsing, evaluating and printing all at once. stats
+// shows how each stage did on stderr
+int run_file(std::string_view path, bool stats = false) {
+  std::ifstream in{std::string(path)};
+  if (!in)
+    throw std::runtime_error(fmt::format("Could not open {}", path));
+  std::fflush(stdout);
+  auto r = fcalc::run_pipeline(in, std::cout);
+  std::cout.flush();
+  if (stats) {
+    fmt::print(stderr, "{:<9} {:>8} {:>8} {:>8} {:>9} {:>9}\n", "stage",
+               "batches", "starved", "blocked", "occupancy", "busy ms");
+    for (auto &s : r.stages) {
+      fmt::print(stderr, "{:<9} {:>8} {:>8} {:>8} {:>9.2f} {:>9.1f}\n",
+                 s.name, s.batches, s.starved, s.blocked,
+                 s.batches ? double(s.queued) / s.batches : 0.0,
+                 std::chrono::duration<double, std::milli>(s.busy).count());
+    }
+  }
+  return r.failed != 0;
+}
+
+int compile_image(std::string_view path, std::string_view out) {
+  std::vector<fcalc::Program> programs;
+  for (auto &line : read_lines(path)) {
+    auto a = fcalc::tokenize(line);
+    fcalc::parse(a);
+    programs.push_back(fcalc::compile(a));
+  }
+  fcalc::write_image(std::string(out), programs);
+  fmt::print("wrote {} formulas to {}\n", programs.size(), out);
+  return 0;
+}
+
+int run_image(std::string_view path) {
+  fcalc::Image image{std::string(path)};
+  int failed = 0;
+  for (size_t i = 0; i != image.size(); ++i) {
+    if (!image.variables(i).empty()) {
+      fmt::print("{}: unbound variables\n", i);
+      ++failed;
+      continue;
+    }
+    try {
+      double value;
+      fcalc::evaluate(image.program(i), {}, &value, 1);
+      print_result(image.target(i), value);
+    } catch (std::exception &e) {
+      fmt::print("{}: {}\n", i, e.what());
+      ++failed;
+    }
+  }
+  return failed != 0;
+}
+fcalc::Server *serving = nullptr;
+void on_signal(int) {
+  if (serving)
+    serving->stop();
+}
+
+void run_server(fcalc::Server &server) {
+  serving = &server;
+  std::signal(SIGINT, on_signal);
+  std::signal(SIGTERM, on_signal);
+  server.run();
+  serving = nullptr;
+}
+
+int serve(std::string_view address) {
+  fcalc::Server server(std::string(address),
+                       std::max(1u, std::thread::hardware_concurrency()));
+  fmt::print("serving on {}\n", server.address());
+  std::fflush(stdout);
+  run_server(server);
+  return 0;
 }
 
-void main_fun(std::span<std::string_view> args) {
-  if (args.size() == 0) {
-    fmt::print("Please enter a file name\n");
-  } else {
+// calc --serve processes on unix sockets, stopped when this goes away. they
+// are forked before anything starts a thread
+struct LocalWorkers {
+  std::vector<pid_t> pids;
+  std::vector<std::string> addresses;
+
+  explicit LocalWorkers(unsigned count) {
+    unsigned threads =
+        std::max(1u, std::thread::hardware_concurrency() / count);
+    auto dir = std::filesystem::temp_directory_path();
+    std::fflush(stdout);
+    for (unsigned i = 0; i != count; ++i) {
+      auto address =
+          (dir / fmt::format("fcalc-{}-{}.sock", getpid(), i)).string();
+      pid_t pid = fork();
+      if (pid < 0)
+        throw std::runtime_error("Could not start a worker");
+      if (pid == 0) {
+        int status = 0;
+        try {
+          fcalc::Server server(address, threads);
+          run_server(server);
+        } catch (std::exception &e) {
+          fmt::print(stderr, "{}\n", e.what());
+          status = 1;
+        }
+        _exit(status);
+      }
+      pids.push_back(pid);
+      addresses.push_back(std::move(address));
+    }
+  }
+  LocalWorkers(const LocalWorkers &) = delete;
+  ~LocalWorkers() {
+    for (auto pid : pids)
+      kill(pid, SIGTERM);
+    for (auto pid : pids)
+      waitpid(pid, nullptr, 0);
   }
-}
\ No newline at end of file
+};
+
+// a count of local workers, or addresses separated by commas
+std::vector<std::string> worker_addresses(std::string_view workers,
+                                          std::optional<LocalWorkers> &local) {
+  unsigned count;
+  auto end = workers.data() + workers.size();
+  if (std::from_chars(workers.data(), end, count) ==
+      std::from_chars_result{end, std::errc{}}) {
+    if (count == 0)
+      throw std::runtime_error("Need at least one worker");
+    local.emplace(count);
+    // they take a moment to start listening
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    for (auto &a : local->addresses) {
+      for (;;) {
+        try {
+          close(fcalc::serve::connect(a));
+          break;
+        } catch (std::runtime_error &) {
+          if (std::chrono::steady_clock::now() > deadline)
+            throw;
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+      }
+    }
+    return local->addresses;
+  }
+  std::vector<std::string> addresses;
+  for (size_t at = 0; at <= workers.size();) {
+    auto comma = std::min(workers.find(',', at), workers.size());
+    addresses.emplace_back(workers.substr(at, comma - at));
+    at = comma + 1;
+  }
+  return addresses;
+}
+
+// "x = ..." prints as such. workers only send values back, so the target is
+// read off the text of a line that parsed, where it's a single code point
+std::optional<std::string_view> target_of(std::string_view line) {
+  auto at = line.find_first_not_of(" \t");
+  if (at == std::string_view::npos)
+    return std::nullopt;
+  size_t size = 1;
+  while (at + size != line.size() && (line[at + size] & 0xc0) == 0x80)
+    ++size;
+  auto rest = line.substr(at + size);
+  rest.remove_prefix(std::min(rest.find_first_not_of(" \t"), rest.size()));
+  if (!rest.starts_with('=') || rest.starts_with("=="))
+    return std::nullopt;
+  return line.substr(at, size);
+}
+
+int shard_file(std::string_view workers, std::string_view path) {
+  std::optional<LocalWorkers> local;
+  fcalc::Coordinator coordinator(worker_addresses(workers, local));
+  auto lines = read_lines(path);
+  std::vector<std::string_view> views(lines.begin(), lines.end());
+  auto results = coordinator.evaluate(views);
+  int failed = 0;
+  for (size_t i = 0; i != lines.size(); ++i) {
+    auto &r = results[i];
+    if (r.status == fcalc::serve::Status::ok) {
+      print_result(target_of(lines[i]), r.value);
+      continue;
+    }
+    if (r.status == fcalc::serve::Status::parse_error)
+      fmt::print("{}: {}\n", lines[i], r.error.message(lines[i]));
+    else
+      fmt::print("{}: could not be evaluated\n", lines[i]);
+    ++failed;
+  }
+  return failed != 0;
+}
+
+// a rows file, a column per variable named in its header
+struct Rows {
+  std::vector<std::string> names;
+  std::vector<std::vector<double>> columns;
+  size_t rows = 0;
+
+  explicit Rows(std::string_view path) {
+    auto lines = read_lines(path);
+    if (lines.empty())
+      throw std::runtime_error(fmt::format("No header in {}", path));
+    std::istringstream header(lines[0]);
+    for (std::string name; header >> name;)
+      names.push_back(std::move(name));
+    columns.resize(names.size());
+    for (size_t row = 1; row != lines.size(); ++row) {
+      std::string_view rest = lines[row];
+      for (auto &c : columns) {
+        rest.remove_prefix(
+            std::min(rest.find_first_not_of(" \t"), rest.size()));
+        double value;
+        auto [end, ec] =
+            std::from_chars(rest.data(), rest.data() + rest.size(), value);
+        if (ec != std::errc{})
+          throw std::runtime_error(
+              fmt::format("Bad value on line {} of {}", row + 1, path));
+        c.push_back(value);
+        rest.remove_prefix(end - rest.data());
+      }
+    }
+    rows = lines.size() - 1;
+  }
+
+  // the column for each of p's variables
+  std::vector<const double *> bind(const fcalc::Program &p) const {
+    std::vector<const double *> vars;
+    for (auto &v : p.variables) {
+      auto it = std::ranges::find(names, v.view());
+      if (it == names.end())
+        throw std::runtime_error(
+            fmt::format("No column for variable {}", v.view()));
+      vars.push_back(columns[it - names.begin()].data());
+    }
+    return vars;
+  }
+};
+
+void write_results(fcalc::OutputFormat format, std::string_view formula,
+                   const std::vector<double> &results) {
+  std::fflush(stdout);
+  std::string_view names[] = {formula};
+  fcalc::ResultWriter out(stdout, format, names);
+  const double *columns[] = {results.data()};
+  out.write(columns, results.size());
+  out.finish();
+}
+
+int run_rows(std::string_view formula, std::string_view path,
+             fcalc::OutputFormat format) {
+  Rows rows(path);
+  auto a = fcalc::tokenize(formula);
+  fcalc::parse(a);
+  fcalc::Rewrites applied;
+  auto p = fcalc::compile(a, applied);
+  std::vector<double> results(rows.rows);
+  fcalc::evaluate(p, rows.bind(p), results.data(), rows.rows);
+  write_results(format, formula, results);
+  return 0;
+}
+
+// streamed a chunk at a time, from the file straight into the columns and
+// on to the output
+int run_csv(std::string_view formula, std::string_view path,
+            fcalc::OutputFormat format) {
+  fcalc::CsvReader csv{std::string(path)};
+  auto a = fcalc::tokenize(formula);
+  fcalc::parse(a);
+  fcalc::Rewrites applied;
+  auto p = fcalc::compile(a, applied);
+  csv.bind(p.variables);
+  std::vector<std::vector<double>> columns(p.variables.size());
+  std::vector<double *> vars;
+  for (auto &c : columns) {
+    c.resize(fcalc::csv_rows);
+    vars.push_back(c.data());
+  }
+  std::vector<const double *> in(vars.begin(), vars.end());
+  std::vector<double> results(fcalc::csv_rows);
+  const double *out[] = {results.data()};
+
+  std::fflush(stdout);
+  std::string_view names[] = {formula};
+  fcalc::ResultWriter writer(stdout, format, names);
+  while (auto rows = csv.read(vars, fcalc::csv_rows)) {
+    fcalc::evaluate(p, in, results.data(), rows);
+    writer.write(out, rows);
+  }
+  writer.finish();
+  return 0;
+}
+
+int shard_rows(std::string_view workers, std::string_view formula,
+               std::string_view path, fcalc::OutputFormat format) {
+  std::optional<LocalWorkers> local;
+  fcalc::Coordinator coordinator(worker_addresses(workers, local));
+  Rows rows(path);
+  std::vector<std::string_view> names(rows.names.begin(), rows.names.end());
+  std::vector<const double *> columns;
+  for (auto &c : rows.columns)
+    columns.push_back(c.data());
+  write_results(format, formula,
+                coordinator.evaluate(formula, names, columns, rows.rows));
+  return 0;
+}
+} // namespace
+
+int main_fun(std::span<std::string_view> args) {
+  try {
+    auto format = fcalc::OutputFormat::text;
+    bool output = args.size() > 2 && args[0] == "--output";
+    if (output) {
+      format = fcalc::output_format(args[1]);
+      args = args.subspan(2);
+    }
+    if (args.size() == 4 && args[0] == "--shard")
+      return shard_rows(args[1], args[2], args[3], format);
+    if (args.size() == 3 && args[0] == "--rows")
+      return run_rows(args[1], args[2], format);
+    if (args.size() == 3 && args[0] == "--csv")
+      return run_csv(args[1], args[2], format);
+    // every other mode prints a line per formula
+    if (output)
+      throw std::runtime_error(
+          "--output only applies to --rows, --csv or --shard with rows");
+    if (args.size() == 1 && !args[0].starts_with("--"))
+      return run_file(args[0]);
+    if (args.size() == 2 && args[0] == "--stats")
+      return run_file(args[1], true);
+    if (args.size() == 3 && args[0] == "--decimal")
+      return run_decimal(args[2], unsigned(std::stoul(std::string(args[1]))));
+    if (args.size() == 3 && args[0] == "--compile")
+      return compile_image(args[1], args[2]);
+    if (args.size() == 2 && args[0] == "--image")
+      return run_image(args[1]);
+    if (args.size() == 2 && args[0] == "--serve")
+      return serve(args[1]);
+    if (args.size() == 3 && args[0] == "--shard")
+      return shard_file(args[1], args[2]);
+  } catch (std::exception &e) {
+    fmt::print("{}\n", e.what());
+    return 1;
+  }
+  usage();
+  return 1;
+}
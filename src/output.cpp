@@ -0,0 +1,279 @@
+#include "output.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cstring>
+#include <fmt/format.h>
+#include <initializer_list>
+#include <stdexcept>
+
+namespace fcalc {
+namespace {
+// room past output_buffer for the value that crosses it, the longest
+// shortest double is 24 characters and a separator
+constexpr size_t text_slack = 64;
+
+// the arrow ipc format, see https://arrow.apache.org/docs/format/Columnar.html
+constexpr uint32_t continuation = 0xffffffff;
+constexpr uint64_t metadata_v5 = 4;
+enum : uint64_t { header_schema = 1, header_record_batch = 3 };
+constexpr uint64_t type_floating_point = 3;
+constexpr uint64_t precision_double = 2;
+
+// just enough of a flatbuffer writer for arrow's messages. it goes front to
+// back: a table's vtable right before it and whatever it points to after
+// it, offsets get filled in once their target is placed. alignment counts
+// from the start of the buffer, which lands 8 byte aligned in the stream
+class Flat {
+public:
+  std::vector<char> buf;
+
+  // a table field by id, offsets are left for point
+  struct Slot {
+    uint16_t id;
+    uint8_t size;
+    uint64_t value = 0;
+  };
+  struct Table {
+    size_t start;
+    // where each field went, by id
+    std::array<size_t, 8> at{};
+  };
+
+  // the root offset, which has to come first
+  size_t root() {
+    buf.resize(4);
+    return 0;
+  }
+
+  Table table(std::initializer_list<Slot> slots) {
+    std::vector<Slot> fields(slots);
+    // widest first, so nothing needs padding inside
+    std::ranges::stable_sort(fields, std::greater{}, &Slot::size);
+    uint16_t count = 0;
+    for (auto &s : fields)
+      count = std::max<uint16_t>(count, s.id + 1);
+    align(2, 0);
+    size_t vtable = grow(4 + 2 * count);
+    // the vtable offset comes first, 8 byte fields need it at 4 mod 8
+    if (fields.front().size == 8)
+      align(8, 4);
+    else
+      align(4, 0);
+    Table t{grow(4)};
+    store(t.start, t.start - vtable, 4);
+    for (auto &s : fields) {
+      t.at[s.id] = grow(s.size);
+      store(t.at[s.id], s.value, s.size);
+      store(vtable + 4 + 2 * s.id, t.at[s.id] - t.start, 2);
+    }
+    store(vtable, 4 + 2 * count, 2);
+    store(vtable + 2, buf.size() - t.start, 2);
+    return t;
+  }
+
+  // count elements of size bytes, returns where the length is and the
+  // elements follow
+  size_t vector(size_t count, size_t size, size_t alignment) {
+    align(std::max<size_t>(alignment, 4), 4 % alignment);
+    size_t at = grow(4 + count * size);
+    store(at, count, 4);
+    return at;
+  }
+  size_t string(std::string_view s) {
+    align(4, 0);
+    size_t at = grow(4 + s.size() + 1);
+    store(at, s.size(), 4);
+    std::memcpy(buf.data() + at + 4, s.data(), s.size());
+    return at;
+  }
+
+  // makes the offset at at lead to to, which comes after it
+  void point(size_t at, size_t to) { store(at, to - at, 4); }
+
+  // flatbuffers are little endian whatever the host is
+  void store(size_t at, uint64_t value, size_t size) {
+    for (size_t k = 0; k != size; ++k)
+      buf[at + k] = char(value >> (8 * k));
+  }
+
+private:
+  size_t grow(size_t size) {
+    size_t at = buf.size();
+    buf.resize(at + size);
+    return at;
+  }
+  void align(size_t alignment, size_t remainder) {
+    while (buf.size() % alignment != remainder)
+      buf.push_back(0);
+  }
+};
+
+Flat schema(std::span<const std::string_view> names) {
+  Flat f;
+  auto root = f.root();
+  // version, header type, header, body length
+  auto m = f.table(
+      {{0, 2, metadata_v5}, {1, 1, header_schema}, {2, 4}, {3, 8, 0}});
+  f.point(root, m.start);
+  // endianness, fields
+  auto s = f.table({{0, 2, 0}, {1, 4}});
+  f.point(m.at[2], s.start);
+  auto fields = f.vector(names.size(), 4, 4);
+  f.point(s.at[1], fields);
+  for (size_t i = 0; i != names.size(); ++i) {
+    // name, nullable, type type, type, children. arrow insists on the
+    // children even when there are none
+    auto field = f.table(
+        {{0, 4}, {1, 1, 0}, {2, 1, type_floating_point}, {3, 4}, {5, 4}});
+    f.point(fields + 4 + 4 * i, field.start);
+    f.point(field.at[0], f.string(names[i]));
+    auto precision = f.table({{0, 2, precision_double}});
+    f.point(field.at[3], precision.start);
+    f.point(field.at[5], f.vector(0, 4, 4));
+  }
+  return f;
+}
+
+// the columns follow one after another in the body, each with an empty
+// validity buffer
+Flat record_batch(size_t columns, size_t rows) {
+  Flat f;
+  auto root = f.root();
+  uint64_t column = rows * sizeof(double);
+  // version, header type, header, body length
+  auto m = f.table({{0, 2, metadata_v5},
+                    {1, 1, header_record_batch},
+                    {2, 4},
+                    {3, 8, columns * column}});
+  f.point(root, m.start);
+  // length, nodes, buffers
+  auto b = f.table({{0, 8, rows}, {1, 4}, {2, 4}});
+  f.point(m.at[2], b.start);
+  auto nodes = f.vector(columns, 16, 8);
+  f.point(b.at[1], nodes);
+  auto buffers = f.vector(2 * columns, 16, 8);
+  f.point(b.at[2], buffers);
+  // a node is length and null count, a buffer offset and length
+  for (size_t c = 0; c != columns; ++c) {
+    f.store(nodes + 4 + 16 * c, rows, 8);
+    f.store(buffers + 4 + 32 * c, c * column, 8);
+    f.store(buffers + 20 + 32 * c, c * column, 8);
+    f.store(buffers + 28 + 32 * c, column, 8);
+  }
+  return f;
+}
+
+// the continuation marker and the length of the padded message, which
+// starts the buffer
+std::vector<char> framed(Flat f) {
+  size_t size = (f.buf.size() + 7) / 8 * 8;
+  f.buf.resize(size);
+  f.buf.insert(f.buf.begin(), 8, 0);
+  f.store(0, continuation, 4);
+  f.store(4, size, 4);
+  return std::move(f.buf);
+}
+} // namespace
+
+ResultWriter::ResultWriter(std::FILE *out, OutputFormat format,
+                           std::span<const std::string_view> names)
+    : out(out), format(format), columns(names.size()),
+      buffer(output_buffer + text_slack) {
+  if (format == OutputFormat::arrow) {
+    auto message = framed(schema(names));
+    put(message.data(), message.size());
+  }
+}
+
+ResultWriter::~ResultWriter() {
+  try {
+    finish();
+  } catch (std::exception &) {
+  }
+}
+
+void ResultWriter::write(std::span<const double *const> columns,
+                         size_t rows) {
+  if (columns.size() != this->columns)
+    throw std::runtime_error(fmt::format("Expected {} result columns, got {}",
+                                         this->columns, columns.size()));
+  if (format == OutputFormat::text) {
+    char *at = buffer.data() + used;
+    char *end = buffer.data() + output_buffer;
+    for (size_t r = 0; r != rows; ++r) {
+      for (size_t c = 0; c != columns.size(); ++c) {
+        at = std::to_chars(at, at + text_slack, columns[c][r]).ptr;
+        *at++ = c + 1 == columns.size() ? '\n' : ' ';
+        if (at >= end) {
+          used = at - buffer.data();
+          flush();
+          at = buffer.data();
+        }
+      }
+    }
+    used = at - buffer.data();
+    return;
+  }
+  if (format == OutputFormat::arrow) {
+    auto message = framed(record_batch(columns.size(), rows));
+    put(message.data(), message.size());
+  }
+  for (auto column : columns) {
+    if constexpr (std::endian::native == std::endian::little) {
+      put(column, rows * sizeof(double));
+    } else {
+      for (size_t r = 0; r != rows; ++r) {
+        auto v = std::byteswap(std::bit_cast<uint64_t>(column[r]));
+        put(&v, sizeof(v));
+      }
+    }
+  }
+}
+
+void ResultWriter::finish() {
+  if (finished)
+    return;
+  finished = true;
+  if (format == OutputFormat::arrow) {
+    // a message of length 0 ends the stream
+    char end[] = {-1, -1, -1, -1, 0, 0, 0, 0};
+    put(end, sizeof(end));
+  }
+  flush();
+  if (std::fflush(out) != 0)
+    throw std::runtime_error("Could not write results");
+}
+
+// big pieces skip the buffer
+void ResultWriter::put(const void *data, size_t size) {
+  if (size >= output_buffer) {
+    flush();
+    if (std::fwrite(data, 1, size, out) != size)
+      throw std::runtime_error("Could not write results");
+    return;
+  }
+  if (used + size > output_buffer)
+    flush();
+  std::memcpy(buffer.data() + used, data, size);
+  used += size;
+}
+
+void ResultWriter::flush() {
+  if (used != 0 && std::fwrite(buffer.data(), 1, used, out) != used)
+    throw std::runtime_error("Could not write results");
+  used = 0;
+}
+
+OutputFormat output_format(std::string_view name) {
+  if (name == "text")
+    return OutputFormat::text;
+  if (name == "binary")
+    return OutputFormat::binary;
+  if (name == "arrow")
+    return OutputFormat::arrow;
+  throw std::runtime_error(fmt::format("Unknown output format {}", name));
+}
+} // namespace fcalc
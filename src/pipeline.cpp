@@ -0,0 +1,261 @@
+#include "pipeline.hpp"
+
+#include "fcalc.hpp"
+#include "real_eval.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <fmt/format.h>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace fcalc {
+namespace {
+using clock_type = std::chrono::steady_clock;
+
+constexpr size_t cache_line = 64;
+
+struct Line {
+  std::string text;
+  Words words;
+  // set by whichever stage gave up on the line, and then it's only passed
+  // along
+  std::optional<std::string> failure;
+  std::optional<SmolString> target;
+  double value{};
+};
+
+struct Batch {
+  // only the first size are in use, the rest are kept for their storage
+  std::vector<Line> lines;
+  size_t size = 0;
+};
+using BatchPtr = std::unique_ptr<Batch>;
+
+// one producer and one consumer, each with its own index on its own cache
+// line. a side that can't go on sleeps on the other's index, and notifying
+// costs next to nothing while nobody sleeps. a null batch ends the stream
+class Ring {
+public:
+  explicit Ring(size_t capacity) : slots(capacity) {}
+
+  void push(BatchPtr b, StageStats &s) {
+    auto t = tail.load(std::memory_order_relaxed);
+    auto h = head.load(std::memory_order_acquire);
+    if (t - h == slots.size()) {
+      ++s.blocked;
+      while (t - h == slots.size()) {
+        head.wait(h, std::memory_order_acquire);
+        h = head.load(std::memory_order_acquire);
+      }
+    }
+    s.queued += t - h;
+    slots[t % slots.size()] = std::move(b);
+    tail.store(t + 1, std::memory_order_release);
+    tail.notify_one();
+  }
+  void close() {
+    StageStats ignored;
+    push(nullptr, ignored);
+  }
+
+  BatchPtr pop(StageStats &s) {
+    auto h = head.load(std::memory_order_relaxed);
+    auto t = tail.load(std::memory_order_acquire);
+    if (h == t) {
+      ++s.starved;
+      while (h == t) {
+        tail.wait(t, std::memory_order_acquire);
+        t = tail.load(std::memory_order_acquire);
+      }
+    }
+    return take(h);
+  }
+  // null if there's nothing waiting
+  BatchPtr try_pop() {
+    auto h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire))
+      return nullptr;
+    return take(h);
+  }
+
+private:
+  BatchPtr take(size_t h) {
+    auto b = std::move(slots[h % slots.size()]);
+    head.store(h + 1, std::memory_order_release);
+    head.notify_one();
+    return b;
+  }
+
+  std::vector<BatchPtr> slots;
+  alignas(cache_line) std::atomic<size_t> head{0};
+  alignas(cache_line) std::atomic<size_t> tail{0};
+};
+
+// after a stage throws, whatever reaches it is dropped so the stage feeding
+// it never waits for room, and the exception goes back to run_pipeline
+void drain(Ring &in) {
+  StageStats ignored;
+  while (in.pop(ignored))
+    ;
+}
+
+void read(std::istream &in, Ring &free, Ring &out, StageStats &s,
+          size_t batch) {
+  for (bool more = true; more;) {
+    auto b = free.try_pop();
+    if (!b) {
+      b = std::make_unique<Batch>();
+      b->lines.resize(batch);
+    }
+    auto start = clock_type::now();
+    b->size = 0;
+    while (b->size != batch) {
+      if (!std::getline(in, b->lines[b->size].text)) {
+        more = false;
+        break;
+      }
+      if (!b->lines[b->size].text.empty())
+        ++b->size;
+    }
+    s.busy += clock_type::now() - start;
+    if (b->size != 0) {
+      ++s.batches;
+      out.push(std::move(b), s);
+    }
+  }
+}
+
+// f on every line of every batch from in, which then go on to out
+template <typename F>
+void stage(Ring &in, Ring &out, StageStats &s, F &&f) {
+  while (auto b = in.pop(s)) {
+    auto start = clock_type::now();
+    for (size_t i = 0; i != b->size; ++i)
+      f(b->lines[i]);
+    s.busy += clock_type::now() - start;
+    ++s.batches;
+    out.push(std::move(b), s);
+  }
+}
+
+void tokenize_line(Line &l) {
+  l.failure.reset();
+  l.target.reset();
+  if (auto ok = try_tokenize(l.text, l.words); !ok)
+    l.failure = ok.error().message(l.text);
+}
+
+void parse_line(Line &l) {
+  if (l.failure)
+    return;
+  if (auto ok = try_parse(l.words); !ok)
+    l.failure = ok.error().message(l.text);
+}
+
+void evaluate_line(Line &l) {
+  if (l.failure)
+    return;
+  try {
+    auto p = compile(l.words);
+    if (!p.variables.empty()) {
+      l.failure = "unbound variables";
+      return;
+    }
+    l.target = p.target;
+    evaluate(p, {}, &l.value, 1);
+  } catch (std::exception &e) {
+    l.failure = e.what();
+  }
+}
+
+void write(Ring &in, Ring &free, std::ostream &out, PipelineResult &r) {
+  auto &s = r.stages.back();
+  StageStats ignored;
+  fmt::memory_buffer text;
+  while (auto b = in.pop(s)) {
+    auto start = clock_type::now();
+    text.clear();
+    for (size_t i = 0; i != b->size; ++i) {
+      auto &l = b->lines[i];
+      auto to = fmt::appender(text);
+      if (l.failure) {
+        fmt::format_to(to, "{}: {}\n", l.text, *l.failure);
+        ++r.failed;
+      } else if (l.target) {
+        fmt::format_to(to, "{} = {}\n", l.target->view(), l.value);
+      } else {
+        fmt::format_to(to, "{}\n", l.value);
+      }
+    }
+    out.write(text.data(), text.size());
+    r.lines += b->size;
+    s.busy += clock_type::now() - start;
+    ++s.batches;
+    free.push(std::move(b), ignored);
+  }
+}
+} // namespace
+
+PipelineResult run_pipeline(std::istream &in, std::ostream &out,
+                            size_t batch, size_t depth) {
+  batch = std::max<size_t>(batch, 1);
+  depth = std::max<size_t>(depth, 1);
+  PipelineResult r;
+  const char *names[] = {"read", "tokenize", "parse", "evaluate", "write"};
+  for (size_t i = 0; i != r.stages.size(); ++i)
+    r.stages[i].name = names[i];
+
+  Ring lines(depth), words(depth), parsed(depth), results(depth);
+  // room for every batch there can be, so the writer never waits on it
+  Ring free(4 * depth + r.stages.size());
+  auto &s = r.stages;
+  // one per stage, the first one set is rethrown once every thread is done
+  std::exception_ptr errors[std::size(names)];
+  // runs a stage and then ends its output, whether it finished or threw
+  auto guarded = [&](size_t i, Ring *in, Ring *to, auto &&f) {
+    try {
+      f();
+    } catch (...) {
+      errors[i] = std::current_exception();
+      if (in)
+        drain(*in);
+    }
+    if (to)
+      to->close();
+  };
+  std::thread threads[] = {
+      std::thread([&] {
+        guarded(0, nullptr, &lines,
+                [&] { read(in, free, lines, s[0], batch); });
+      }),
+      std::thread([&] {
+        guarded(1, &lines, &words,
+                [&] { stage(lines, words, s[1], tokenize_line); });
+      }),
+      std::thread([&] {
+        guarded(2, &words, &parsed,
+                [&] { stage(words, parsed, s[2], parse_line); });
+      }),
+      std::thread([&] {
+        guarded(3, &parsed, &results,
+                [&] { stage(parsed, results, s[3], evaluate_line); });
+      }),
+  };
+  guarded(4, &results, nullptr, [&] { write(results, free, out, r); });
+  for (auto &t : threads)
+    t.join();
+  for (auto &e : errors)
+    if (e)
+      std::rethrow_exception(e);
+  return r;
+}
+} // namespace fcalc
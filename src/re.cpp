@@ -2,8 +2,10 @@
 
 #include <fmt/core.h>
 #include <pcre2.h>
+#include <cstring>
 #include <stdexcept>
 #include <utility>
+#include <vector>
 
 namespace {
 void rc_err(int rc) {
@@ -12,13 +14,62 @@ void rc_err(int rc) {
   throw std::runtime_error(fmt::format("Pattern failed to match: {}",
                                        reinterpret_cast<char *>(message)));
 }
+
+// match data and a match context for each thread. a Matches takes a block
+// of match data for as long as it lives and hands it back afterwards
+struct ThreadCache {
+  std::vector<pcre2_match_data *> free;
+  pcre2_match_context *context = pcre2_match_context_create(nullptr);
+
+  ThreadCache() = default;
+  ThreadCache(const ThreadCache &) = delete;
+  ~ThreadCache() {
+    for (auto data : free)
+      pcre2_match_data_free(data);
+    pcre2_match_context_free(context);
+  }
+
+  pcre2_match_data *acquire(uint32_t pairs) {
+    if (!free.empty()) {
+      auto data = free.back();
+      free.pop_back();
+      if (pcre2_get_ovector_count(data) >= pairs)
+        return data;
+      pcre2_match_data_free(data);
+    }
+    auto data = pcre2_match_data_create(pairs, nullptr);
+    if (!data)
+      throw std::runtime_error("Match data failed to construct.");
+    return data;
+  }
+  void release(pcre2_match_data *data) { free.push_back(data); }
+};
+thread_local ThreadCache cache;
+
+// match data borrowed from the cache for one scope
+struct Borrowed {
+  pcre2_match_data *data;
+  explicit Borrowed(uint32_t pairs) : data(cache.acquire(pairs)) {}
+  Borrowed(const Borrowed &) = delete;
+  ~Borrowed() { cache.release(data); }
+};
 } // namespace
 
 namespace re {
 namespace detail {} // namespace detail
 
+JitStack::JitStack(size_t start_size, size_t max_size) {
+  internal = pcre2_jit_stack_create(start_size, max_size, nullptr);
+  if (!internal)
+    throw std::runtime_error("JIT stack failed to construct.");
+}
+JitStack::~JitStack() {
+  pcre2_jit_stack_free(static_cast<pcre2_jit_stack *>(internal));
+}
+
 Matches::~Matches() {
-  pcre2_match_data_free(static_cast<pcre2_match_data *>(internal));
+  if (internal)
+    cache.release(static_cast<pcre2_match_data *>(internal));
 }
 
 MatchIterator Matches::begin() {
@@ -36,14 +87,37 @@ MatchIterator::reference MatchIterator::operator*() const {
 // this must be called first bc
 void MatchIterator::match(bool is_first) {
   size_t offset = is_first ? 0 : start[1];
-  auto rc = pcre2_match(
-      static_cast<pcre2_code *>(source->pattern),
-      reinterpret_cast<const unsigned char *>(source->string.data()),
-      source->string.size(), offset, {},
-      static_cast<pcre2_match_data *>(source->internal), nullptr);
+  if (!is_first && start[0] == start[1]) {
+    // step over an empty match, and over a whole utf-8 sequence
+    auto chars = source->string.data();
+    ++offset;
+    while (offset < source->string.size() && (chars[offset] & 0xc0) == 0x80)
+      ++offset;
+    if (offset > source->string.size()) {
+      start = nullptr;
+      end = nullptr;
+      return;
+    }
+  }
+  auto code = static_cast<pcre2_code *>(source->pattern);
+  auto data = static_cast<pcre2_match_data *>(source->internal);
+  auto subject = reinterpret_cast<const unsigned char *>(source->string.data());
+  int rc;
+  if (source->jit) {
+    // the context is shared by the thread, so the stack is set every time
+    pcre2_jit_stack_assign(
+        cache.context, nullptr,
+        source->stack ? source->stack->internal : nullptr);
+    rc = pcre2_jit_match(code, subject, source->string.size(), offset, {}, data,
+                         cache.context);
+  } else {
+    // the subject's utf is checked on the first match only, rechecking it
+    // on every step makes lexing quadratic
+    rc = pcre2_match(code, subject, source->string.size(), offset,
+                     is_first ? 0 : PCRE2_NO_UTF_CHECK, data, nullptr);
+  }
   if (is_first) {
-    start = pcre2_get_ovector_pointer(
-        static_cast<pcre2_match_data *>(source->internal));
+    start = pcre2_get_ovector_pointer(data);
     end = start + rc;
   }
   if (rc == PCRE2_ERROR_NOMATCH) {
@@ -66,7 +140,7 @@ MatchEnd Matches::end() { return MatchEnd{}; }
 
 #define pattern_ptr static_cast<pcre2_code *>(internal)
 
-Pattern::Pattern(std::string_view pattern, Options options) {
+Pattern::Pattern(std::string_view pattern, Options options, Jit jit) {
   int errcode{};
   size_t erroffset{};
   internal = pcre2_compile(
@@ -75,19 +149,104 @@ Pattern::Pattern(std::string_view pattern, Options options) {
   if (!internal) {
     unsigned char message[121]{};
     pcre2_get_error_message(errcode, message, sizeof(message));
-    std::runtime_error(fmt::format("Pattern failed to compile at offset {}: {}",
-                                   erroffset,
-                                   reinterpret_cast<char *>(message)));
+    throw std::runtime_error(
+        fmt::format("Pattern failed to compile at offset {}: {}", erroffset,
+                    reinterpret_cast<char *>(message)));
   }
+  uint32_t captures{};
+  pcre2_pattern_info(pattern_ptr, PCRE2_INFO_CAPTURECOUNT, &captures);
+  pairs = captures + 1;
+  if (jit == Jit::on)
+    this->jit = pcre2_jit_compile(pattern_ptr, PCRE2_JIT_COMPLETE) == 0;
 }
 Pattern::~Pattern() { pcre2_code_free(pattern_ptr); }
 
-Matches Pattern::match(std::string_view str) {
-  auto data = pcre2_match_data_create_from_pattern(
-      static_cast<pcre2_code *>(internal), nullptr);
-  if (!data)
-    throw std::runtime_error("Match data failed to construct.");
-  return Matches(data, internal, str);
+Matches Pattern::match(std::string_view str, JitStack *stack) {
+  return Matches(cache.acquire(pairs), internal, str, stack, jit);
+}
+
+size_t Pattern::scan(detail::MatchPtr *data, std::string_view subject,
+                     std::span<Match> out, size_t &offset, JitStack *stack) {
+  auto md = static_cast<pcre2_match_data *>(data);
+  auto ovector = pcre2_get_ovector_pointer(md);
+  auto chars = reinterpret_cast<const unsigned char *>(subject.data());
+  // resuming means the subject was already checked
+  uint32_t flags = offset == 0 ? 0 : PCRE2_NO_UTF_CHECK;
+  if (jit)
+    pcre2_jit_stack_assign(cache.context, nullptr,
+                           stack ? stack->internal : nullptr);
+
+  size_t count = 0;
+  while (offset <= subject.size()) {
+    int rc = jit ? pcre2_jit_match(pattern_ptr, chars, subject.size(), offset,
+                                   0, md, cache.context)
+                 : pcre2_match(pattern_ptr, chars, subject.size(), offset,
+                               flags, md, nullptr);
+    flags = PCRE2_NO_UTF_CHECK;
+    if (rc == PCRE2_ERROR_NOMATCH) {
+      offset = std::string_view::npos;
+      break;
+    }
+    if (rc < 0)
+      rc_err(rc);
+    // a match that doesn't fit is found again when resuming at offset
+    if ((count + 1) * pairs > out.size())
+      break;
+    // Match is laid out like an ovector pair, and PCRE2_UNSET is npos
+    static_assert(sizeof(Match) == 2 * sizeof(PCRE2_SIZE));
+    std::memcpy(&out[count * pairs], ovector, pairs * sizeof(Match));
+    ++count;
+
+    offset = ovector[1];
+    if (ovector[0] == ovector[1]) {
+      // step over an empty match, and over a whole utf-8 sequence
+      ++offset;
+      while (offset < subject.size() && (chars[offset] & 0xc0) == 0x80)
+        ++offset;
+    }
+  }
+  // past the end after the last match, whatever room is left
+  if (offset > subject.size())
+    offset = std::string_view::npos;
+  return count;
+}
+
+void Pattern::check_room(std::span<Match> out) const {
+  if (out.size() < pairs)
+    throw std::runtime_error(fmt::format(
+        "match_all needs room for a match of {} pairs, got {}", pairs,
+        out.size()));
+}
+
+size_t Pattern::match_all(std::string_view subject, std::span<Match> out,
+                          size_t &offset, JitStack *stack) {
+  if (offset == std::string_view::npos)
+    return 0;
+  check_room(out);
+  Borrowed borrowed(pairs);
+  return scan(borrowed.data, subject, out, offset, stack);
+}
+
+size_t Pattern::match_all(std::span<const std::string_view> subjects,
+                          std::span<Match> out, std::span<size_t> ends,
+                          JitStack *stack) {
+  if (ends.size() < subjects.size())
+    throw std::runtime_error(
+        fmt::format("match_all needs {} ends, got {}", subjects.size(),
+                    ends.size()));
+  check_room(out);
+  Borrowed borrowed(pairs);
+  size_t written = 0;
+  for (size_t i = 0; i != subjects.size(); ++i) {
+    size_t offset = 0;
+    auto count = scan(borrowed.data, subjects[i], out.subspan(written * pairs),
+                      offset, stack);
+    if (offset != std::string_view::npos)
+      return i;
+    written += count;
+    ends[i] = written;
+  }
+  return subjects.size();
 }
 
-} // namespace re
\ No newline at end of file
+} // namespace re
@@ -0,0 +1,568 @@
+#include "real_eval.hpp"
+#include "fork_join.hpp"
+#include "vmath.hpp"
+#include "work_pool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fmt/format.h>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+namespace fcalc {
+namespace {
+double real_constant(Constant::Types t) {
+  if (t == Constant::Types::i)
+    throw std::runtime_error("i has no real value, use evaluate_complex");
+  return to_double(t);
+}
+
+struct ScalarMode {
+  using value_type = double;
+  std::span<const Binding<double>> vars;
+  bool short_circuit = false;
+
+  double number(const Number &n) const noexcept { return to_double(n); }
+  double constant(Constant::Types t) const { return real_constant(t); }
+  double variable(const Variable &v) const {
+    for (auto &b : vars) {
+      if (b.name == v.s.view())
+        return b.value;
+    }
+    throw std::runtime_error(fmt::format("Unbound variable: {}", v.s.view()));
+  }
+  double unary(Unary::Ops op, double a) const noexcept {
+    if (op == Unary::Ops::minus)
+      return -a;
+    if (op == Unary::Ops::square)
+      return a * a;
+    return std::sqrt(a);
+  }
+  double binary(Binary::Ops op, double a, double b) const {
+    switch (op) {
+      using enum Binary::Ops;
+    case eq:
+      return a == b ? 1 : 0;
+    case lt:
+      return a < b ? 1 : 0;
+    case gt:
+      return a > b ? 1 : 0;
+    case add:
+      return a + b;
+    case sub:
+      return a - b;
+    case mul:
+      return a * b;
+    case div:
+      return a / b;
+    case exp:
+      return std::pow(a, b);
+    case assign:
+      break;
+    }
+    throw std::runtime_error("Unexpected assignment");
+  }
+  double function(Function::Ops op, double a) const {
+    switch (op) {
+      using enum Function::Ops;
+    case sin:
+      return vmath::sin(a);
+    case cos:
+      return vmath::cos(a);
+    case log:
+      return vmath::log(a);
+    case exp:
+      return vmath::exp(a);
+    case abs:
+      return std::abs(a);
+    case min:
+    case max:
+      break;
+    }
+    throw std::runtime_error(
+        fmt::format("{} takes two arguments", format_as(op)));
+  }
+  // b < a rather than std::min, so the rows match the block kernels
+  double function(Function::Ops op, double a, double b) const {
+    if (op == Function::Ops::min)
+      return b < a ? b : a;
+    if (op == Function::Ops::max)
+      return a < b ? b : a;
+    throw std::runtime_error(
+        fmt::format("{} takes one argument", format_as(op)));
+  }
+  bool truth(double c) const noexcept { return c != 0; }
+  double select(double c, double a, double b) const noexcept {
+    return c != 0 ? a : b;
+  }
+};
+
+// the comparisons and select run over the whole block, -O2 only
+// vectorizes loops with a known trip count and turns these into compares
+// and masked blends. the pointers have to be restrict parameters, locals
+// lose it once BlockMode is inlined into run_blocks, and both arms are
+// loaded up front so select has no branch left to convert
+void compare(Binary::Ops op, double *__restrict a,
+             const double *__restrict b) noexcept {
+  if (op == Binary::Ops::eq) {
+    for (size_t i = 0; i != block_rows; ++i)
+      a[i] = a[i] == b[i] ? 1 : 0;
+  } else if (op == Binary::Ops::lt) {
+    for (size_t i = 0; i != block_rows; ++i)
+      a[i] = a[i] < b[i] ? 1 : 0;
+  } else {
+    for (size_t i = 0; i != block_rows; ++i)
+      a[i] = a[i] > b[i] ? 1 : 0;
+  }
+}
+void select(double *__restrict c, const double *__restrict a,
+            const double *__restrict b) noexcept {
+  for (size_t i = 0; i != block_rows; ++i) {
+    double x = a[i], y = b[i];
+    c[i] = c[i] != 0 ? x : y;
+  }
+}
+
+struct BlockMode {
+  std::span<const double *const> vars;
+  double *out;
+  std::vector<double> scratch;
+
+  double *slot(uint32_t s) noexcept { return scratch.data() + block_rows * s; }
+
+  void number(uint32_t s, const Number &v, size_t n) {
+    std::fill_n(slot(s), n, to_double(v));
+  }
+  void constant(uint32_t s, Constant::Types t, size_t n) {
+    std::fill_n(slot(s), n, real_constant(t));
+  }
+  void variable(uint32_t s, uint32_t var, size_t row, size_t n) {
+    std::copy_n(vars[var] + row, n, slot(s));
+  }
+  void unary(Unary::Ops op, uint32_t s, size_t n) {
+    double *__restrict a = slot(s);
+    if (op == Unary::Ops::minus) {
+      for (size_t i = 0; i != n; ++i)
+        a[i] = -a[i];
+    } else if (op == Unary::Ops::square) {
+      for (size_t i = 0; i != n; ++i)
+        a[i] *= a[i];
+    } else {
+      for (size_t i = 0; i != n; ++i)
+        a[i] = std::sqrt(a[i]);
+    }
+  }
+  void binary(Binary::Ops op, uint32_t sa, uint32_t sb, size_t n) {
+    double *__restrict a = slot(sa);
+    const double *__restrict b = slot(sb);
+    switch (op) {
+      using enum Binary::Ops;
+    case eq:
+    case lt:
+    case gt:
+      // rows past n are never stored
+      return compare(op, a, b);
+    case add:
+      for (size_t i = 0; i != n; ++i)
+        a[i] += b[i];
+      return;
+    case sub:
+      for (size_t i = 0; i != n; ++i)
+        a[i] -= b[i];
+      return;
+    case mul:
+      for (size_t i = 0; i != n; ++i)
+        a[i] *= b[i];
+      return;
+    case div:
+      for (size_t i = 0; i != n; ++i)
+        a[i] /= b[i];
+      return;
+    case exp:
+      for (size_t i = 0; i != n; ++i)
+        a[i] = std::pow(a[i], b[i]);
+      return;
+    case assign:
+      break;
+    }
+    throw std::runtime_error("Unexpected assignment");
+  }
+  void function(Function::Ops op, uint32_t s, size_t n) {
+    double *__restrict a = slot(s);
+    const double *__restrict b = slot(s + 1);
+    switch (op) {
+      using enum Function::Ops;
+    case sin:
+      return vmath::sin(a, n);
+    case cos:
+      return vmath::cos(a, n);
+    case log:
+      return vmath::log(a, n);
+    case exp:
+      return vmath::exp(a, n);
+    case abs:
+      for (size_t i = 0; i != n; ++i)
+        a[i] = std::abs(a[i]);
+      return;
+    case min:
+      for (size_t i = 0; i != n; ++i)
+        a[i] = b[i] < a[i] ? b[i] : a[i];
+      return;
+    case max:
+      for (size_t i = 0; i != n; ++i)
+        a[i] = a[i] < b[i] ? b[i] : a[i];
+      return;
+    }
+  }
+  void select(uint32_t s, size_t) {
+    fcalc::select(slot(s), slot(s + 1), slot(s + 2));
+  }
+  void store(size_t row, size_t n) { std::copy_n(slot(0), n, out + row); }
+};
+
+// takes each finished block instead of storing it, out stays unused
+template <typename Reducer> struct ReduceMode : BlockMode {
+  Reducer reducer;
+  void store(size_t, size_t n) { reducer.add(slot(0), n); }
+};
+
+// four lanes so the block loop vectorizes without reassociating the sum
+struct SummaryReducer {
+  Summary result;
+
+  void add(const double *__restrict v, size_t n) noexcept {
+    constexpr size_t lanes = 4;
+    double sum[lanes]{}, lo[lanes], hi[lanes];
+    std::fill_n(lo, lanes, result.min);
+    std::fill_n(hi, lanes, result.max);
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+      for (size_t k = 0; k != lanes; ++k) {
+        sum[k] += v[i + k];
+        lo[k] = std::min(lo[k], v[i + k]);
+        hi[k] = std::max(hi[k], v[i + k]);
+      }
+    }
+    for (; i != n; ++i) {
+      sum[0] += v[i];
+      lo[0] = std::min(lo[0], v[i]);
+      hi[0] = std::max(hi[0], v[i]);
+    }
+    result.sum += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    result.min = std::min({lo[0], lo[1], lo[2], lo[3]});
+    result.max = std::max({hi[0], hi[1], hi[2], hi[3]});
+    result.count += n;
+  }
+};
+
+struct HistogramReducer {
+  Histogram result;
+  double scale;
+
+  void add(const double *__restrict v, size_t n) noexcept {
+    size_t last = result.counts.size() - 1;
+    for (size_t i = 0; i != n; ++i) {
+      if (std::isnan(v[i]))
+        ++result.nan;
+      else if (v[i] < result.lo)
+        ++result.below;
+      else if (v[i] >= result.hi)
+        ++result.above;
+      else
+        ++result.counts[std::min(size_t((v[i] - result.lo) * scale), last)];
+    }
+  }
+};
+
+template <typename Reducer>
+auto reduce(ProgramView p, std::span<const double *const> vars, size_t rows,
+            Reducer reducer) {
+  if (vars.size() < p.variables)
+    throw std::runtime_error(fmt::format("Expected {} variable columns, got {}",
+                                         p.variables, vars.size()));
+  ReduceMode<Reducer> mode{
+      {vars, nullptr, std::vector<double>(block_rows * p.max_depth)},
+      std::move(reducer)};
+  run_blocks(p, rows, mode);
+  return std::move(mode.reducer.result);
+}
+
+// rows split in halves down to a range per thread, each range is reduced
+// on its own and the partials merged on the way back up
+template <typename Reducer>
+auto reduce_range(ProgramView p, std::span<const double *const> vars,
+                  size_t begin, size_t end, size_t grain,
+                  const Reducer &reducer, WorkPool &pool) {
+  if (end - begin <= grain) {
+    std::vector<const double *> shifted(vars.begin(), vars.end());
+    for (auto &column : shifted)
+      column += begin;
+    return reduce(p, shifted, end - begin, reducer);
+  }
+  size_t mid = begin + (end - begin) / 2 / block_rows * block_rows;
+  decltype(reduce(p, vars, 0, reducer)) lhs, rhs;
+  pool.invoke(
+      [&] { lhs = reduce_range(p, vars, begin, mid, grain, reducer, pool); },
+      [&] { rhs = reduce_range(p, vars, mid, end, grain, reducer, pool); });
+  lhs.merge(rhs);
+  return lhs;
+}
+
+template <typename Reducer>
+auto reduce(ProgramView p, std::span<const double *const> vars, size_t rows,
+            const Reducer &reducer, WorkPool &pool) {
+  if (vars.size() < p.variables)
+    throw std::runtime_error(fmt::format("Expected {} variable columns, got {}",
+                                         p.variables, vars.size()));
+  size_t per_thread = (rows + pool.size() - 1) / pool.size();
+  size_t grain = std::max(16 * block_rows, per_thread);
+  return reduce_range(p, vars, 0, rows, grain, reducer, pool);
+}
+
+constexpr size_t l2_bytes = size_t(1) << 20;
+constexpr size_t cache_line = 64;
+
+// row moved back so that out + row starts a cache line
+size_t line_start(const double *out, size_t row) noexcept {
+  return row - reinterpret_cast<uintptr_t>(out + row) % cache_line /
+                   sizeof(double);
+}
+
+// halves down to chunks like reduce_range. the scratch stays with the
+// thread, so it's allocated once per thread rather than once per chunk
+void evaluate_range(ProgramView p, std::span<const double *const> vars,
+                    double *out, size_t begin, size_t end, size_t chunk,
+                    WorkPool &pool) {
+  if (end - begin <= chunk) {
+    thread_local std::vector<double> scratch;
+    std::vector<const double *> shifted(vars.begin(), vars.end());
+    for (auto &column : shifted)
+      column += begin;
+    scratch.resize(block_rows * p.max_depth);
+    BlockMode mode{shifted, out + begin, std::move(scratch)};
+    run_blocks(p, end - begin, mode);
+    scratch = std::move(mode.scratch);
+    return;
+  }
+  size_t mid = line_start(
+      out, begin + (end - begin) / 2 / block_rows * block_rows);
+  pool.invoke(
+      [&] { evaluate_range(p, vars, out, begin, mid, chunk, pool); },
+      [&] { evaluate_range(p, vars, out, mid, end, chunk, pool); });
+}
+
+HistogramReducer histogram_reducer(double lo, double hi, size_t bins) {
+  if (bins == 0 || !(lo < hi))
+    throw std::runtime_error(
+        "A histogram needs lo below hi and at least one bin");
+  return {{lo, hi, std::vector<uint64_t>(bins)}, double(bins) / (hi - lo)};
+}
+} // namespace
+
+void Summary::merge(const Summary &o) noexcept {
+  sum += o.sum;
+  min = std::min(min, o.min);
+  max = std::max(max, o.max);
+  count += o.count;
+}
+
+void Histogram::merge(const Histogram &o) noexcept {
+  for (size_t k = 0; k != counts.size(); ++k)
+    counts[k] += o.counts[k];
+  below += o.below;
+  above += o.above;
+  nan += o.nan;
+}
+
+double evaluate(std::span<const Word> s,
+                std::span<const Binding<double>> vars,
+                Conditionals conditionals) {
+  ScalarMode mode{vars, conditionals == Conditionals::short_circuit};
+  return walk(s, mode);
+}
+
+double evaluate(std::span<const Word> s, WorkPool &pool,
+                std::span<const Binding<double>> vars, size_t cutoff) {
+  ScalarMode mode{vars};
+  return fork_join_walk(s, mode, pool, cutoff);
+}
+
+void evaluate(ProgramView p, std::span<const double *const> vars,
+              double *out, size_t rows) {
+  if (vars.size() < p.variables)
+    throw std::runtime_error(fmt::format("Expected {} variable columns, got {}",
+                                         p.variables, vars.size()));
+  BlockMode mode{vars, out, std::vector<double>(block_rows * p.max_depth)};
+  run_blocks(p, rows, mode);
+}
+
+void evaluate(ProgramView p, std::span<const double *const> vars,
+              double *out, size_t rows, WorkPool &pool, size_t chunk) {
+  if (vars.size() < p.variables)
+    throw std::runtime_error(fmt::format("Expected {} variable columns, got {}",
+                                         p.variables, vars.size()));
+  // at least two blocks, so every split leaves rows on both sides
+  chunk = std::max(chunk ? chunk : chunk_rows(p), 2 * block_rows);
+  evaluate_range(p, vars, out, 0, rows, chunk, pool);
+}
+
+size_t chunk_rows(ProgramView p) noexcept {
+  size_t rows = l2_bytes / (sizeof(double) * (p.variables + 1));
+  return std::max(rows / block_rows, size_t(1)) * block_rows;
+}
+
+ScalarProgram compile_scalar(std::span<const Word> s) {
+  auto p = compile(s);
+  ScalarProgram result{{}, std::move(p.variables), p.max_depth};
+  result.code.reserve(p.code.size());
+  ScalarMode mode;
+  // whether each value on the stack is a constant, those are always the
+  // last op emitted for it
+  std::vector<bool> known;
+  // folds the top arity values into one when they are all constants
+  auto fold = [&](uint32_t arity, auto apply) {
+    if (!std::all_of(known.end() - arity, known.end(), std::identity{}))
+      return false;
+    auto args = result.code.end() - arity;
+    double v = apply(args);
+    result.code.erase(args, result.code.end());
+    result.code.push_back({WordType::Number, 0, 0, v});
+    known.resize(known.size() - arity + 1);
+    return true;
+  };
+  for (auto &ins : p.code) {
+    switch (ins.type) {
+      using enum WordType;
+    case Number:
+      result.code.push_back({Number, 0, 0, to_double(p.numbers[ins.arg])});
+      known.push_back(true);
+      break;
+    case Constant:
+      result.code.push_back(
+          {Number, 0, 0, mode.constant(Constant::Types(ins.op))});
+      known.push_back(true);
+      break;
+    case Variable:
+      result.code.push_back({Variable, 0, ins.arg});
+      known.push_back(false);
+      break;
+    case Unary:
+      if (!fold(1, [&](auto a) {
+            return mode.unary(Unary::Ops(ins.op), a[0].value);
+          }))
+        result.code.push_back({Unary, ins.op});
+      break;
+    case Binary:
+      if (!fold(2, [&](auto a) {
+            return mode.binary(Binary::Ops(ins.op), a[0].value, a[1].value);
+          })) {
+        result.code.push_back({Binary, ins.op});
+        known.pop_back();
+        known.back() = false;
+      }
+      break;
+    case Function: {
+      auto op = Function::Ops(ins.op);
+      uint32_t arity = Function::arity(op);
+      if (!fold(arity, [&](auto a) {
+            return arity == 1 ? mode.function(op, a[0].value)
+                              : mode.function(op, a[0].value, a[1].value);
+          })) {
+        result.code.push_back({Function, ins.op});
+        known.resize(known.size() - arity + 1);
+        known.back() = false;
+      }
+      break;
+    }
+    case Ternary:
+      if (!fold(3, [&](auto a) {
+            return mode.select(a[0].value, a[1].value, a[2].value);
+          })) {
+        result.code.push_back({Ternary});
+        known.resize(known.size() - 2);
+        known.back() = false;
+      }
+      break;
+    case Token:
+      break;
+    }
+  }
+  return result;
+}
+
+double evaluate(const ScalarProgram &p, std::span<const double> vars) {
+  if (vars.size() < p.variables.size())
+    throw std::runtime_error(fmt::format("Expected {} variables, got {}",
+                                         p.variables.size(), vars.size()));
+  // a local array unless the formula is unusually deep
+  double small[32];
+  std::vector<double> large;
+  double *stack = small;
+  if (p.max_depth > std::size(small)) {
+    large.resize(p.max_depth);
+    stack = large.data();
+  }
+  ScalarMode mode;
+  uint32_t top = 0;
+  for (auto &op : p.code) {
+    switch (op.type) {
+      using enum WordType;
+    case Number:
+      stack[top++] = op.value;
+      break;
+    case Variable:
+      stack[top++] = vars[op.arg];
+      break;
+    case Unary:
+      stack[top - 1] = mode.unary(Unary::Ops(op.op), stack[top - 1]);
+      break;
+    case Binary:
+      --top;
+      stack[top - 1] =
+          mode.binary(Binary::Ops(op.op), stack[top - 1], stack[top]);
+      break;
+    case Function:
+      if (Function::arity(Function::Ops(op.op)) == 1) {
+        stack[top - 1] = mode.function(Function::Ops(op.op), stack[top - 1]);
+      } else {
+        --top;
+        stack[top - 1] =
+            mode.function(Function::Ops(op.op), stack[top - 1], stack[top]);
+      }
+      break;
+    case Ternary:
+      top -= 2;
+      stack[top - 1] =
+          mode.select(stack[top - 1], stack[top], stack[top + 1]);
+      break;
+    case Constant:
+    case Token:
+      break;
+    }
+  }
+  return stack[0];
+}
+
+Summary summarize(ProgramView p, std::span<const double *const> vars,
+                  size_t rows) {
+  return reduce(p, vars, rows, SummaryReducer{});
+}
+
+Summary summarize(ProgramView p, std::span<const double *const> vars,
+                  size_t rows, WorkPool &pool) {
+  return reduce(p, vars, rows, SummaryReducer{}, pool);
+}
+
+Histogram histogram(ProgramView p, std::span<const double *const> vars,
+                    size_t rows, double lo, double hi, size_t bins) {
+  return reduce(p, vars, rows, histogram_reducer(lo, hi, bins));
+}
+
+Histogram histogram(ProgramView p, std::span<const double *const> vars,
+                    size_t rows, double lo, double hi, size_t bins,
+                    WorkPool &pool) {
+  return reduce(p, vars, rows, histogram_reducer(lo, hi, bins), pool);
+}
+} // namespace fcalc
@@ -0,0 +1,649 @@
+#include "server.hpp"
+#include "eval.hpp"
+#include "fcalc.hpp"
+#include "real_eval.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fmt/format.h>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace fcalc {
+namespace {
+template <typename T> void put(std::vector<char> &out, T v) {
+  auto at = out.size();
+  out.resize(at + sizeof(T));
+  std::memcpy(out.data() + at, &v, sizeof(T));
+}
+void put(std::vector<char> &out, std::string_view bytes) {
+  out.insert(out.end(), bytes.begin(), bytes.end());
+}
+
+// reserves a frame's length, end_frame fills it in once the body is written
+size_t begin_frame(std::vector<char> &out) {
+  auto at = out.size();
+  put<uint32_t>(out, 0);
+  return at;
+}
+void end_frame(std::vector<char> &out, size_t at) {
+  uint32_t size = out.size() - at - sizeof(uint32_t);
+  std::memcpy(out.data() + at, &size, sizeof(size));
+}
+
+// walks a frame body, throwing if it runs short
+struct Reader {
+  std::string_view rest;
+
+  template <typename T> T get() {
+    T v;
+    std::memcpy(&v, bytes(sizeof(T)).data(), sizeof(T));
+    return v;
+  }
+  std::string_view bytes(size_t n) {
+    if (n > rest.size())
+      throw std::runtime_error("Truncated request");
+    auto result = rest.substr(0, n);
+    rest.remove_prefix(n);
+    return result;
+  }
+};
+
+[[noreturn]] void fail(std::string_view what, std::string_view path) {
+  throw std::runtime_error(
+      fmt::format("{} {}: {}", what, path, std::strerror(errno)));
+}
+
+struct Fd {
+  int fd = -1;
+  Fd() = default;
+  explicit Fd(int fd) noexcept : fd(fd) {}
+  Fd(const Fd &) = delete;
+  ~Fd() {
+    if (fd >= 0)
+      close(fd);
+  }
+};
+
+// an address ready for bind or connect
+struct Endpoint {
+  sockaddr_storage storage{};
+  socklen_t size{};
+  bool tcp = false;
+
+  sockaddr *get() noexcept { return reinterpret_cast<sockaddr *>(&storage); }
+};
+
+Endpoint endpoint(const std::string &address) {
+  Endpoint e;
+  if (address.starts_with("tcp:")) {
+    auto host = address.substr(4);
+    auto colon = host.rfind(':');
+    sockaddr_in in{};
+    in.sin_family = AF_INET;
+    uint16_t port = 0;
+    auto last = host.data() + host.size();
+    bool ok = colon != std::string::npos &&
+              std::from_chars(host.data() + colon + 1, last, port) ==
+                  std::from_chars_result{last, std::errc{}} &&
+              inet_pton(AF_INET, host.substr(0, colon).c_str(),
+                        &in.sin_addr) == 1;
+    if (!ok)
+      throw std::runtime_error(fmt::format("Not a tcp address: {}", address));
+    in.sin_port = htons(port);
+    std::memcpy(&e.storage, &in, sizeof(in));
+    e.size = sizeof(in);
+    e.tcp = true;
+    return e;
+  }
+  sockaddr_un un{};
+  un.sun_family = AF_UNIX;
+  if (address.size() >= sizeof(un.sun_path))
+    throw std::runtime_error(fmt::format("Socket path too long: {}", address));
+  std::memcpy(un.sun_path, address.data(), address.size());
+  std::memcpy(&e.storage, &un, sizeof(un));
+  e.size = sizeof(un);
+  return e;
+}
+
+// frames are small and answered one at a time, so they go out right away
+void no_delay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+constexpr uint32_t read_events = EPOLLIN | EPOLLRDHUP;
+
+struct Connection {
+  explicit Connection(int fd) noexcept : fd(fd) {}
+
+  Fd fd;
+  // shared between the event loop and the worker
+  std::mutex m;
+  std::vector<char> in, out;
+  bool queued = false;
+  bool closed = false;
+  bool writing = false;
+  // the client shut down its side. what it sent before still gets answered,
+  // then the connection closes
+  bool eof = false;
+
+  // only touched by the worker that has the connection, and kept between
+  // requests so a warm connection doesn't allocate
+  std::vector<char> work, reply;
+  Words words;
+  std::vector<double> columns, results;
+  std::vector<const double *> column_ptrs;
+  // forgotten ones are left without code, and their ids are reused first
+  std::vector<Program> formulas;
+  std::vector<uint32_t> forgotten;
+};
+using ConnectionPtr = std::shared_ptr<Connection>;
+
+// how many bytes at the front of buffer are whole frames
+size_t whole_frames(std::span<const char> buffer) {
+  size_t at = 0;
+  while (buffer.size() - at >= sizeof(uint32_t)) {
+    uint32_t size;
+    std::memcpy(&size, buffer.data() + at, sizeof(size));
+    if (buffer.size() - at - sizeof(uint32_t) < size)
+      break;
+    at += sizeof(uint32_t) + size;
+  }
+  return at;
+}
+bool oversized(std::span<const char> buffer, size_t whole) {
+  uint32_t size;
+  if (buffer.size() - whole < sizeof(size))
+    return false;
+  std::memcpy(&size, buffer.data() + whole, sizeof(size));
+  return size > serve::max_frame;
+}
+
+char *add_result(std::vector<char> &reply, serve::Status status) {
+  auto at = reply.size();
+  reply.resize(at + serve::result_size);
+  reply[at] = char(status);
+  return reply.data() + at + 1;
+}
+void put_parse_error(std::vector<char> &reply, ParseError e) {
+  put(reply, serve::Status::parse_error);
+  put(reply, e.code);
+  put(reply, e.offset);
+}
+
+void answer_batch(Connection &c, Reader r) {
+  auto count = r.get<uint32_t>();
+  put(c.reply, serve::Status::ok);
+  for (uint32_t i = 0; i != count; ++i) {
+    auto expression = r.bytes(r.get<uint32_t>());
+    if (auto ok = try_read(expression, c.words); !ok) {
+      auto p = add_result(c.reply, serve::Status::parse_error);
+      std::memcpy(p, &ok.error().code, sizeof(ok.error().code));
+      std::memcpy(p + 1, &ok.error().offset, sizeof(ok.error().offset));
+      continue;
+    }
+    try {
+      double value = evaluate(c.words);
+      std::memcpy(add_result(c.reply, serve::Status::ok), &value,
+                  sizeof(value));
+    } catch (std::exception &) {
+      add_result(c.reply, serve::Status::error);
+    }
+  }
+}
+
+// the formula behind id, if it's defined
+Program &formula(Connection &c, uint32_t id) {
+  if (id >= c.formulas.size() || c.formulas[id].code.empty())
+    throw std::runtime_error(fmt::format("Unknown formula {}", id));
+  return c.formulas[id];
+}
+
+void answer_define(Connection &c, Reader r) {
+  if (c.formulas.size() == serve::max_formulas && c.forgotten.empty())
+    throw std::runtime_error(fmt::format(
+        "A connection can only define {} formulas", serve::max_formulas));
+  if (auto ok = try_read(r.rest, c.words); !ok) {
+    put_parse_error(c.reply, ok.error());
+    return;
+  }
+  // strength reduced like calc --rows, so sharding doesn't change results
+  Rewrites applied;
+  uint32_t id = c.formulas.size();
+  if (!c.forgotten.empty()) {
+    id = c.forgotten.back();
+    c.forgotten.pop_back();
+    c.formulas[id] = compile(c.words, applied);
+  } else {
+    c.formulas.push_back(compile(c.words, applied));
+  }
+  auto &p = c.formulas[id];
+  put(c.reply, serve::Status::ok);
+  put<uint32_t>(c.reply, id);
+  put<uint32_t>(c.reply, p.variables.size());
+  for (auto &v : p.variables) {
+    put<uint32_t>(c.reply, v.view().size());
+    put(c.reply, v.view());
+  }
+}
+
+void answer_rows(Connection &c, Reader r) {
+  auto &p = formula(c, r.get<uint32_t>());
+  auto rows = r.get<uint32_t>();
+  if (rows > serve::max_rows)
+    throw std::runtime_error(
+        fmt::format("{} rows is more than {} at once", rows, serve::max_rows));
+  size_t vars = p.variables.size();
+  // copied out since nothing in the frame is aligned
+  auto data = r.bytes(vars * rows * sizeof(double));
+  c.columns.resize(vars * rows);
+  std::memcpy(c.columns.data(), data.data(), data.size());
+  c.column_ptrs.clear();
+  for (size_t v = 0; v != vars; ++v)
+    c.column_ptrs.push_back(c.columns.data() + v * rows);
+  c.results.resize(rows);
+  evaluate(p, c.column_ptrs, c.results.data(), rows);
+
+  put(c.reply, serve::Status::ok);
+  put(c.reply, std::string_view(reinterpret_cast<const char *>(
+                                    c.results.data()),
+                                rows * sizeof(double)));
+}
+
+void answer_forget(Connection &c, Reader r) {
+  auto id = r.get<uint32_t>();
+  formula(c, id) = Program{};
+  c.forgotten.push_back(id);
+  put(c.reply, serve::Status::ok);
+}
+
+void answer(Connection &c, std::string_view frame) {
+  auto at = begin_frame(c.reply);
+  try {
+    Reader r{frame};
+    switch (r.get<serve::Kind>()) {
+    case serve::Kind::batch:
+      answer_batch(c, r);
+      break;
+    case serve::Kind::define:
+      answer_define(c, r);
+      break;
+    case serve::Kind::rows:
+      answer_rows(c, r);
+      break;
+    case serve::Kind::forget:
+      answer_forget(c, r);
+      break;
+    default:
+      throw std::runtime_error("Unknown request kind");
+    }
+  } catch (std::exception &e) {
+    c.reply.resize(at + sizeof(uint32_t));
+    put(c.reply, serve::Status::error);
+    put(c.reply, std::string_view(e.what()));
+  }
+  end_frame(c.reply, at);
+}
+} // namespace
+
+namespace serve {
+void put_batch(std::vector<char> &out,
+               std::span<const std::string_view> expressions) {
+  auto at = begin_frame(out);
+  put(out, Kind::batch);
+  put<uint32_t>(out, expressions.size());
+  for (auto e : expressions) {
+    put<uint32_t>(out, e.size());
+    put(out, e);
+  }
+  end_frame(out, at);
+}
+void put_define(std::vector<char> &out, std::string_view expression) {
+  auto at = begin_frame(out);
+  put(out, Kind::define);
+  put(out, expression);
+  end_frame(out, at);
+}
+void put_rows(std::vector<char> &out, uint32_t formula, size_t rows,
+              std::span<const double *const> columns) {
+  auto at = begin_frame(out);
+  put(out, Kind::rows);
+  put<uint32_t>(out, formula);
+  put<uint32_t>(out, rows);
+  for (auto column : columns)
+    put(out, std::string_view(reinterpret_cast<const char *>(column),
+                              rows * sizeof(double)));
+  end_frame(out, at);
+}
+void put_forget(std::vector<char> &out, uint32_t formula) {
+  auto at = begin_frame(out);
+  put(out, Kind::forget);
+  put<uint32_t>(out, formula);
+  end_frame(out, at);
+}
+
+int connect(const std::string &address) {
+  auto e = endpoint(address);
+  Fd fd(socket(e.storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (fd.fd < 0 || ::connect(fd.fd, e.get(), e.size) != 0)
+    fail("Could not connect to", address);
+  if (e.tcp)
+    no_delay(fd.fd);
+  return std::exchange(fd.fd, -1);
+}
+
+void write_all(int fd, std::span<const char> bytes) {
+  while (!bytes.empty()) {
+    auto n = send(fd, bytes.data(), bytes.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      throw std::runtime_error("Server went away");
+    bytes = bytes.subspan(n);
+  }
+}
+
+void read_frame(int fd, std::vector<char> &frame) {
+  auto read_exactly = [&](char *to, size_t size) {
+    while (size != 0) {
+      auto n = recv(fd, to, size, 0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        throw std::runtime_error("Server went away");
+      to += n;
+      size -= n;
+    }
+  };
+  uint32_t size;
+  read_exactly(reinterpret_cast<char *>(&size), sizeof(size));
+  frame.resize(size);
+  read_exactly(frame.data(), size);
+}
+} // namespace serve
+
+struct Server::Impl {
+  std::string path;
+  bool tcp;
+  Fd listener, epoll, wake;
+  // the event loop's alone
+  std::unordered_map<int, ConnectionPtr> connections;
+  std::vector<char> buffer = std::vector<char>(64 << 10);
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<ConnectionPtr> queue;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+
+  Impl(const std::string &address, unsigned threads) : path(address) {
+    auto e = endpoint(address);
+    tcp = e.tcp;
+    listener.fd = socket(e.storage.ss_family,
+                         SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener.fd < 0)
+      fail("Could not create socket", path);
+    if (tcp) {
+      int one = 1;
+      setsockopt(listener.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    } else {
+      unlink(path.c_str());
+    }
+    if (bind(listener.fd, e.get(), e.size))
+      fail("Could not bind", path);
+    if (listen(listener.fd, SOMAXCONN))
+      fail("Could not listen on", path);
+    if (tcp) {
+      // the port the kernel picked when asked for 0
+      sockaddr_in in{};
+      socklen_t size = sizeof(in);
+      getsockname(listener.fd, reinterpret_cast<sockaddr *>(&in), &size);
+      char host[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &in.sin_addr, host, sizeof(host));
+      path = fmt::format("tcp:{}:{}", host, ntohs(in.sin_port));
+    }
+
+    epoll.fd = epoll_create1(EPOLL_CLOEXEC);
+    wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll.fd < 0 || wake.fd < 0)
+      fail("Could not set up the event loop for", path);
+    watch(listener.fd, EPOLLIN);
+    watch(wake.fd, EPOLLIN);
+
+    for (unsigned i = 0; i != threads; ++i)
+      workers.emplace_back([this] { work(); });
+  }
+  ~Impl() {
+    {
+      std::lock_guard lock(m);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto &t : workers)
+      t.join();
+    if (!tcp)
+      unlink(path.c_str());
+  }
+
+  bool watch(int fd, uint32_t events) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll.fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+  }
+
+  void run() {
+    epoll_event events[64];
+    for (;;) {
+      int n = epoll_wait(epoll.fd, events, std::size(events), -1);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        fail("Event loop failed on", path);
+      }
+      for (int i = 0; i != n; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == wake.fd)
+          return;
+        if (fd == listener.fd) {
+          accept_all();
+          continue;
+        }
+        auto it = connections.find(fd);
+        if (it == connections.end())
+          continue;
+        auto c = it->second;
+        if (events[i].events & EPOLLOUT) {
+          std::lock_guard lock(c->m);
+          flush(*c);
+        }
+        if (events[i].events & (read_events | EPOLLHUP | EPOLLERR))
+          read(c);
+      }
+    }
+  }
+
+  void accept_all() {
+    for (;;) {
+      int fd = accept4(listener.fd, nullptr, nullptr,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR)
+          continue;
+        // EAGAIN, or out of descriptors, in which case the rest wait
+        return;
+      }
+      if (tcp)
+        no_delay(fd);
+      auto c = std::make_shared<Connection>(fd);
+      if (watch(fd, read_events))
+        connections.emplace(fd, std::move(c));
+    }
+  }
+
+  void read(const ConnectionPtr &c) {
+    bool ready = false;
+    bool closed = false;
+    {
+      std::lock_guard lock(c->m);
+      bool eof = c->eof;
+      while (!eof) {
+        auto n = recv(c->fd.fd, buffer.data(), buffer.size(), 0);
+        if (n > 0) {
+          c->in.insert(c->in.end(), buffer.data(), buffer.data() + n);
+          continue;
+        }
+        if (n < 0 && errno == EINTR)
+          continue;
+        eof = n == 0;
+        // anything else but EAGAIN breaks the connection
+        c->closed = c->closed || (n < 0 && errno != EAGAIN &&
+                                  errno != EWOULDBLOCK);
+        break;
+      }
+      auto whole = whole_frames(c->in);
+      c->closed = c->closed || oversized(c->in, whole);
+      ready = !c->closed && whole != 0 && !c->queued;
+      c->queued = c->queued || ready;
+      if (eof && !c->eof) {
+        // stop reading, or the end of the stream keeps waking the loop
+        c->eof = true;
+        interest(*c);
+      }
+      // after the end of the stream, once everything has been answered and
+      // sent. a worker finishing the last of it shuts the socket down,
+      // which brings the connection back here
+      closed = c->closed || (c->eof && !c->queued && c->out.empty());
+    }
+    if (closed) {
+      // the worker may still hold it, the socket closes with the last owner
+      epoll_ctl(epoll.fd, EPOLL_CTL_DEL, c->fd.fd, nullptr);
+      connections.erase(c->fd.fd);
+    } else if (ready) {
+      {
+        std::lock_guard lock(m);
+        queue.push_back(c);
+      }
+      cv.notify_one();
+    }
+  }
+
+  // writes what it can and waits for EPOLLOUT for the rest. c.m is held
+  void flush(Connection &c) {
+    size_t sent = 0;
+    while (sent != c.out.size()) {
+      auto n = send(c.fd.fd, c.out.data() + sent, c.out.size() - sent,
+                    MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n > 0) {
+        sent += n;
+        continue;
+      }
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+      // the event loop notices the broken socket and drops it
+      c.closed = true;
+      c.out.clear();
+      return;
+    }
+    c.out.erase(c.out.begin(), c.out.begin() + sent);
+    bool writing = !c.out.empty();
+    if (writing != c.writing) {
+      c.writing = writing;
+      interest(c);
+    }
+    finish(c);
+  }
+
+  // what the event loop waits for on c. c.m is held
+  void interest(Connection &c) {
+    epoll_event ev{};
+    ev.events = c.eof ? 0 : read_events;
+    if (c.writing)
+      ev.events |= EPOLLOUT;
+    ev.data.fd = c.fd.fd;
+    epoll_ctl(epoll.fd, EPOLL_CTL_MOD, c.fd.fd, &ev);
+  }
+
+  // after the client's end of stream, shuts the socket down once every
+  // answer is out. the hang up that follows has the event loop drop it.
+  // c.m is held
+  void finish(Connection &c) {
+    if (c.eof && !c.queued && c.out.empty())
+      shutdown(c.fd.fd, SHUT_RDWR);
+  }
+
+  void work() {
+    for (;;) {
+      ConnectionPtr c;
+      {
+        std::unique_lock lock(m);
+        cv.wait(lock, [&] { return stopping || !queue.empty(); });
+        if (stopping)
+          return;
+        c = std::move(queue.front());
+        queue.pop_front();
+      }
+      serve(*c);
+    }
+  }
+
+  // answers every whole frame, including ones that arrive meanwhile, then
+  // hands the connection back to the event loop
+  void serve(Connection &c) {
+    for (;;) {
+      {
+        std::lock_guard lock(c.m);
+        auto whole = whole_frames(c.in);
+        if (c.closed || whole == 0) {
+          c.queued = false;
+          finish(c);
+          return;
+        }
+        c.work.assign(c.in.begin(), c.in.begin() + whole);
+        c.in.erase(c.in.begin(), c.in.begin() + whole);
+      }
+      c.reply.clear();
+      for (size_t at = 0; at != c.work.size();) {
+        uint32_t size;
+        std::memcpy(&size, c.work.data() + at, sizeof(size));
+        answer(c, std::string_view(c.work.data() + at + sizeof(size), size));
+        at += sizeof(size) + size;
+      }
+      std::lock_guard lock(c.m);
+      c.out.insert(c.out.end(), c.reply.begin(), c.reply.end());
+      flush(c);
+    }
+  }
+};
+
+Server::Server(const std::string &path, unsigned workers)
+    : impl(std::make_unique<Impl>(path, workers)) {}
+Server::~Server() = default;
+
+const std::string &Server::address() const noexcept { return impl->path; }
+
+void Server::run() { impl->run(); }
+
+void Server::stop() noexcept {
+  uint64_t one = 1;
+  [[maybe_unused]] auto n = write(impl->wake.fd, &one, sizeof(one));
+}
+} // namespace fcalc
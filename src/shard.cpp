@@ -0,0 +1,223 @@
+#include "shard.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <fmt/format.h>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include <unistd.h>
+
+namespace fcalc {
+namespace {
+// the status byte of a response, with the message of an error thrown
+std::string_view checked(std::string_view frame) {
+  if (frame.empty())
+    throw std::runtime_error("Empty response");
+  if (frame[0] == char(serve::Status::error))
+    throw std::runtime_error(std::string(frame.substr(1)));
+  return frame;
+}
+
+template <typename T> T get(std::string_view &rest) {
+  T v;
+  if (rest.size() < sizeof(T))
+    throw std::runtime_error("Truncated response");
+  std::memcpy(&v, rest.data(), sizeof(T));
+  rest.remove_prefix(sizeof(T));
+  return v;
+}
+
+// f(connection) on a thread per connection, rethrowing the first exception
+template <typename F> void each(size_t connections, F &&f) {
+  std::mutex m;
+  std::exception_ptr error;
+  std::vector<std::thread> threads;
+  for (size_t c = 0; c != connections; ++c) {
+    threads.emplace_back([&, c] {
+      try {
+        f(c);
+      } catch (...) {
+        std::lock_guard lock(m);
+        if (!error)
+          error = std::current_exception();
+      }
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+// connection c's shards of all of them, with up to shard_depth sent ahead
+// of the reply being read. send(s) writes shard s and receive(s) reads its
+// reply, so neither side ever holds more than the window
+template <typename Send, typename Receive>
+void windowed(size_t c, size_t connections, size_t shards, Send &&send,
+              Receive &&receive) {
+  size_t sent = c;
+  for (size_t s = c; s < shards; s += connections) {
+    for (; sent < shards && sent < s + shard_depth * connections;
+         sent += connections)
+      send(sent);
+    receive(s);
+  }
+}
+
+// where each batch shard starts, then the end. a shard closes after lines
+// expressions, or sooner if its request or its answer would outgrow a frame
+std::vector<size_t> batch_bounds(std::span<const std::string_view> expressions,
+                                 size_t lines) {
+  constexpr size_t header = sizeof(serve::Kind) + sizeof(uint32_t);
+  constexpr size_t answers = (serve::max_frame - 1) / serve::result_size;
+  lines = std::min(lines, answers);
+  std::vector<size_t> bounds{0};
+  size_t size = header;
+  for (size_t i = 0; i != expressions.size(); ++i) {
+    auto bytes = sizeof(uint32_t) + expressions[i].size();
+    if (header + bytes > serve::max_frame)
+      throw std::runtime_error(
+          fmt::format("Expression {} is {} bytes, more than a frame holds", i,
+                      expressions[i].size()));
+    if (i - bounds.back() == lines || size + bytes > serve::max_frame) {
+      bounds.push_back(i);
+      size = header;
+    }
+    size += bytes;
+  }
+  if (!expressions.empty())
+    bounds.push_back(expressions.size());
+  return bounds;
+}
+} // namespace
+
+Coordinator::Coordinator(std::span<const std::string> addresses) {
+  if (addresses.empty())
+    throw std::runtime_error("No workers to shard over");
+  try {
+    for (auto &a : addresses)
+      fds.push_back(serve::connect(a));
+  } catch (...) {
+    for (int fd : fds)
+      close(fd);
+    throw;
+  }
+}
+
+Coordinator::~Coordinator() {
+  for (int fd : fds)
+    close(fd);
+}
+
+std::vector<ShardResult>
+Coordinator::evaluate(std::span<const std::string_view> expressions,
+                      size_t lines) {
+  auto bounds = batch_bounds(expressions, std::max<size_t>(lines, 1));
+  size_t shards = bounds.size() - 1;
+  std::vector<ShardResult> results(expressions.size());
+  each(fds.size(), [&](size_t c) {
+    std::vector<char> frame;
+    auto send = [&](size_t s) {
+      auto begin = bounds[s], count = bounds[s + 1] - begin;
+      frame.clear();
+      serve::put_batch(frame, expressions.subspan(begin, count));
+      serve::write_all(fds[c], frame);
+    };
+    auto receive = [&](size_t s) {
+      serve::read_frame(fds[c], frame);
+      auto rest = checked({frame.data(), frame.size()}).substr(1);
+      for (size_t i = bounds[s]; i != bounds[s + 1]; ++i) {
+        auto &r = results[i];
+        r.status = get<serve::Status>(rest);
+        auto body = rest;
+        // every result is the same size, whatever it holds
+        get<double>(rest);
+        if (r.status == serve::Status::ok) {
+          r.value = get<double>(body);
+        } else if (r.status == serve::Status::parse_error) {
+          r.error.code = get<ParseError::Code>(body);
+          r.error.offset = get<uint32_t>(body);
+        }
+      }
+    };
+    windowed(c, fds.size(), shards, send, receive);
+  });
+  return results;
+}
+
+std::vector<double>
+Coordinator::evaluate(std::string_view formula,
+                      std::span<const std::string_view> names,
+                      std::span<const double *const> columns, size_t rows,
+                      size_t shard) {
+  if (names.size() != columns.size())
+    throw std::runtime_error("Every column needs a name");
+  shard = std::max<size_t>(shard, 1);
+  std::vector<double> out(rows);
+  each(fds.size(), [&](size_t c) {
+    std::vector<char> frame;
+    serve::put_define(frame, formula);
+    serve::write_all(fds[c], frame);
+    serve::read_frame(fds[c], frame);
+    std::string_view rest = checked({frame.data(), frame.size()});
+    if (get<serve::Status>(rest) == serve::Status::parse_error) {
+      ParseError e;
+      e.code = get<ParseError::Code>(rest);
+      e.offset = get<uint32_t>(rest);
+      throw std::runtime_error(e.message(formula));
+    }
+    // columns go in the worker's variable order, not the caller's
+    auto id = get<uint32_t>(rest);
+    std::vector<const double *> order(get<uint32_t>(rest));
+    for (auto &o : order) {
+      auto length = get<uint32_t>(rest);
+      if (length > rest.size())
+        throw std::runtime_error("Truncated response");
+      auto name = rest.substr(0, length);
+      rest.remove_prefix(length);
+      auto it = std::find(names.begin(), names.end(), name);
+      if (it == names.end())
+        throw std::runtime_error(
+            fmt::format("No column for variable {}", name));
+      o = columns[it - names.begin()];
+    }
+
+    // every connection comes to the same size, so they agree on the shards
+    constexpr size_t header = sizeof(serve::Kind) + 2 * sizeof(uint32_t);
+    auto fits = (serve::max_frame - header) /
+                (sizeof(double) * std::max<size_t>(order.size(), 1));
+    auto step = std::min({shard, fits, size_t(serve::max_rows)});
+    size_t shards = (rows + step - 1) / step;
+    std::vector<const double *> at(order.size());
+    auto send = [&](size_t s) {
+      auto begin = s * step;
+      for (size_t v = 0; v != order.size(); ++v)
+        at[v] = order[v] + begin;
+      frame.clear();
+      serve::put_rows(frame, id, std::min(step, rows - begin), at);
+      serve::write_all(fds[c], frame);
+    };
+    auto receive = [&](size_t s) {
+      serve::read_frame(fds[c], frame);
+      auto begin = s * step;
+      auto count = std::min(step, rows - begin);
+      auto body = checked({frame.data(), frame.size()}).substr(1);
+      if (body.size() != count * sizeof(double))
+        throw std::runtime_error("Truncated response");
+      std::memcpy(out.data() + begin, body.data(), body.size());
+    };
+    windowed(c, fds.size(), shards, send, receive);
+
+    // the worker can give the id to the next formula
+    frame.clear();
+    serve::put_forget(frame, id);
+    serve::write_all(fds[c], frame);
+    serve::read_frame(fds[c], frame);
+    checked({frame.data(), frame.size()});
+  });
+  return out;
+}
+} // namespace fcalc
@@ -0,0 +1,133 @@
+#include "tiered.hpp"
+#include "real_eval.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fmt/format.h>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace fcalc {
+struct TieredEvaluator::State {
+  Words words;
+  std::atomic<uint64_t> calls{0};
+  // published once by the compiler thread, stays null if compiling threw
+  std::atomic<const ScalarProgram *> program{nullptr};
+  std::unique_ptr<ScalarProgram> owned;
+};
+
+// one thread compiles whatever went hot, in the order it did
+struct TieredEvaluator::Impl {
+  std::mutex m;
+  std::condition_variable wake, idle;
+  std::deque<std::shared_ptr<State>> queue;
+  bool busy = false;
+  bool stopping = false;
+  std::thread thread;
+
+  Impl() : thread([this] { work(); }) {}
+
+  // a formula that can't be compiled, say one using i, stays on the walk,
+  // which reports the error on every call the same as before
+  static void compile(State &s) {
+    try {
+      s.owned = std::make_unique<ScalarProgram>(compile_scalar(s.words));
+      s.program.store(s.owned.get(), std::memory_order_release);
+    } catch (std::exception &) {
+    }
+  }
+
+  void work() {
+    std::unique_lock lock(m);
+    for (;;) {
+      wake.wait(lock, [&] { return stopping || !queue.empty(); });
+      if (stopping)
+        return;
+      auto state = std::move(queue.front());
+      queue.pop_front();
+      busy = true;
+      lock.unlock();
+      compile(*state);
+      lock.lock();
+      busy = false;
+      if (queue.empty())
+        idle.notify_all();
+    }
+  }
+
+  ~Impl() {
+    {
+      std::lock_guard lock(m);
+      stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+  }
+};
+
+TieredEvaluator::TieredEvaluator(uint64_t hot_calls)
+    : hot_calls(hot_calls), impl(std::make_unique<Impl>()) {}
+TieredEvaluator::~TieredEvaluator() = default;
+
+TieredEvaluator::Formula TieredEvaluator::load(std::string_view formula) {
+  auto state = std::make_shared<State>();
+  if (auto ok = try_read(formula, state->words); !ok)
+    throw std::runtime_error(ok.error().message(formula));
+  if (hot_calls == 0)
+    promote(state);
+  return {std::move(state), this};
+}
+
+void TieredEvaluator::promote(std::shared_ptr<State> state) {
+  {
+    std::lock_guard lock(impl->m);
+    impl->queue.push_back(std::move(state));
+  }
+  impl->wake.notify_one();
+}
+
+void TieredEvaluator::drain() {
+  std::unique_lock lock(impl->m);
+  impl->idle.wait(lock, [&] { return impl->queue.empty() && !impl->busy; });
+}
+
+double
+TieredEvaluator::Formula::operator()(std::span<const Binding<double>> vars)
+    const {
+  if (auto *p = state->program.load(std::memory_order_acquire)) {
+    // names are looked up once per slot instead of once per occurrence
+    double small[16];
+    std::vector<double> large;
+    std::span<double> values(small, p->variables.size());
+    if (p->variables.size() > std::size(small)) {
+      large.resize(p->variables.size());
+      values = large;
+    }
+    for (size_t k = 0; k != values.size(); ++k) {
+      auto name = p->variables[k].view();
+      auto it = std::ranges::find(vars, name, &Binding<double>::name);
+      if (it == vars.end())
+        throw std::runtime_error(fmt::format("Unbound variable: {}", name));
+      values[k] = it->value;
+    }
+    return evaluate(*p, values);
+  }
+  // only the call that crosses the threshold queues it
+  if (state->calls.fetch_add(1, std::memory_order_relaxed) + 1 ==
+      owner->hot_calls)
+    owner->promote(state);
+  return evaluate(state->words, vars);
+}
+
+uint64_t TieredEvaluator::Formula::calls() const noexcept {
+  return state->calls.load(std::memory_order_relaxed);
+}
+
+bool TieredEvaluator::Formula::compiled() const noexcept {
+  return state->program.load(std::memory_order_acquire) != nullptr;
+}
+} // namespace fcalc
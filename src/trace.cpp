@@ -0,0 +1,152 @@
+#include "trace.hpp"
+
+#include <chrono>
+#include <fmt/format.h>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace fcalc::trace {
+std::atomic<bool> enabled_flag{false};
+
+namespace {
+struct Event {
+  uint64_t begin;
+  uint64_t end;
+  Phase phase;
+};
+
+// written only by its own thread and read only by flush, so head and tail
+// are all the synchronization it needs
+struct Ring {
+  static constexpr uint64_t capacity = 1 << 13;
+  std::atomic<uint64_t> head{};
+  std::atomic<uint64_t> tail{};
+  std::atomic<uint64_t> dropped{};
+  uint32_t tid{};
+  // cleared under the registry lock when the thread exits
+  bool owned = true;
+  Event events[capacity];
+};
+
+struct Registry {
+  std::mutex lock;
+  // rings outlive their threads so nothing is lost before a flush, and once
+  // drained they are handed to the next new thread instead of piling up
+  std::vector<std::unique_ptr<Ring>> rings;
+  uint32_t next_tid = 1;
+  // taken on the first set_enabled(true), to turn ticks into microseconds
+  bool calibrated = false;
+  uint64_t start_ticks{};
+  std::chrono::steady_clock::time_point start_time;
+};
+
+Registry &registry() {
+  static Registry r;
+  return r;
+}
+
+struct Owner {
+  Ring *ring;
+
+  Owner() {
+    auto &reg = registry();
+    std::lock_guard guard(reg.lock);
+    ring = nullptr;
+    for (auto &r : reg.rings)
+      if (!r->owned && r->head.load(std::memory_order_relaxed) ==
+                           r->tail.load(std::memory_order_relaxed)) {
+        ring = r.get();
+        break;
+      }
+    if (!ring)
+      ring = reg.rings.emplace_back(std::make_unique<Ring>()).get();
+    ring->owned = true;
+    ring->tid = reg.next_tid++;
+  }
+  Owner(const Owner &) = delete;
+  ~Owner() {
+    auto &reg = registry();
+    std::lock_guard guard(reg.lock);
+    ring->owned = false;
+  }
+};
+
+Ring &local_ring() {
+  thread_local Owner owner;
+  return *owner.ring;
+}
+} // namespace
+
+void set_enabled(bool on) noexcept {
+  if (on) {
+    auto &reg = registry();
+    std::lock_guard guard(reg.lock);
+    if (!reg.calibrated) {
+      reg.start_time = std::chrono::steady_clock::now();
+      reg.start_ticks = now();
+      reg.calibrated = true;
+    }
+  }
+  enabled_flag.store(on, std::memory_order_relaxed);
+}
+
+void record(Phase p, uint64_t begin, uint64_t end) noexcept {
+  auto &r = local_ring();
+  auto head = r.head.load(std::memory_order_relaxed);
+  if (head - r.tail.load(std::memory_order_acquire) == Ring::capacity) {
+    r.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  r.events[head % Ring::capacity] = {begin, end, p};
+  r.head.store(head + 1, std::memory_order_release);
+}
+
+std::string flush() {
+  auto &reg = registry();
+  std::lock_guard guard(reg.lock);
+  std::string out = R"({"traceEvents":[)";
+  if (!reg.calibrated)
+    return out + "]}";
+
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - reg.start_time;
+  double ticks = double(now() - reg.start_ticks);
+  double ticks_per_us =
+      elapsed.count() > 0 && ticks > 0 ? ticks / elapsed.count() : 1.0;
+
+  bool first = true;
+  uint64_t lost = 0;
+  for (auto &r : reg.rings) {
+    auto tail = r->tail.load(std::memory_order_relaxed);
+    auto head = r->head.load(std::memory_order_acquire);
+    for (; tail != head; ++tail) {
+      auto &e = r->events[tail % Ring::capacity];
+      double ts = double(int64_t(e.begin - reg.start_ticks)) / ticks_per_us;
+      double dur = double(e.end - e.begin) / ticks_per_us;
+      fmt::format_to(std::back_inserter(out),
+                     R"({}{{"name":"{}","ph":"X","pid":1,"tid":{},)"
+                     R"("ts":{:.3f},"dur":{:.3f}}})",
+                     first ? "" : ",", format_as(e.phase), r->tid, ts, dur);
+      first = false;
+    }
+    r->tail.store(tail, std::memory_order_release);
+    // taken rather than reset, so a drop counted while this runs is either
+    // reported here or left for the next flush
+    lost += r->dropped.exchange(0, std::memory_order_relaxed);
+  }
+  fmt::format_to(std::back_inserter(out), R"(],"otherData":{{"dropped":{}}}}})",
+                 lost);
+  return out;
+}
+
+uint64_t dropped() noexcept {
+  auto &reg = registry();
+  std::lock_guard guard(reg.lock);
+  uint64_t total = 0;
+  for (auto &r : reg.rings)
+    total += r->dropped.load(std::memory_order_relaxed);
+  return total;
+}
+} // namespace fcalc::trace
@@ -0,0 +1,238 @@
+#include "vmath.hpp"
+
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <numbers>
+#include <type_traits>
+
+// double4 never crosses this file, so the calling convention gcc warns
+// about without avx doesn't matter
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+namespace fcalc::vmath {
+namespace {
+using double4 = double __attribute__((vector_size(32)));
+using uint4 = uint64_t __attribute__((vector_size(32)));
+
+// the integer side stays unsigned, 64 bit arithmetic shifts and compares
+// aren't in sse2 and would split the vector kernels into scalar code
+template <typename T> struct Lanes {
+  using Int = uint64_t;
+};
+template <> struct Lanes<double4> {
+  using Int = uint4;
+};
+template <typename T> using Int = typename Lanes<T>::Int;
+
+template <typename T> Int<T> bits(T x) { return std::bit_cast<Int<T>>(x); }
+template <typename T> T from_bits(Int<T> x) { return std::bit_cast<T>(x); }
+// comparisons give bool for double and a lane mask for double4. gcc splits
+// ?: on vectors into scalar compares, masking by hand keeps it in registers
+template <typename C, typename T> T select(C c, T a, T b) {
+  if constexpr (std::is_same_v<T, double>) {
+    return c ? a : b;
+  } else {
+    auto mask = std::bit_cast<Int<T>>(c);
+    return from_bits<T>((bits(a) & mask) | (bits(b) & ~mask));
+  }
+}
+// a where bit 0 of pick is set, b elsewhere
+template <typename T> T pick_bits(Int<T> pick, T a, T b) {
+  Int<T> mask = 0 - (pick & 1);
+  return from_bits<T>((bits(a) & mask) | (bits(b) & ~mask));
+}
+
+// adding 1.5 * 2^52 rounds to an integer and leaves it in the low mantissa
+// bits, which saves a conversion either way
+constexpr double round_magic = 0x1.8p52;
+template <typename T> T round(T x) {
+  return (x + round_magic) - round_magic;
+}
+template <typename T> Int<T> round_int(T x) {
+  return bits(T(x + round_magic)) - bits(T{} + round_magic);
+}
+
+constexpr double ln2_hi = 0x1.62e42fee00000p-1;
+constexpr double ln2_lo = 0x1.a39ef35793c76p-33;
+
+// forced inline into the column loops, where an out of line call would
+// pass double4 through memory without avx
+template <typename T> [[gnu::always_inline]] inline T exp_kernel(T x) {
+  // past these exp is inf or 0 anyway, and 2^k stays in range. nan fails
+  // both compares and goes through
+  x = select(x > 709.8, T{} + 709.8, x);
+  x = select(x < -745.2, T{} - 745.2, x);
+  T k = round(x * std::numbers::log2e);
+  // ln2_hi has its low bits clear, so k * ln2_hi is exact
+  T r = (x - k * ln2_hi) - k * ln2_lo;
+  // |r| <= ln2 / 2, taylor to r^13 is below half an ulp
+  T p = 1.0 / 479001600 + r * (1.0 / 6227020800);
+  p = 1.0 / 39916800 + r * p;
+  p = 1.0 / 3628800 + r * p;
+  p = 1.0 / 362880 + r * p;
+  p = 1.0 / 40320 + r * p;
+  p = 1.0 / 5040 + r * p;
+  p = 1.0 / 720 + r * p;
+  p = 1.0 / 120 + r * p;
+  p = 1.0 / 24 + r * p;
+  p = 1.0 / 6 + r * p;
+  p = 0.5 + r * p;
+  p = 1 + r * p;
+  p = 1 + r * p;
+  // 2^k in two halves, k runs past what a single exponent field holds
+  T k1 = round(k * 0.5);
+  T s1 = from_bits<T>((round_int(k1) + 1023) << 52);
+  T s2 = from_bits<T>((round_int(k - k1) + 1023) << 52);
+  return p * s1 * s2;
+}
+
+template <typename T> [[gnu::always_inline]] inline T log_kernel(T x) {
+  constexpr double inf = std::numeric_limits<double>::infinity();
+  // subnormals are scaled up first so the exponent field is meaningful
+  auto tiny = x < 0x1p-1022;
+  T y = select(tiny, x * 0x1p54, x);
+  T e = select(tiny, T{} - 54, T{});
+  auto b = bits(y);
+  // exponent, as a double through the same trick as round_int
+  e += from_bits<T>(((b >> 52) & 0x7ff) + bits(T{} + round_magic)) -
+       (round_magic + 1023);
+  T m = from_bits<T>((b & 0xfffffffffffff) | (uint64_t(1023) << 52));
+  // m in [sqrt(1/2), sqrt(2)) keeps s small
+  auto big = m > std::numbers::sqrt2;
+  m = select(big, m * 0.5, m);
+  e += select(big, T{} + 1, T{});
+  // fdlibm's log1p(f) = f - f^2/2 + s (f^2/2 + R(s^2)) with s = f / (2 + f)
+  T f = m - 1;
+  T s = f / (2 + f);
+  T z = s * s;
+  T w = z * z;
+  T r1 = w * (3.999999999940941908e-01 +
+              w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+  T r2 = z * (6.666666666666735130e-01 +
+              w * (2.857142874366239149e-01 +
+                   w * (1.818357216161805012e-01 +
+                        w * 1.479819860511658591e-01)));
+  T hfsq = 0.5 * f * f;
+  T r = e * ln2_hi - ((hfsq - (s * (hfsq + r1 + r2) + e * ln2_lo)) - f);
+  r = select(x == 0, T{} - inf, r);
+  r = select(x < 0, T{} + std::numeric_limits<double>::quiet_NaN(), r);
+  r = select(x == inf, T{} + inf, r);
+  return select(x != x, x, r);
+}
+
+// pi/2 split in 33 bit parts and the tail after the third, from fdlibm
+constexpr double pio2_1 = 1.57079632673412561417e+00;
+constexpr double pio2_2 = 6.07710050630396597660e-11;
+constexpr double pio2_3 = 2.02226624871116645580e-21;
+constexpr double pio2_3t = 8.47842766036889956997e-32;
+
+// a - b = result + err exactly
+template <typename T> T two_diff(T a, T b, T &err) {
+  T s = a - b;
+  T bb = s - a;
+  err = (a - (s - bb)) - (b + bb);
+  return s;
+}
+
+// fdlibm's sin and cos kernels on [-pi/4, pi/4], y is the tail of x left
+// over from the reduction
+template <typename T> T sin_kernel(T x, T y) {
+  T z = x * x;
+  T v = z * x;
+  T r = 8.33333333332248946124e-03 +
+        z * (-1.98412698298579493134e-04 +
+             z * (2.75573137070700676789e-06 +
+                  z * (-2.50507602534068634195e-08 +
+                       z * 1.58969099521155010221e-10)));
+  return x - ((z * (0.5 * y - v * r) - y) - v * -1.66666666666666324348e-01);
+}
+template <typename T> T cos_kernel(T x, T y) {
+  T z = x * x;
+  T w = z * z;
+  T r = z * (4.16666666666666019037e-02 +
+             z * (-1.38888888888741095749e-03 +
+                  z * 2.48015872894767294178e-05)) +
+        w * w *
+            (-2.75573143513906633035e-07 +
+             z * (2.08757232129817482790e-09 +
+                  z * -1.13596475577881948265e-11));
+  T hz = 0.5 * z;
+  w = 1 - hz;
+  return w + (((1 - w) - hz) + (z * r - x * y));
+}
+
+// quadrant is 0 for sin and 1 for cos, since cos(x) = sin(x + pi/2)
+template <typename T>
+[[gnu::always_inline]] inline T sin_cos_kernel(T x, int quadrant) {
+  T t = x * std::numbers::inv_pi * 2;
+  T n = round(t);
+  auto q = round_int(t) + quadrant;
+  // cody-waite in three parts, the products are exact for |n| < 2^20 and
+  // the rounding of each subtraction is carried into the tail
+  T r = x - n * pio2_1;
+  T e2, e3;
+  T r2 = two_diff(r, n * pio2_2, e2);
+  T r3 = two_diff(r2, n * pio2_3, e3);
+  T tail = n * pio2_3t - (e2 + e3);
+  T y0 = r3 - tail;
+  T y1 = (r3 - y0) - tail;
+  T v = pick_bits(q, cos_kernel(y0, y1), sin_kernel(y0, y1));
+  // quadrants 2 and 3 flip the sign
+  return from_bits<T>(bits(v) ^ ((q & 2) << 62));
+}
+
+constexpr double reduction_limit = 1e6;
+
+enum struct Kernel { exp, log, sin, cos };
+
+template <Kernel K, typename T> [[gnu::always_inline]] inline T apply(T x) {
+  if constexpr (K == Kernel::exp)
+    return exp_kernel(x);
+  else if constexpr (K == Kernel::log)
+    return log_kernel(x);
+  else
+    return sin_cos_kernel(x, K == Kernel::sin ? 0 : 1);
+}
+template <Kernel K> double scalar(double x) noexcept {
+  if constexpr (K == Kernel::sin || K == Kernel::cos) {
+    if (std::abs(x) > reduction_limit)
+      return K == Kernel::sin ? std::sin(x) : std::cos(x);
+  }
+  return apply<K>(x);
+}
+
+// four at a time, then the tail one by one through the scalar kernel.
+// sin and cos lanes past the reduction limit are redone by libm, which is
+// rare enough that checking afterwards beats a blend
+template <Kernel K> void columns(double *x, size_t n) noexcept {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    double4 v;
+    std::memcpy(&v, x + i, sizeof(v));
+    double4 r = apply<K>(v);
+    if constexpr (K == Kernel::sin || K == Kernel::cos) {
+      for (int k = 0; k != 4; ++k) {
+        if (std::abs(v[k]) > reduction_limit)
+          r[k] = scalar<K>(v[k]);
+      }
+    }
+    std::memcpy(x + i, &r, sizeof(r));
+  }
+  for (; i != n; ++i)
+    x[i] = scalar<K>(x[i]);
+}
+} // namespace
+
+double exp(double x) noexcept { return scalar<Kernel::exp>(x); }
+double log(double x) noexcept { return scalar<Kernel::log>(x); }
+double sin(double x) noexcept { return scalar<Kernel::sin>(x); }
+double cos(double x) noexcept { return scalar<Kernel::cos>(x); }
+
+void exp(double *x, size_t n) noexcept { columns<Kernel::exp>(x, n); }
+void log(double *x, size_t n) noexcept { columns<Kernel::log>(x, n); }
+void sin(double *x, size_t n) noexcept { columns<Kernel::sin>(x, n); }
+void cos(double *x, size_t n) noexcept { columns<Kernel::cos>(x, n); }
+} // namespace fcalc::vmath
@@ -0,0 +1,161 @@
+#include "work_pool.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fcalc {
+struct WorkPool::Impl {
+  struct Deque {
+    std::mutex m;
+    std::deque<Job *> jobs;
+  };
+
+  // deques[0] is shared by every thread outside the pool, worker n owns
+  // deques[n]
+  std::vector<Deque> deques;
+  std::vector<std::thread> threads;
+  // bumped to wake sleeping workers
+  std::atomic<uint32_t> epoch{0};
+  std::atomic<uint32_t> sleepers{0};
+  std::atomic<bool> stopping{false};
+
+  static thread_local Impl *current_pool;
+  static thread_local size_t current_index;
+
+  explicit Impl(unsigned workers) : deques(workers + 1) {
+    threads.reserve(workers);
+    for (unsigned n = 1; n <= workers; ++n)
+      threads.emplace_back([this, n] { work(n); });
+  }
+
+  size_t home() const noexcept {
+    return current_pool == this ? current_index : 0;
+  }
+
+  void push(Job &job) {
+    auto &d = deques[home()];
+    {
+      std::lock_guard lock(d.m);
+      d.jobs.push_back(&job);
+    }
+    // pairs with the fence in work, either the sleeper sees the job or we
+    // see the sleeper
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_relaxed) != 0) {
+      epoch.fetch_add(1, std::memory_order_release);
+      epoch.notify_one();
+    }
+  }
+
+  // the shared deque can hold other threads' jobs behind ours, so search
+  // rather than only looking at the back
+  bool take_back(Job &job) {
+    auto &d = deques[home()];
+    std::lock_guard lock(d.m);
+    auto it = std::find(d.jobs.rbegin(), d.jobs.rend(), &job);
+    if (it == d.jobs.rend())
+      return false;
+    d.jobs.erase(std::next(it).base());
+    return true;
+  }
+
+  // newest of our own first, then the oldest of everyone else's, which
+  // tend to be the biggest subtrees
+  Job *find(size_t self) {
+    {
+      auto &d = deques[self];
+      std::lock_guard lock(d.m);
+      if (!d.jobs.empty()) {
+        auto *job = d.jobs.back();
+        d.jobs.pop_back();
+        return job;
+      }
+    }
+    for (size_t k = 1; k != deques.size(); ++k) {
+      auto &d = deques[(self + k) % deques.size()];
+      std::lock_guard lock(d.m);
+      if (!d.jobs.empty()) {
+        auto *job = d.jobs.front();
+        d.jobs.pop_front();
+        return job;
+      }
+    }
+    return nullptr;
+  }
+
+  // done is the last thing touched, the job lives on its owner's stack
+  static void execute(Job &job) noexcept {
+    try {
+      job.run(job);
+    } catch (...) {
+      job.error = std::current_exception();
+    }
+    job.done.store(true, std::memory_order_release);
+  }
+
+  void join(Job &job) {
+    if (take_back(job)) {
+      execute(job);
+      return;
+    }
+    while (!job.done.load(std::memory_order_acquire)) {
+      if (auto *other = find(home()))
+        execute(*other);
+      else
+        std::this_thread::yield();
+    }
+  }
+
+  void work(size_t index) {
+    current_pool = this;
+    current_index = index;
+    while (!stopping.load(std::memory_order_acquire)) {
+      if (auto *job = find(index)) {
+        execute(*job);
+        continue;
+      }
+      // forks come in bursts, spin a little before going to sleep
+      Job *job = nullptr;
+      for (int spin = 0; spin != 64 && !job; ++spin) {
+        std::this_thread::yield();
+        job = find(index);
+      }
+      if (!job) {
+        auto seen = epoch.load(std::memory_order_acquire);
+        sleepers.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        job = find(index);
+        if (!job && !stopping.load(std::memory_order_acquire))
+          epoch.wait(seen, std::memory_order_acquire);
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+      }
+      if (job)
+        execute(*job);
+    }
+  }
+
+  ~Impl() {
+    stopping.store(true, std::memory_order_release);
+    epoch.fetch_add(1, std::memory_order_release);
+    epoch.notify_all();
+    for (auto &t : threads)
+      t.join();
+  }
+};
+
+thread_local WorkPool::Impl *WorkPool::Impl::current_pool = nullptr;
+thread_local size_t WorkPool::Impl::current_index = 0;
+
+WorkPool::WorkPool(unsigned workers) : impl(std::make_unique<Impl>(workers)) {}
+WorkPool::~WorkPool() = default;
+
+unsigned WorkPool::size() const noexcept {
+  return unsigned(impl->threads.size()) + 1;
+}
+
+void WorkPool::push(Job &job) { impl->push(job); }
+void WorkPool::join(Job &job) { impl->join(job); }
+} // namespace fcalc
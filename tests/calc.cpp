@@ -7,11 +7,11 @@ std::string print_recurse(calc::Word *w) {
   if (!w)
     return result;
   result = fmt::format("{} ", w->format());
-  if (auto b = dynamic_cast<calc::Binary *>(w)) {
-    result.append(print_recurse(b->lhs.get()));
-    result.append(print_recurse(b->rhs.get()));
+  if (auto b = calc::word_cast<calc::Binary>(w)) {
+    result.append(print_recurse(b->lhs));
+    result.append(print_recurse(b->rhs));
   }
-  result.append(print_recurse(w->child.get()));
+  result.append(print_recurse(w->child));
   return result;
 }
 } // namespace
@@ -20,14 +20,13 @@ int main() {
   constexpr const char *input = "v = 3 * 2 + 1 - aπb ^ 2 / i";
   // = v + * 3 2 - 1 aπ / ^ b 2 i
 
-  auto a = calc::tokenize(input);
+  calc::Pool pool;
+  auto a = calc::tokenize(input, pool);
   auto root = calc::parse(std::move(a));
-  fmt::print("out: {}\n", print_recurse(root.get()));
-  fmt::print("child: {}\n", print_recurse(root->child.get()));
-  fmt::print(
-      "lhs: {}\n",
-      print_recurse(dynamic_cast<calc::Binary *>(root.get())->lhs.get()));
-  fmt::print(
-      "rhs: {}\n",
-      print_recurse(dynamic_cast<calc::Binary *>(root.get())->rhs.get()));
-}
\ No newline at end of file
+  fmt::print("out: {}\n", print_recurse(root));
+  fmt::print("child: {}\n", print_recurse(root->child));
+  fmt::print("lhs: {}\n",
+             print_recurse(calc::word_cast<calc::Binary>(root)->lhs));
+  fmt::print("rhs: {}\n",
+             print_recurse(calc::word_cast<calc::Binary>(root)->rhs));
+}
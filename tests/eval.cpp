@@ -0,0 +1,1020 @@
+#include "fast_calc/complex_eval.hpp"
+#include "fast_calc/csv.hpp"
+#include "fast_calc/decimal_eval.hpp"
+#include "fast_calc/dual_eval.hpp"
+#include "fast_calc/fcalc.hpp"
+#include "fast_calc/float_eval.hpp"
+#include "fast_calc/formula_set.hpp"
+#include "fast_calc/image.hpp"
+#include "fast_calc/output.hpp"
+#include "fast_calc/pipeline.hpp"
+#include "fast_calc/real_eval.hpp"
+#include "fast_calc/tiered.hpp"
+#include "fast_calc/vmath.hpp"
+#include "fast_calc/work_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fmt/core.h>
+#include <fstream>
+#include <iterator>
+#include <numbers>
+#include <sstream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+int failures = 0;
+
+bool near(double a, double b) {
+  return std::abs(a - b) <= 1e-9 * std::max(1.0, std::abs(b));
+}
+
+// walking either way and the compiled forms have to agree with each other
+// too
+void check_real(std::string_view input, double expected) {
+  auto a = fcalc::tokenize(input);
+  fcalc::parse(a);
+  auto got = fcalc::evaluate(a);
+  auto branched = fcalc::evaluate(a, {}, fcalc::Conditionals::short_circuit);
+  auto scalar = fcalc::evaluate(fcalc::compile_scalar(a), {});
+  double column;
+  fcalc::evaluate(fcalc::compile(a), {}, &column, 1);
+  if (!near(got, expected) || got != branched || got != scalar ||
+      got != column) {
+    fmt::print("{}: expected {}, got {} walking, {} short circuit, {} and {} "
+               "compiled\n",
+               input, expected, got, branched, scalar, column);
+    ++failures;
+  }
+}
+
+// the kernels against libm in ulp, and the columns against the scalar
+// versions to the bit
+void check_vmath() {
+  struct Case {
+    const char *name;
+    double (*f)(double);
+    void (*column)(double *, size_t);
+    double (*libm)(double);
+    double lo, hi;
+  } cases[] = {
+      {"exp", fcalc::vmath::exp, fcalc::vmath::exp, std::exp, -745, 709},
+      {"log", fcalc::vmath::log, fcalc::vmath::log, std::log, 1e-310, 1e300},
+      {"sin", fcalc::vmath::sin, fcalc::vmath::sin, std::sin, -1e7, 1e7},
+      {"cos", fcalc::vmath::cos, fcalc::vmath::cos, std::cos, -1e4, 1e4},
+  };
+  for (auto &c : cases) {
+    std::vector<double> xs;
+    for (size_t k = 0; k != 50001; ++k) {
+      double t = double(k) / 50000;
+      // log gets its inputs spread over the exponents instead
+      xs.push_back(c.lo > 0 ? c.lo * std::pow(c.hi / c.lo, t)
+                            : c.lo + (c.hi - c.lo) * t);
+    }
+    xs.insert(xs.end(), {0.0, -0.0, INFINITY, -INFINITY, NAN});
+    auto ys = xs;
+    c.column(ys.data(), ys.size());
+    for (size_t k = 0; k != xs.size(); ++k) {
+      double want = c.libm(xs[k]), got = c.f(xs[k]);
+      double ulp = std::abs(std::nextafter(want, INFINITY) - want);
+      bool same = std::isnan(want) ? std::isnan(got)
+                                   : got == want ||
+                                         std::abs(got - want) <= 2 * ulp;
+      if (!same || std::bit_cast<uint64_t>(got) !=
+                       std::bit_cast<uint64_t>(ys[k])) {
+        fmt::print("vmath {}({}): expected {}, got {} scalar and {} column\n",
+                   c.name, xs[k], want, got, ys[k]);
+        ++failures;
+        break;
+      }
+    }
+  }
+}
+
+void check_complex(std::string_view input, fcalc::Complex expected) {
+  auto a = fcalc::tokenize(input);
+  fcalc::parse(a);
+  auto got = fcalc::evaluate_complex(a);
+  if (!near(got.real(), expected.real()) ||
+      !near(got.imag(), expected.imag())) {
+    fmt::print("{}: expected {}{:+}i, got {}{:+}i\n", input, expected.real(),
+               expected.imag(), got.real(), got.imag());
+    ++failures;
+  }
+}
+
+// the column path has to agree with walking the prefix form row by row
+void check_complex_columns(std::string_view input) {
+  auto a = fcalc::tokenize(input);
+  fcalc::parse(a);
+  auto p = fcalc::compile(a);
+
+  constexpr size_t rows = 1000;
+  std::vector<std::array<std::vector<double>, 2>> data(p.variables.size());
+  std::vector<fcalc::ComplexColumnView> columns;
+  for (size_t v = 0; v != data.size(); ++v) {
+    for (size_t r = 0; r != rows; ++r) {
+      data[v][0].push_back(double(r) - 500.0 + v);
+      data[v][1].push_back(0.25 * r - 3.0 * v);
+    }
+    columns.push_back({data[v][0].data(), data[v][1].data()});
+  }
+  std::vector<double> re(rows), im(rows);
+  fcalc::evaluate_complex(p, columns, {re.data(), im.data()}, rows);
+
+  std::vector<fcalc::Binding<fcalc::Complex>> vars(p.variables.size());
+  for (size_t r = 0; r != rows; ++r) {
+    for (size_t v = 0; v != vars.size(); ++v)
+      vars[v] = {p.variables[v].view(), {data[v][0][r], data[v][1][r]}};
+    auto expected = fcalc::evaluate_complex(a, vars);
+    if (!near(re[r], expected.real()) || !near(im[r], expected.imag())) {
+      fmt::print("{} row {}: expected {}{:+}i, got {}{:+}i\n", input, r,
+                 expected.real(), expected.imag(), re[r], im[r]);
+      ++failures;
+      return;
+    }
+  }
+}
+
+// float rows against double ones, and the shadow report has to see the
+// same error the test does
+void check_float(std::string_view input, double tolerance) {
+  auto a = fcalc::tokenize(input);
+  fcalc::parse(a);
+  auto p = fcalc::compile(a);
+
+  constexpr size_t rows = 1000;
+  std::vector<std::vector<float>> data(p.variables.size());
+  std::vector<std::vector<double>> wide(p.variables.size());
+  std::vector<const float *> columns;
+  std::vector<const double *> wide_columns;
+  for (size_t v = 0; v != data.size(); ++v) {
+    for (size_t r = 0; r != rows; ++r) {
+      data[v].push_back(float(0.01 * r + 0.5 + v));
+      wide[v].push_back(data[v].back());
+    }
+    columns.push_back(data[v].data());
+    wide_columns.push_back(wide[v].data());
+  }
+  std::vector<double> want(rows);
+  fcalc::evaluate(p, wide_columns, want.data(), rows);
+
+  std::vector<float> got(rows);
+  auto error = fcalc::evaluate_float(p, columns, got.data(), rows, 1);
+  double worst = 0;
+  for (size_t r = 0; r != rows; ++r)
+    worst = std::max(worst, std::abs((got[r] - want[r]) / want[r]));
+  if (worst > tolerance || error.max_relative != worst ||
+      error.samples != rows) {
+    fmt::print("{} as float ({}): error {}, reported {} over {} rows\n", input,
+               format_as(fcalc::float_isa()), worst, error.max_relative,
+               error.samples);
+    ++failures;
+  }
+  // every kernel this cpu runs has to agree with the generic one bit for
+  // bit, fused multiply-adds would show up here
+  std::vector<float> generic(rows), other(rows);
+  fcalc::evaluate_float(p, columns, generic.data(), rows,
+                        fcalc::FloatIsa::generic);
+  for (auto isa : {fcalc::FloatIsa::avx2, fcalc::FloatIsa::avx512}) {
+    if (isa > fcalc::float_isa())
+      break;
+    fcalc::evaluate_float(p, columns, other.data(), rows, isa);
+    if (std::memcmp(generic.data(), other.data(), rows * sizeof(float))) {
+      fmt::print("{} as float: {} differs from generic\n", input,
+                 format_as(isa));
+      ++failures;
+    }
+  }
+  auto sampled = fcalc::evaluate_float(p, columns, got.data(), rows, 7);
+  if (sampled.samples != 143 || sampled.max_relative > worst ||
+      sampled.worst_row % 7 != 0) {
+    fmt::print("{} sampled every 7th row: {} samples, error {} at {}\n",
+               input, sampled.samples, sampled.max_relative,
+               sampled.worst_row);
+    ++failures;
+  }
+}
+
+// every formula of a set against its own Program, bit for bit, in both
+// layouts
+void check_formula_set() {
+  std::vector<std::string_view> inputs = {
+      "x * y - x / y + 3",
+      "2 ^ 3 + sin(π / 2)",
+      "y",
+      "√ z + max(x, 2) - abs(- y) / 2",
+      "v = - 2 x ^ 2 - 1",
+      "min(1, z) * log(x y) + cos(z) exp(y / 4)",
+      "x > y / 2 == 1 ? x - z : 1 < 2 ? y * z : 0",
+      "min(1 ? x * y : z, z * 2) - 1",
+  };
+  std::vector<fcalc::Words> words;
+  std::vector<std::span<const fcalc::Word>> spans;
+  for (auto input : inputs) {
+    words.push_back(fcalc::tokenize(input));
+    fcalc::parse(words.back());
+  }
+  for (auto &w : words)
+    spans.push_back(w);
+  auto set = fcalc::compile_set(spans);
+
+  constexpr size_t rows = 1000;
+  std::vector<std::vector<double>> data(set.variables.size());
+  std::vector<const double *> columns;
+  for (size_t v = 0; v != data.size(); ++v) {
+    for (size_t r = 0; r != rows; ++r)
+      data[v].push_back(0.01 * r + 0.5 + v);
+    columns.push_back(data[v].data());
+  }
+  size_t formulas = inputs.size();
+  std::vector<double> by_row(rows * formulas), by_column(rows * formulas);
+  fcalc::evaluate(set, columns, by_row.data(), rows, fcalc::Layout::row_major);
+  fcalc::evaluate(set, columns, by_column.data(), rows,
+                  fcalc::Layout::column_major);
+
+  for (size_t f = 0; f != formulas; ++f) {
+    auto p = fcalc::compile(words[f]);
+    std::vector<const double *> own;
+    for (auto &name : p.variables) {
+      auto it = std::ranges::find(set.variables, name);
+      own.push_back(columns[it - set.variables.begin()]);
+    }
+    std::vector<double> want(rows);
+    fcalc::evaluate(p, own, want.data(), rows);
+    for (size_t r = 0; r != rows; ++r) {
+      auto bits = std::bit_cast<uint64_t>(want[r]);
+      if (std::bit_cast<uint64_t>(by_row[r * formulas + f]) != bits ||
+          std::bit_cast<uint64_t>(by_column[f * rows + r]) != bits) {
+        fmt::print("{} row {} in a set: expected {}, got {} and {}\n",
+                   inputs[f], r, want[r], by_row[r * formulas + f],
+                   by_column[f * rows + r]);
+        ++failures;
+        break;
+      }
+    }
+  }
+}
+
+// gradient from one dual pass against the analytic one, then the column
+// version against the scalar one
+void check_gradient(std::string_view input, double x, double y,
+                    double expected, double dx, double dy) {
+  auto a = fcalc::tokenize(input);
+  fcalc::parse(a);
+  auto p = fcalc::compile(a);
+  uint32_t wrt[] = {*p.slot("x"), *p.slot("y")};
+  double vars[2];
+  vars[wrt[0]] = x;
+  vars[wrt[1]] = y;
+  double gradient[2];
+  auto value = fcalc::evaluate_gradient(p, vars, wrt, gradient);
+  if (!near(value, expected) || !near(gradient[0], dx) ||
+      !near(gradient[1], dy)) {
+    fmt::print("{}: expected {} ({}, {}), got {} ({}, {})\n", input,
+               expected, dx, dy, value, gradient[0], gradient[1]);
+    ++failures;
+  }
+
+  constexpr size_t rows = 600;
+  std::vector<double> xs, ys;
+  for (size_t r = 0; r != rows; ++r) {
+    xs.push_back(1.0 + 0.01 * r);
+    ys.push_back(3.0 - 0.002 * r);
+  }
+  const double *columns[2];
+  columns[wrt[0]] = xs.data();
+  columns[wrt[1]] = ys.data();
+  std::vector<double> values(rows), gx(rows), gy(rows);
+  double *gradients[] = {gx.data(), gy.data()};
+  fcalc::evaluate_gradient(p, columns, wrt, values.data(), gradients, rows);
+  for (size_t r = 0; r != rows; ++r) {
+    vars[wrt[0]] = xs[r];
+    vars[wrt[1]] = ys[r];
+    value = fcalc::evaluate_gradient(p, vars, wrt, gradient);
+    if (!near(values[r], value) || !near(gx[r], gradient[0]) ||
+        !near(gy[r], gradient[1])) {
+      fmt::print("{} row {}: columns disagree with the scalar gradient\n",
+                 input, r);
+      ++failures;
+      return;
+    }
+  }
+}
+
+// decimals compare exactly, through their printed form
+void check_decimal(std::string_view input, unsigned scale,
+                   std::string_view expected) {
+  auto a = fcalc::tokenize(input);
+  fcalc::parse(a);
+  std::string got;
+  try {
+    got = fcalc::format_decimal(fcalc::evaluate_decimal(a, scale), scale);
+  } catch (std::exception &e) {
+    got = e.what();
+  }
+  if (got != expected) {
+    fmt::print("{} at scale {}: expected {}, got {}\n", input, scale,
+               expected, got);
+    ++failures;
+  }
+}
+
+void check_decimal_columns(std::string_view input, unsigned scale) {
+  auto a = fcalc::tokenize(input);
+  fcalc::parse(a);
+  auto p = fcalc::compile(a);
+
+  constexpr size_t rows = 700;
+  std::vector<std::vector<fcalc::Decimal>> data(p.variables.size());
+  std::vector<const fcalc::Decimal *> columns;
+  for (size_t v = 0; v != data.size(); ++v) {
+    for (size_t r = 0; r != rows; ++r) {
+      auto text = fmt::format("{}.{:03}", int(r) - 350 + int(v), 7 * r % 1000);
+      data[v].push_back(fcalc::to_decimal(text, scale));
+    }
+    columns.push_back(data[v].data());
+  }
+  std::vector<fcalc::Decimal> out(rows);
+  fcalc::evaluate_decimal(p, columns, out.data(), rows, scale);
+
+  std::vector<fcalc::Binding<fcalc::Decimal>> vars(p.variables.size());
+  for (size_t r = 0; r != rows; ++r) {
+    for (size_t v = 0; v != vars.size(); ++v)
+      vars[v] = {p.variables[v].view(), data[v][r]};
+    auto expected = fcalc::evaluate_decimal(a, scale, vars);
+    if (out[r] != expected) {
+      fmt::print("{} row {}: expected {}, got {}\n", input, r,
+                 fcalc::format_decimal(expected, scale),
+                 fcalc::format_decimal(out[r], scale));
+      ++failures;
+      return;
+    }
+  }
+}
+
+// splitting across a pool folds in the same order as the plain walk, so the
+// results have to match to the bit
+void check_fork_join(unsigned workers) {
+  std::string input = "2";
+  const char *terms[] = {" + 3 x", " * 1.5", " - √ 2 x", " / 7 ^ 2",
+                         " + π i", " - 0.25 x x"};
+  for (size_t k = 0; input.size() < 100000; ++k)
+    input.append(terms[k % std::size(terms)]);
+  auto a = fcalc::tokenize(input);
+  fcalc::parse(a);
+  fcalc::Binding<fcalc::Complex> x[] = {{"x", {0.5, -1}}};
+  auto expected = fcalc::evaluate_complex(a, x);
+
+  fcalc::WorkPool pool(workers);
+  for (size_t cutoff : {size_t(8), size_t(300), fcalc::fork_cutoff}) {
+    auto got = fcalc::evaluate_complex(a, pool, x, cutoff);
+    if (got != expected) {
+      fmt::print("fork join with {} workers, cutoff {}: expected {}{:+}i, "
+                 "got {}{:+}i\n",
+                 workers, cutoff, expected.real(), expected.imag(),
+                 got.real(), got.imag());
+      ++failures;
+    }
+  }
+  // an unbound variable deep inside still comes out as the exception
+  try {
+    fcalc::evaluate_complex(a, pool, {}, 8);
+    fmt::print("fork join: expected an unbound variable\n");
+    ++failures;
+  } catch (std::runtime_error &) {
+  }
+}
+
+// fused reductions against evaluating the column and reducing it after,
+// and the column split over a pool against the one from a single thread
+void check_aggregates(std::string_view input) {
+  auto a = fcalc::tokenize(input);
+  fcalc::parse(a);
+  auto p = fcalc::compile(a);
+
+  constexpr size_t rows = 20000;
+  std::vector<std::vector<double>> data(p.variables.size());
+  std::vector<const double *> columns;
+  for (size_t v = 0; v != data.size(); ++v) {
+    for (size_t r = 0; r != rows; ++r)
+      data[v].push_back(std::sin(0.01 * r + v) * 10);
+    columns.push_back(data[v].data());
+  }
+  std::vector<double> out(rows);
+  fcalc::evaluate(p, columns, out.data(), rows);
+
+  fcalc::WorkPool pool(3);
+  // out + 1 is off its cache line, so the chunks don't start on blocks
+  std::vector<double> split(rows + 1);
+  fcalc::evaluate(p, columns, split.data() + 1, rows, pool, 512);
+  if (!std::ranges::equal(out, std::span(split).subspan(1))) {
+    fmt::print("{}: columns split over a pool differ\n", input);
+    ++failures;
+  }
+
+  double sum = 0;
+  for (auto v : out)
+    sum += v;
+  auto [min, max] = std::ranges::minmax(out);
+  constexpr double lo = -5, hi = 5;
+  constexpr size_t bins = 7;
+  fcalc::Histogram expected{lo, hi, std::vector<uint64_t>(bins)};
+  for (auto v : out) {
+    if (v < lo)
+      ++expected.below;
+    else if (v >= hi)
+      ++expected.above;
+    else
+      ++expected.counts[std::min(size_t((v - lo) * (bins / (hi - lo))),
+                                 bins - 1)];
+  }
+
+  for (auto &s : {fcalc::summarize(p, columns, rows),
+                  fcalc::summarize(p, columns, rows, pool)}) {
+    if (!near(s.sum, sum) || s.min != min || s.max != max ||
+        s.count != rows || !near(s.mean(), sum / rows)) {
+      fmt::print("{}: expected sum {} in [{}, {}], got {} in [{}, {}]\n",
+                 input, sum, min, max, s.sum, s.min, s.max);
+      ++failures;
+    }
+  }
+  for (auto &h : {fcalc::histogram(p, columns, rows, lo, hi, bins),
+                  fcalc::histogram(p, columns, rows, lo, hi, bins, pool)}) {
+    if (h.counts != expected.counts || h.below != expected.below ||
+        h.above != expected.above || h.nan != 0) {
+      fmt::print("{}: histogram differs\n", input);
+      ++failures;
+    }
+  }
+}
+
+// a formula has to give the same bits before and after it goes hot
+void check_tiered() {
+  fcalc::TieredEvaluator tiered(10);
+  auto f = tiered.load("x * y - sin(2 π / 8) x + √ 2 ^ 3 / y");
+  fcalc::Binding<double> vars[] = {{"y", 1.75}, {"x", -3.5}};
+  std::vector<double> cold;
+  for (int k = 0; k != 10; ++k)
+    cold.push_back(f(vars));
+  tiered.drain();
+  if (!f.compiled() || f.calls() != 10) {
+    fmt::print("tiered: not compiled after {} calls\n", f.calls());
+    ++failures;
+  }
+  if (f(vars) != cold.back()) {
+    fmt::print("tiered: walked {}, compiled {}\n", cold.back(), f(vars));
+    ++failures;
+  }
+  // errors come out the same on either side
+  for (auto input : {"2 i + 1", "x + q"}) {
+    auto g = tiered.load(input);
+    for (int k = 0; k != 12; ++k) {
+      try {
+        g(vars);
+        fmt::print("tiered: {} evaluated\n", input);
+        ++failures;
+        break;
+      } catch (std::runtime_error &) {
+      }
+      if (k == 10)
+        tiered.drain();
+    }
+  }
+}
+
+// programs read back from an image evaluate the same as the originals
+void check_image() {
+  std::vector<fcalc::Program> programs;
+  for (auto input : {"v = 1 + 2 * 3", "x / y - 0.5", "x ^ 2 + y ^ 2 + q"}) {
+    auto a = fcalc::tokenize(input);
+    fcalc::parse(a);
+    programs.push_back(fcalc::compile(a));
+  }
+  auto path = std::filesystem::temp_directory_path() / "fcalc_eval_test.img";
+  auto bytes = [&] {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), {});
+  };
+  fcalc::write_image(path, programs);
+  auto first = bytes();
+  fcalc::write_image(path, programs);
+  if (bytes() != first) {
+    fmt::print("image: the same programs wrote different bytes\n");
+    ++failures;
+  }
+  fcalc::Image image(path);
+
+  // each of these has to be caught before it runs, all but the last with
+  // the checksums made to match, and the last one by verify
+  auto bad_path = path;
+  bad_path.replace_extension("bad.img");
+  auto rejected = [&](std::string_view what, auto &&change, bool checksums) {
+    auto changed = first;
+    fcalc::image::Header h;
+    std::memcpy(&h, changed.data(), sizeof(h));
+    fcalc::image::Formula f;
+    std::memcpy(&f, changed.data() + h.formulas + sizeof(f), sizeof(f));
+    change(changed, f);
+    if (checksums) {
+      h.payload_checksum = fcalc::image::checksum(
+          std::span(changed).subspan(sizeof(h)));
+      h.header_checksum = fcalc::image::checksum(std::span(
+          reinterpret_cast<const char *>(&h),
+          offsetof(fcalc::image::Header, header_checksum)));
+      std::memcpy(changed.data(), &h, sizeof(h));
+    }
+    {
+      std::ofstream out(bad_path, std::ios::binary | std::ios::trunc);
+      out.write(changed.data(), changed.size());
+    }
+    try {
+      fcalc::Image bad(bad_path);
+      if (!bad.verify())
+        return;
+      bad.program(1);
+    } catch (std::runtime_error &) {
+      return;
+    }
+    fmt::print("image: {} wasn't caught\n", what);
+    ++failures;
+  };
+  // program 1 is x / y - 0.5: x, y, div, 0.5, sub
+  auto instr = [](std::string &bytes, const fcalc::image::Formula &f,
+                  size_t k) {
+    return bytes.data() + f.code + k * sizeof(fcalc::Instr);
+  };
+  auto set = [&](size_t k, auto field, auto value) {
+    return [=](std::string &bytes, const fcalc::image::Formula &f) {
+      fcalc::Instr ins;
+      std::memcpy(&ins, instr(bytes, f, k), sizeof(ins));
+      ins.*field = value;
+      std::memcpy(instr(bytes, f, k), &ins, sizeof(ins));
+    };
+  };
+  rejected("a variable out of range", set(1, &fcalc::Instr::arg, 2u), true);
+  rejected("a number out of range", set(3, &fcalc::Instr::arg, 1u), true);
+  rejected("an unknown op", set(2, &fcalc::Instr::op, uint8_t(40)), true);
+  rejected("an unknown instruction",
+           set(2, &fcalc::Instr::type, fcalc::WordType::Token), true);
+  rejected("an underflow",
+           set(2, &fcalc::Instr::type, fcalc::WordType::Ternary), true);
+  rejected(
+      "a max_depth that's too small",
+      [&](std::string &bytes, const fcalc::image::Formula &) {
+        auto h = reinterpret_cast<const fcalc::image::Header *>(bytes.data());
+        auto at = h->formulas + sizeof(fcalc::image::Formula) +
+                  offsetof(fcalc::image::Formula, max_depth);
+        uint32_t depth = 1;
+        std::memcpy(&bytes[at], &depth, sizeof(depth));
+      },
+      true);
+  rejected("a flipped payload byte", set(4, &fcalc::Instr::arg, 7u), false);
+  std::filesystem::remove(bad_path);
+
+  if (image.size() != programs.size() || !image.verify() ||
+      image.target(0) != "v" || image.target(1)) {
+    fmt::print("image: bad index\n");
+    ++failures;
+    return;
+  }
+  double xs[] = {1, 2, 3}, ys[] = {4, 5, 6}, qs[] = {7, 8, 9};
+  for (size_t i = 0; i != programs.size(); ++i) {
+    std::vector<const double *> columns;
+    for (auto id : image.variables(i)) {
+      auto name = image.symbol(id);
+      columns.push_back(name == "x" ? xs : name == "y" ? ys : qs);
+    }
+    double expected[3], got[3];
+    fcalc::evaluate(programs[i], columns, expected, 3);
+    fcalc::evaluate(image.program(i), columns, got, 3);
+    for (size_t r = 0; r != 3; ++r) {
+      if (expected[r] != got[r]) {
+        fmt::print("image: program {} row {}: expected {}, got {}\n", i, r,
+                   expected[r], got[r]);
+        ++failures;
+      }
+    }
+  }
+}
+
+// the staged file job against going over the lines one by one, with batches
+// and queues small enough that every stage has to wait on the others
+void check_pipeline() {
+  std::string input, expected;
+  for (int i = 0; i != 200; ++i) {
+    std::string line;
+    if (i % 17 == 3)
+      line = fmt::format("{} + * 2", i);
+    else if (i % 23 == 5)
+      line = "x - 1";
+    else if (i % 7 == 0)
+      line = fmt::format("v = {} / 4 > 10 ? √ {} : - {}", i, i, i);
+    else
+      line = fmt::format("{}.5 * sin({}) ^ 2", i, i);
+    input += line + (i % 11 == 0 ? "\n\n" : "\n");
+
+    auto a = fcalc::try_read(line);
+    if (!a) {
+      expected += fmt::format("{}: {}\n", line, a.error().message(line));
+      continue;
+    }
+    auto p = fcalc::compile(*a);
+    if (!p.variables.empty()) {
+      expected += fmt::format("{}: unbound variables\n", line);
+      continue;
+    }
+    double value;
+    fcalc::evaluate(p, {}, &value, 1);
+    expected += p.target ? fmt::format("{} = {}\n", p.target->view(), value)
+                         : fmt::format("{}\n", value);
+  }
+
+  std::istringstream in(input);
+  std::ostringstream out;
+  auto r = fcalc::run_pipeline(in, out, 3, 1);
+  if (out.str() != expected || r.lines != 200 || r.failed != 21) {
+    fmt::print("pipeline: {} lines and {} failed, output:\n{}\n", r.lines,
+               r.failed, out.str());
+    ++failures;
+  }
+  for (auto &s : r.stages) {
+    if (s.batches != 67) {
+      fmt::print("pipeline: {} stage ran {} batches\n", s.name, s.batches);
+      ++failures;
+    }
+  }
+
+  // a stream that throws on either end comes out of run_pipeline, after
+  // the stages it was stuck behind have let go
+  struct Sink : std::streambuf {
+  } sink;
+  struct Source : std::streambuf {
+    int_type underflow() override { throw std::runtime_error("source"); }
+  } source;
+  std::ostream broken_out(&sink);
+  broken_out.exceptions(std::ios::badbit);
+  std::istream broken_in(&source);
+  broken_in.exceptions(std::ios::badbit);
+  auto throws = [&](std::istream &from, std::ostream &to) {
+    try {
+      fcalc::run_pipeline(from, to, 3, 1);
+    } catch (std::exception &) {
+      return true;
+    }
+    return false;
+  };
+  in = std::istringstream(input);
+  if (!throws(in, broken_out) || !throws(broken_in, out)) {
+    fmt::print("pipeline: a failing stream should throw\n");
+    ++failures;
+  }
+}
+
+// everything a writer wrote, read back from a temporary file
+std::string written(fcalc::OutputFormat format,
+                    std::span<const std::string_view> names,
+                    std::span<const double *const> columns, size_t rows) {
+  auto f = std::tmpfile();
+  {
+    fcalc::ResultWriter w(f, format, names);
+    // in two writes, so text crosses a flush and arrow has two batches
+    w.write(columns, rows / 2);
+    std::vector<const double *> rest;
+    for (auto c : columns)
+      rest.push_back(c + rows / 2);
+    w.write(rest, rows - rows / 2);
+    w.finish();
+  }
+  std::string bytes(std::ftell(f), '\0');
+  std::rewind(f);
+  if (std::fread(bytes.data(), 1, bytes.size(), f) != bytes.size())
+    bytes.clear();
+  std::fclose(f);
+  return bytes;
+}
+
+// text has to read back to the same bits, binary has to be the columns
+// as they are, and arrow framed as a stream of the schema, a batch per
+// write and the end marker
+void check_output() {
+  size_t rows = 300000;
+  std::vector<double> x(rows), y(rows);
+  for (size_t i = 0; i != rows; ++i) {
+    x[i] = std::sin(double(i)) * std::pow(10.0, double(i % 40) - 20);
+    y[i] = i % 7 == 0 ? -0.0 : double(i) / 3;
+  }
+  std::string_view names[] = {"x", "y"};
+  const double *columns[] = {x.data(), y.data()};
+
+  auto text = written(fcalc::OutputFormat::text, names, columns, rows);
+  std::string_view rest = text;
+  bool same = true;
+  for (size_t i = 0; i != rows && same; ++i) {
+    for (auto c : columns) {
+      double v;
+      auto [end, ec] =
+          std::from_chars(rest.data(), rest.data() + rest.size(), v);
+      same = same && ec == std::errc{} &&
+             end != rest.data() + rest.size() &&
+             std::bit_cast<uint64_t>(v) == std::bit_cast<uint64_t>(c[i]);
+      rest.remove_prefix(std::min<size_t>(end - rest.data() + 1, rest.size()));
+    }
+  }
+  if (!same || !rest.empty()) {
+    fmt::print("output: text doesn't read back\n");
+    ++failures;
+  }
+
+  // x and y of the first write, then x and y of the second
+  auto binary = written(fcalc::OutputFormat::binary, names, columns, rows);
+  auto half = rows / 2 * sizeof(double);
+  auto rest_size = (rows - rows / 2) * sizeof(double);
+  auto second = binary.data() + 2 * half;
+  if (binary.size() != 2 * rows * sizeof(double) ||
+      std::memcmp(binary.data(), x.data(), half) != 0 ||
+      std::memcmp(binary.data() + half, y.data(), half) != 0 ||
+      std::memcmp(second, x.data() + rows / 2, rest_size) != 0 ||
+      std::memcmp(second + rest_size, y.data() + rows / 2, rest_size) != 0) {
+    fmt::print("output: binary columns differ\n");
+    ++failures;
+  }
+
+  auto arrow = written(fcalc::OutputFormat::arrow, names, columns, rows);
+  size_t at = 0, messages = 0;
+  for (;;) {
+    uint32_t prefix[2];
+    if (arrow.size() - at < sizeof(prefix))
+      break;
+    std::memcpy(prefix, arrow.data() + at, sizeof(prefix));
+    at += sizeof(prefix);
+    if (prefix[0] != 0xffffffff || prefix[1] % 8 != 0 || prefix[1] == 0)
+      break;
+    // after the schema, each message is followed by its rows of both columns
+    at += prefix[1];
+    if (messages++ != 0)
+      at += (messages == 2 ? rows / 2 : rows - rows / 2) * 2 * sizeof(double);
+  }
+  if (messages != 3 || at != arrow.size()) {
+    fmt::print("output: arrow stream framed wrong\n");
+    ++failures;
+  }
+}
+
+// rows read a few at a time so they end mid block, with the odd lines a
+// file picks up along the way, and the errors with their line numbers
+void check_csv() {
+  auto path = std::filesystem::temp_directory_path() / "fcalc_eval_test.csv";
+  auto csv = [&](std::string_view text) {
+    auto f = std::fopen(path.c_str(), "wb");
+    std::fwrite(text.data(), 1, text.size(), f);
+    std::fclose(f);
+    return fcalc::CsvReader(path);
+  };
+
+  std::string text = "label, y ,\"x\"\r\n";
+  std::vector<double> xs, ys;
+  for (int i = 0; i != 500; ++i) {
+    xs.push_back(i * 0.37 - 50);
+    ys.push_back(i % 13 == 0 ? std::nan("") : 1e10 / (i + 1));
+    auto y = i % 13 == 0 ? std::string() : fmt::format("{}", ys.back());
+    text += fmt::format("row {},{},{}{}", i, y, i % 3 == 0 ? "+" : "",
+                        xs.back());
+    text += i % 7 == 0 ? "\r\n" : i % 50 == 0 ? "\n\n" : "\n";
+  }
+  text.pop_back();
+  auto a = fcalc::tokenize("x * y");
+  fcalc::parse(a);
+  auto p = fcalc::compile(a);
+  auto reader = csv(text);
+  reader.bind(p.variables);
+  std::vector<double> x(7), y(7);
+  double *out[] = {x.data(), y.data()};
+  size_t row = 0;
+  bool same = reader.header().size() == 3 && reader.header()[1] == "y" &&
+              reader.header()[2] == "x";
+  while (auto rows = reader.read(out, 7)) {
+    for (size_t r = 0; r != rows; ++r, ++row) {
+      same = same && row < xs.size() && x[r] == xs[row] &&
+             std::bit_cast<uint64_t>(y[r]) == std::bit_cast<uint64_t>(ys[row]);
+    }
+  }
+  if (!same || row != xs.size()) {
+    fmt::print("csv: {} rows read back wrong\n", row);
+    ++failures;
+  }
+
+  // an empty last field reads as nan with or without the newline after it
+  for (std::string_view last : {"3,", "3,\n"}) {
+    auto reader = csv(fmt::format("x,y\n1,2\n{}", last));
+    reader.bind(p.variables);
+    auto rows = reader.read(out, 7);
+    if (rows != 2 || x[1] != 3 || !std::isnan(y[1]) ||
+        reader.read(out, 7) != 0) {
+      fmt::print("csv: {:?} as the last line read {} rows\n", last, rows);
+      ++failures;
+    }
+  }
+
+  auto throws = [&](std::string_view text, std::string_view variable,
+                    std::string_view expected) {
+    std::string got = "nothing";
+    try {
+      auto reader = csv(text);
+      fcalc::SmolString v[] = {variable};
+      reader.bind(v);
+      double value;
+      double *out[] = {&value};
+      while (reader.read(out, 1) != 0) {
+      }
+    } catch (std::runtime_error &e) {
+      got = e.what();
+    }
+    if (got != expected) {
+      fmt::print("csv: expected {}, got {}\n", expected, got);
+      ++failures;
+    }
+  };
+  throws("a,b\n1,2\n3,x4\n", "b", "Line 3: x4 is not a number");
+  throws("a,b\n1,2\n\n3\n", "a", "Line 4 has 1 fields, the header has 2");
+  throws("a,b\n1,2,3\n", "a", "Line 2 has more than 2 fields");
+  throws("a,b\n1,2\n", "c", "No column for variable c");
+  std::filesystem::remove(path);
+}
+
+// the strength reduced program against the plain one over columns and
+// through a gradient, and what it says it rewrote
+void check_reduced(std::string_view input, fcalc::Rewrites expected) {
+  auto a = fcalc::tokenize(input);
+  fcalc::parse(a);
+  auto plain = fcalc::compile(a);
+  fcalc::Rewrites applied;
+  auto reduced = fcalc::compile(a, applied);
+  if (applied != expected) {
+    fmt::print("{}: rewrote {} powers, {} reciprocals and {} polynomials, "
+               "expected {}, {} and {}\n",
+               input, applied.powers, applied.reciprocals,
+               applied.polynomials, expected.powers, expected.reciprocals,
+               expected.polynomials);
+    ++failures;
+  }
+
+  constexpr size_t rows = 600;
+  std::vector<double> xs, ys;
+  for (size_t r = 0; r != rows; ++r) {
+    xs.push_back(-3.0 + 0.01 * r);
+    ys.push_back(0.5 + 0.002 * r);
+  }
+  std::vector<const double *> columns;
+  std::vector<double> vars;
+  for (auto &v : plain.variables) {
+    columns.push_back(v.view() == "x" ? xs.data() : ys.data());
+    vars.push_back(v.view() == "x" ? 1.3 : 0.7);
+  }
+  std::vector<double> want(rows), got(rows);
+  fcalc::evaluate(plain, columns, want.data(), rows);
+  fcalc::evaluate(reduced, columns, got.data(), rows);
+  for (size_t r = 0; r != rows; ++r) {
+    if (!near(got[r], want[r])) {
+      fmt::print("{} row {}: expected {}, got {} strength reduced\n", input,
+                 r, want[r], got[r]);
+      ++failures;
+      return;
+    }
+  }
+
+  uint32_t wrt[] = {*plain.slot("x")};
+  double dx[1], reduced_dx[1];
+  auto value = fcalc::evaluate_gradient(plain, vars, wrt, dx);
+  auto reduced_value = fcalc::evaluate_gradient(reduced, vars, wrt, reduced_dx);
+  if (!near(reduced_value, value) || !near(reduced_dx[0], dx[0])) {
+    fmt::print("{}: expected {} ({}), got {} ({}) strength reduced\n", input,
+               value, dx[0], reduced_value, reduced_dx[0]);
+    ++failures;
+  }
+}
+} // namespace
+
+int main() {
+  check_real("2 sin(π / 6)", 1);
+  check_real("log(e ^ 3) - cos(0)", 2);
+  check_real("exp(2) ^ 2", std::exp(4.0));
+  check_real("2 ^ abs(- 3) ^ 2", 512);
+  check_real("max(min(1, 2), abs(- 5) - 1) * 2", 8);
+  check_real("- min(3, 4 - 2) max(1, - 1)", -2);
+  check_real("v = exp(0) + 1", 2);
+  check_real("1 + 1 == 2", 1);
+  check_real("2 ^ 3 < 3 ^ 2 == 3 > 4", 0);
+  check_real("2 > 3 ? 1 : 0 < 1 ? 2 + 3 : 4", 5);
+  check_real("0 ? 1 : 2 ? 3 ? 4 : 5 : 6", 4);
+  check_real("v = 0 / 0 ? min(1 > 0 ? 2 : 3, 4) : 5", 2);
+  check_vmath();
+  check_tiered();
+  check_pipeline();
+  check_output();
+  check_csv();
+  check_reduced("x ^ 2 + y ^ 3", {2, 0, 0});
+  check_reduced("3 x ^ 3 - 2 x ^ 2 + x / 4 - 7", {0, 1, 1});
+  check_reduced("a x ^ 3 + b x ^ 2 + c x + d", {0, 0, 1});
+  check_reduced("x ^ 12 - x ^ 4 + x ^ 2 / 2", {0, 1, 1});
+  check_reduced("- x ^ 3 + y x - x y", {0, 0, 1});
+  check_reduced("x ^ 5 / 8 - y / 3", {1, 1, 0});
+  check_reduced("x ^ 0 + x ^ 1 + abs(x + y) ^ 4 + abs(x) ^ 3", {3, 0, 0});
+
+  check_complex("3 * 2 + 1", 7);
+  check_complex("3 - 2 - 1", 0);
+  check_complex("8 / 2 / 2", 2);
+  check_complex("2 ^ 3 ^ 2", 512);
+  check_complex("0.5 + 0.05", 0.55);
+  check_complex("i i", -1);
+  check_complex("√ - 4", {0, 2});
+  check_complex("e ^ i π", -1);
+  check_complex("v = 2 π", 2 * std::numbers::pi);
+  check_complex("exp(i π)", -1);
+  check_complex("abs(3 + 4 i)", 5);
+  check_complex("log(- 1)", {0, std::numbers::pi});
+  check_complex("max(2, 3) + sin(0)", 3);
+  check_complex("i i == - 1 ? 2 i : 3", {0, 2});
+  check_complex("abs(3 + 4 i) > 4 ? 1 : 2", 1);
+
+  check_complex_columns("x * y - x / y + 3");
+  check_complex_columns("- x ^ 2 + √ y i");
+  check_complex_columns("sin(x) - log(y) + abs(x) cos(y / 100)");
+  check_complex_columns("x == y - 1 ? x : y * i");
+  // a single slot, a one argument call has nothing past it
+  check_complex_columns("exp(x)");
+
+  check_gradient("y x ^ 2 + x / y - √ x", 3, 2,
+                 18 + 1.5 - std::sqrt(3.0), 12 + 0.5 - 0.5 / std::sqrt(3.0),
+                 9 - 0.75);
+  check_gradient("x ^ y - - x y", 2, 3, 8 + 6, 12 + 3,
+                 8 * std::numbers::ln2 + 2);
+  check_gradient("sin(x) exp(y) + log(x y)", 2, 0.5,
+                 std::sin(2.0) * std::exp(0.5),
+                 std::cos(2.0) * std::exp(0.5) + 0.5,
+                 std::sin(2.0) * std::exp(0.5) + 2);
+  check_gradient("x < y ? x y : x ^ 2 + y", 3, 2, 11, 6, 1);
+  check_gradient("max(x, y) - min(x ^ 2, 1) + abs(- x) - cos(y)", 3, 2,
+                 3 - 1 + 3 - std::cos(2.0), 1 + 1, std::sin(2.0));
+
+  check_image();
+  check_fork_join(0);
+  check_fork_join(3);
+
+  check_aggregates("x * y - x / 3 + 1");
+  check_aggregates("x ^ 2 - √ 4 y");
+  check_aggregates("min(x, y) + sin(x) ^ 2 - log(abs(y) + 1)");
+
+  check_float("x * y - x / y + 3", 1e-6);
+  check_float("√ x + max(x, y) - abs(- y) / 2", 1e-6);
+  check_float("sin(x) exp(y / 4) + log(x y) ^ 2", 1e-5);
+  check_float("x > y / 2 ? x * y : y - x", 1e-6);
+  check_float("x * y + x * 3 - y * y + 0.1 * x", 1e-5);
+  check_formula_set();
+
+  check_decimal("0.1 + 0.2 - 0.3", 18, "0.000000000000000000");
+  check_decimal("1 / 3", 4, "0.3333");
+  check_decimal("2 / 3", 4, "0.6667");
+  check_decimal("0.125 * 1", 2, "0.12");
+  check_decimal("0.375 * 1", 2, "0.38");
+  check_decimal("- 7 / 2", 0, "-4");
+  check_decimal("2 ^ 100", 0, "1267650600228229401496703205376");
+  check_decimal("2 ^ - 2", 3, "0.250");
+  check_decimal("0.3 ^ - 8", 4, "15241.5790");
+  check_decimal("0.07 ^ - 3", 4, "2915.4519");
+  check_decimal("- 0.5 ^ - 3", 2, "-8.00");
+  check_decimal("0.5 ^ - 100", 2, "1267650600228229401496703205376.00");
+  check_decimal("0.5 ^ - 200", 2, "Decimal overflow");
+  check_decimal("0 ^ - 1", 2, "Decimal division by zero");
+  check_decimal("√ 2", 18, "1.414213562373095049");
+  check_decimal("√ 123456789", 6, "11111.111061");
+  check_decimal("π", 18, "3.141592653589793238");
+  check_decimal("123456789.5 * 987654321.25", 18,
+                "121932631637326626.875000000000000000");
+  check_decimal("1 / 7 * 7", 6, "0.999999");
+  check_decimal("2 ^ 0.5", 2, "Decimal exponents have to be whole numbers");
+  check_decimal("10 ^ 30", 12, "Decimal overflow");
+  check_decimal("1 / 0", 2, "Decimal division by zero");
+  check_decimal("max(0.1, 0.2) - min(- 1, abs(- 3))", 2, "1.20");
+  check_decimal("sin(1)", 2, "sin has no decimal implementation");
+  check_decimal("0.1 + 0.2 == 0.3 ? 1 : 2", 2, "1.00");
+  check_decimal("0 == 0 ? 0 : 1 / 0", 2, "0.00");
+
+  check_decimal_columns("x * y - x / y + 3", 6);
+  check_decimal_columns("x * x * x * x * x / y ^ 2 - √ 2 * x", 18);
+  check_decimal_columns("max(x, y) * abs(x - y) - min(x, 0)", 6);
+  check_decimal_columns("x > 1 ? x - y : y < 0 ? 2 : x / 3", 6);
+
+  return failures != 0;
+}
@@ -1,6 +1,24 @@
 #include "fast_calc/fcalc.hpp"
 #include <fmt/ranges.h>
 
+namespace {
+int failures = 0;
+
+void check_error(std::string_view input, fcalc::ParseError::Code code,
+                 uint32_t offset) {
+  auto got = fcalc::try_read(input);
+  if (got) {
+    fmt::print("{}: expected {} at {}, parsed fine\n", input,
+               format_as(code), offset);
+    ++failures;
+  } else if (got.error().code != code || got.error().offset != offset) {
+    fmt::print("{}: expected {} at {}, got {}\n", input, format_as(code),
+               offset, got.error().message(input));
+    ++failures;
+  }
+}
+} // namespace
+
 int main() {
   std::string input = "v = 3 * 2 + 1 - aπb ^ 2 / i";
   // = v + * 3 2 - 1 aπ / ^ b 2 i
@@ -9,4 +27,86 @@ int main() {
   fcalc::parse(a);
   fmt::print("out: {}\n", fmt::join(a, " "));
   fmt::print("offset: {}\n", a.front().bin.second_arg);
-}
\ No newline at end of file
+
+  // the checked path has to come out the same on good input
+  auto b = fcalc::try_read(input);
+  if (!b || *b != a) {
+    fmt::print("try_read disagrees with tokenize + parse\n");
+    ++failures;
+  }
+
+  // calls move as a whole and their arguments are parsed in place
+  auto calls = fcalc::tokenize("2 ^ min(x - 1, - 2) ^ 2 * sin(y)");
+  fcalc::parse(calls);
+  auto prefix = fmt::format("{}", fmt::join(calls, " "));
+  if (prefix != "* ^ 2 ^ min - (x) 1 , - 2 ) 2 sin (y) )") {
+    fmt::print("calls parsed as {}\n", prefix);
+    ++failures;
+  }
+
+  // ? moves in front of its condition and nests to the right
+  auto conditional = fcalc::tokenize("v = x < 1 ? 2 : y ? 3 + 1 : 4");
+  fcalc::parse(conditional);
+  prefix = fmt::format("{}", fmt::join(conditional, " "));
+  if (prefix != "= (v) ? < (x) 1 2 : ? (y) + 3 1 : 4") {
+    fmt::print("conditional parsed as {}\n", prefix);
+    ++failures;
+  }
+
+  using enum fcalc::ParseError::Code;
+  check_error("", empty, 0);
+  check_error("1 + 99999999999999999999", bad_number, 4);
+  check_error("2 * (3 + 1)", unexpected_token, 4);
+  check_error("1 + * 2", missing_operand, 4);
+  check_error("* 2", missing_operand, 0);
+  check_error("3 ^", missing_operand, 2);
+  check_error("2 + √", missing_operand, 4);
+  check_error("x y = 2", misplaced_assign, 4);
+  check_error("x = y = 2", misplaced_assign, 6);
+  check_error("sin(x", unclosed_call, 0);
+  check_error("x)", unexpected_token, 1);
+  check_error("min(1)", bad_arity, 5);
+  check_error("sin(1, 2)", bad_arity, 5);
+  check_error("max(1, 2, 3)", bad_arity, 8);
+  check_error("sin()", missing_operand, 0);
+  check_error("min(1, )", missing_operand, 5);
+  check_error("cos(2 +)", missing_operand, 6);
+  check_error("x ? 1", unmatched_conditional, 2);
+  check_error("x ? 1 : 2 : 3", unmatched_conditional, 10);
+  check_error("min(x ? 1, 2)", unmatched_conditional, 6);
+  check_error("x ? : 2", missing_operand, 2);
+  check_error("2 * -", missing_operand, 4);
+
+  // try_parse has the byte offsets from the words it's given
+  auto words = fcalc::try_tokenize("1 + * 2");
+  auto parsed = fcalc::try_parse(*words);
+  if (parsed || parsed.error().offset != 4) {
+    fmt::print("try_parse should put 1 + * 2 at byte 4\n");
+    ++failures;
+  }
+
+  // the words and a name too long for SmolString's buffer are counted, and
+  // everything is given back once they're gone. the words from above are
+  // still live, reset keeps them
+  fcalc::reset_alloc_stats();
+  auto before = fcalc::alloc_stats().live;
+  {
+    auto words = fcalc::tokenize("1 + 2 * x");
+    fcalc::SmolString name("longer_than_nine");
+    auto stats = fcalc::alloc_stats();
+    auto live =
+        before + int64_t(words.capacity() * sizeof(fcalc::Word) + name.size());
+    if (stats.allocations != 2 || stats.live != live || stats.peak != live) {
+      fmt::print("tokenize counted {} allocations, {} live, {} peak\n",
+                 stats.allocations, stats.live, stats.peak);
+      ++failures;
+    }
+  }
+  auto stats = fcalc::alloc_stats();
+  if (stats.live != before || stats.frees != stats.allocations) {
+    fmt::print("{} bytes left after freeing the words\n", stats.live - before);
+    ++failures;
+  }
+
+  return failures != 0;
+}
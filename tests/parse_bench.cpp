@@ -1,200 +1,113 @@
 #include <algorithm>
 #include <benchmark/benchmark.h>
+#include <chrono>
 #include <cstdint>
+#include <exception>
+#include <fast_calc/alloc.hpp>
+#include <fast_calc/complex_eval.hpp>
 #include <fast_calc/fcalc.hpp>
+#include <fast_calc/trace.hpp>
 #include <fmt/core.h>
-#include <gperftools/malloc_hook.h>
 #include <random>
+#include <string>
 #include <test/calc.hpp>
+#include <test/gen.hpp>
+#include <test/perf.hpp>
 #include <type_traits>
 #include <vector>
 
-benchmark::IterationCount g_num_new = 0;
-benchmark::IterationCount g_sum_size_new = 0;
-auto new_hook = [](const void *, size_t s) {
-  benchmark::IterationCount size = s;
-  ++g_num_new;
-  g_sum_size_new += size;
-};
-
+// allocations are fcalc's own counters, calc doesn't go through them so its
+// benchmarks only report time
 #define BEFORE_TEST()                                                          \
-  benchmark::IterationCount num_new = g_num_new;                               \
-  benchmark::IterationCount sum_size_new = g_sum_size_new;                     \
-  MallocHook::AddNewHook(new_hook)
+  PerfCounters perf;                                                           \
+  fcalc::reset_alloc_stats();                                                  \
+  perf.start()
 
 #define AFTER_TEST()                                                           \
-  MallocHook::RemoveNewHook(new_hook);                                         \
+  perf.stop();                                                                 \
+  auto allocs = fcalc::alloc_stats();                                          \
   auto iter = double(state.iterations());                                      \
-  state.counters["allocs"] = (g_num_new - num_new) / iter;                     \
-  state.counters["avg alloc"] =                                                \
-      (g_sum_size_new - sum_size_new) / double(g_num_new - num_new);
+  state.counters["allocs"] = allocs.allocations / iter;                        \
+  state.counters["avg alloc"] = allocs.bytes / double(allocs.allocations);     \
+  state.counters["peak"] = allocs.peak
 
 namespace {
-const char *ops[] = {"-", "+", "*", "/", "^"};
-const char *rand_op(auto &r) {
-  std::uniform_int_distribution<uint32_t> rand(0, 4);
-  return ops[rand(r)];
-}
-const char *constants[] = {"pi", "tau", "i"};
-const char *rand_con(auto &r) {
-  std::uniform_int_distribution<uint32_t> rand(0, 2);
-  return constants[rand(r)];
-}
-void rand_term(std::string &expression, auto &r, uint32_t term_max) {
-  std::uniform_int_distribution<uint32_t> rand(1, term_max);
-  uint32_t term_length = rand(r);
-  std::uniform_int_distribution<uint32_t> rbool(0, 1);
-  for (uint32_t i = 0; i != term_length; ++i) {
-    if (rbool(r)) {
-      expression.append(rand_con(r));
-    } else {
-      std::uniform_int_distribution<uint32_t> i(1, 50);
-      expression.append(std::to_string(i(r)));
-    }
-  }
-}
-
-std::string gen_expression(uint32_t terms, uint32_t term_max) {
-  std::random_device r;
-  std::default_random_engine e(r());
-  std::string expression;
-  expression.reserve(3 * term_max / 2 * terms);
-  for (uint32_t i = 0; i != terms - 1; i++) {
-    rand_term(expression, e, term_max);
-    expression.append(rand_op(e));
-  }
-  rand_term(expression, e, term_max);
-  return expression;
-}
-
-template <typename T> using int_dist = std::uniform_int_distribution<T>;
 namespace c_gen {
 
-calc::WordPtr ran_op(auto &r) {
+calc::WordPtr ran_op(auto &r, calc::Pool &pool) {
   int_dist<uint32_t> t(1, 4);
-  return calc::WordPtr(new calc::Binary([&]() {
+  return pool.make<calc::Binary>([&]() {
     switch (t(r)) {
       using enum calc::Binary::Ops;
     case 0:
-      return calc::Binary(assign);
+      return assign;
     case 1:
-      return calc::Binary(add);
+      return add;
     case 2:
-      return calc::Binary(sub);
+      return sub;
     case 3:
-      return calc::Binary(mul);
+      return mul;
     case 4:
-      return calc::Binary(div);
+      return div;
     case 5:
-      return calc::Binary(exp);
+      return exp;
     default:
-      return calc::Binary(add);
+      return add;
     }
-  }()));
+  }());
 }
 
-auto ran_val(auto &r) {
-  auto ptr = [](auto &&a) {
-    using T = std::remove_cvref_t<decltype(a)>;
-    return calc::WordPtr(new T(std::move(a)));
-  };
+calc::WordPtr ran_val(auto &r, calc::Pool &pool) {
   int_dist<uint32_t> rbool(0, 1);
   if (rbool(r)) {
     int_dist<uint32_t> i(1, 100);
     if (rbool(r)) {
-      return ptr(calc::Number(i(r)));
+      return pool.make<calc::Number>(int32_t(i(r)));
     } else {
-      return ptr(calc::Number(i(r), i(r)));
+      return pool.make<calc::Number>(uint64_t(i(r)), int64_t(i(r)));
     }
   } else {
     int_dist<uint32_t> t(1, 4);
     switch (t(r)) {
       using enum calc::Constant::Types;
     case 1:
-      return ptr(calc::Constant(pi));
+      return pool.make<calc::Constant>(pi);
     case 2:
-      return ptr(calc::Constant(e));
+      return pool.make<calc::Constant>(e);
     case 3:
-      return ptr(calc::Constant(tau));
+      return pool.make<calc::Constant>(tau);
     case 4:
-      return ptr(calc::Constant(i));
+      return pool.make<calc::Constant>(i);
     default:
-      return ptr(calc::Constant(pi));
+      return pool.make<calc::Constant>(pi);
     }
   }
 }
-auto gen_exp(uint32_t terms, uint32_t term_size) {
+auto gen_exp(calc::Pool &pool, uint32_t terms, uint32_t term_size) {
   std::vector<calc::WordPtr> w;
   w.reserve(terms * term_size);
   std::random_device _r;
   std::default_random_engine e(_r());
   auto gen_term = [&]() {
     for (uint32_t i = 0; i != term_size; ++i) {
-      w.push_back(ran_val(e));
+      w.push_back(ran_val(e, pool));
     }
   };
   for (uint32_t i = 0; i != terms - 1; ++i) {
     gen_term();
-    w.push_back(ran_op(e));
+    w.push_back(ran_op(e, pool));
   }
   gen_term();
   return w;
 }
 } // namespace c_gen
 
-namespace f_gen {
-
-fcalc::Word ran_op(auto &r) {
-  int_dist<uint32_t> t(1, 5);
-  using enum fcalc::Binary::Ops;
-  return fcalc::Binary(fcalc::Binary::Ops(t(r)));
-}
-
-fcalc::Word ran_val(auto &r) {
-  int_dist<uint32_t> rbool(0, 1);
-  if (rbool(r)) {
-    int_dist<uint32_t> i(1, 100);
-    return fcalc::Number(i(r));
-  } else {
-    int_dist<uint32_t> t(1, 4);
-    switch (t(r)) {
-      using enum fcalc::Constant::Types;
-    case 1:
-      return fcalc::Constant(pi);
-    case 2:
-      return fcalc::Constant(e);
-    case 3:
-      return fcalc::Constant(tau);
-    case 4:
-      return fcalc::Constant(i);
-    default:
-      return fcalc::Constant(pi);
-    }
-  }
-}
-auto gen_exp(uint32_t terms, uint32_t term_size) {
-  std::vector<fcalc::Word> w;
-  w.reserve(terms * term_size);
-  std::random_device _r;
-  std::default_random_engine r(_r());
-  auto gen_term = [&]() {
-    for (uint32_t i = 0; i != term_size; ++i) {
-      w.push_back(ran_val(r));
-    }
-  };
-  for (uint32_t i = 0; i != terms - 1; ++i) {
-    gen_term();
-    w.push_back(ran_op(r));
-  }
-  gen_term();
-  return w;
-}
-} // namespace f_gen
 } // namespace
 
 void fcalc_bench(benchmark::State &state) {
-  BEFORE_TEST();
   std::string expression = gen_expression(state.range(0), state.range(1));
+  auto tokens = fcalc::tokenize(expression).size();
+  BEFORE_TEST();
   for (auto _ : state) {
     auto n = fcalc::tokenize(expression);
     fcalc::parse(n);
@@ -204,25 +117,31 @@ void fcalc_bench(benchmark::State &state) {
   state.SetComplexityN(expression.size());
   state.counters["data size"] = expression.size();
   state.counters["efficiency"] =
-      (g_sum_size_new - sum_size_new) / double(expression.size());
+      double(fcalc::alloc_stats().bytes) / double(expression.size());
   AFTER_TEST();
+  perf.report(state, expression.size(), tokens);
 }
 BENCHMARK(fcalc_bench)->Ranges({{8 << 5, 8 << 10}, {2, 8}})->Complexity();
 
 void ccalc_bench(benchmark::State &state) {
-  BEFORE_TEST();
   std::string expression = gen_expression(state.range(0), state.range(1));
+  auto tokens = fcalc::tokenize(expression).size();
+  // the pool keeps its memory between iterations, so after the first one
+  // this measures the parser rather than the allocator
+  calc::Pool pool;
+  PerfCounters perf;
+  perf.start();
   for (auto _ : state) {
-    auto n = calc::tokenize(expression);
+    pool.reset();
+    auto n = calc::tokenize(expression, pool);
     auto r = calc::parse(std::move(n));
     benchmark::DoNotOptimize(r);
     benchmark::ClobberMemory();
   }
   state.SetComplexityN(expression.size());
   state.counters["data size"] = expression.size();
-  state.counters["efficiency"] =
-      (g_sum_size_new - sum_size_new) / double(expression.size());
-  AFTER_TEST();
+  perf.stop();
+  perf.report(state, expression.size(), tokens);
 }
 BENCHMARK(ccalc_bench)->Ranges({{8 << 5, 8 << 10}, {2, 8}})->Complexity();
 
@@ -238,28 +157,168 @@ void fcalc_parse(benchmark::State &state) {
   state.SetComplexityN(state.range(0) * state.range(1));
   state.counters["data num"] = state.range(0) * state.range(1) * 2;
   state.counters["byte/word"] =
-      (g_sum_size_new - sum_size_new) / state.counters["data num"];
+      double(fcalc::alloc_stats().bytes) / state.counters["data num"];
   AFTER_TEST();
+  perf.report(state, 0, state.range(0) * state.range(1));
 }
 BENCHMARK(fcalc_parse)->Ranges({{8 << 5, 8 << 7}, {2, 8}})->Complexity();
 
 void ccalc_parse(benchmark::State &state) {
-  BEFORE_TEST();
+  calc::Pool pool;
+  PerfCounters perf;
+  perf.start();
   for (auto _ : state) {
     state.PauseTiming();
-    auto expression = c_gen::gen_exp(state.range(0), state.range(1));
+    pool.reset();
+    auto expression = c_gen::gen_exp(pool, state.range(0), state.range(1));
     state.ResumeTiming();
     auto r = calc::parse(std::move(expression));
     benchmark::DoNotOptimize(r);
   }
   state.SetComplexityN(state.range(0) * state.range(1));
   state.counters["data num"] = state.range(0) * state.range(1) * 2;
-  state.counters["byte/word"] =
-      (g_sum_size_new - sum_size_new) / state.counters["data num"];
-  AFTER_TEST();
+  perf.stop();
+  perf.report(state, 0, state.range(0) * state.range(1));
 }
 BENCHMARK(ccalc_parse)
     ->Ranges({{8 << 5, 8 << 7}, {2, 8}})
     ->Complexity(benchmark::oNLogN);
 
+// the pipeline one phase at a time on the same inputs, so a regression
+// shows up in the phase that caused it
+void tokenize_phase(benchmark::State &state) {
+  std::string expression = gen_expression(state.range(0), state.range(1));
+  auto tokens = fcalc::tokenize(expression).size();
+  BEFORE_TEST();
+  for (auto _ : state) {
+    auto n = fcalc::tokenize(expression);
+    benchmark::DoNotOptimize(n);
+  }
+  AFTER_TEST();
+  perf.report(state, expression.size(), tokens);
+}
+BENCHMARK(tokenize_phase)->Ranges({{8 << 5, 8 << 10}, {2, 8}});
+
+// parse works in place, so every iteration starts from a fresh copy of the
+// tokens. the copy is part of the measurement but allocates nothing
+void parse_phase(benchmark::State &state) {
+  std::string expression = gen_expression(state.range(0), state.range(1));
+  auto tokens = fcalc::tokenize(expression);
+  auto work = tokens;
+  BEFORE_TEST();
+  for (auto _ : state) {
+    std::ranges::copy(tokens, work.begin());
+    fcalc::parse(work);
+    benchmark::DoNotOptimize(work);
+  }
+  AFTER_TEST();
+  perf.report(state, expression.size(), tokens.size());
+}
+BENCHMARK(parse_phase)->Ranges({{8 << 5, 8 << 10}, {2, 8}});
+
+void evaluate_phase(benchmark::State &state) {
+  std::string expression = gen_expression(state.range(0), state.range(1));
+  auto tokens = fcalc::tokenize(expression);
+  fcalc::parse(tokens);
+  BEFORE_TEST();
+  for (auto _ : state) {
+    auto v = fcalc::evaluate_complex(tokens);
+    benchmark::DoNotOptimize(v);
+  }
+  AFTER_TEST();
+  perf.report(state, expression.size(), tokens.size());
+}
+BENCHMARK(evaluate_phase)->Ranges({{8 << 5, 8 << 10}, {2, 8}});
+
+namespace {
+// small expressions, range(0) percent of them broken in a way tokenize
+// catches. half get a number that doesn't fit, half a parenthesis
+std::vector<std::string> mixed_inputs(uint32_t bad_percent) {
+  std::random_device r;
+  std::default_random_engine e(r());
+  int_dist<uint32_t> percent(0, 99);
+  std::vector<std::string> inputs;
+  for (int i = 0; i != 256; ++i) {
+    auto input = gen_expression(16, 4);
+    if (percent(e) < bad_percent)
+      input.append(i % 2 ? "+99999999999999999999" : "*(");
+    inputs.push_back(std::move(input));
+  }
+  return inputs;
+}
+} // namespace
+
+void mixed_throwing(benchmark::State &state) {
+  auto inputs = mixed_inputs(state.range(0));
+  for (auto _ : state) {
+    size_t bad = 0;
+    for (auto &input : inputs) {
+      try {
+        auto n = fcalc::tokenize(input);
+        fcalc::parse(n);
+        benchmark::DoNotOptimize(n);
+      } catch (std::exception &) {
+        ++bad;
+      }
+    }
+    benchmark::DoNotOptimize(bad);
+  }
+  state.SetItemsProcessed(state.iterations() * inputs.size());
+}
+BENCHMARK(mixed_throwing)->Arg(0)->Arg(5)->Arg(50);
+
+void mixed_expected(benchmark::State &state) {
+  auto inputs = mixed_inputs(state.range(0));
+  for (auto _ : state) {
+    size_t bad = 0;
+    for (auto &input : inputs) {
+      auto n = fcalc::try_read(input);
+      bad += !n;
+      benchmark::DoNotOptimize(n);
+    }
+    benchmark::DoNotOptimize(bad);
+  }
+  state.SetItemsProcessed(state.iterations() * inputs.size());
+}
+BENCHMARK(mixed_expected)->Arg(0)->Arg(5)->Arg(50);
+
+// with tracing compiled in but switched off, a phase marker is a relaxed
+// load and a branch. this times one marker on its own and checks that the
+// markers of a tokenize + parse stay under 1% of its runtime
+void trace_overhead(benchmark::State &state) {
+  using clock = std::chrono::steady_clock;
+  std::string expression = gen_expression(state.range(0), state.range(1));
+  fcalc::trace::set_enabled(false);
+
+  constexpr int markers = 1 << 20;
+  auto start = clock::now();
+  for (int i = 0; i != markers; ++i) {
+    fcalc::trace::Scope scope(fcalc::trace::Phase::parse);
+    benchmark::DoNotOptimize(scope);
+  }
+  std::chrono::duration<double, std::nano> marker = clock::now() - start;
+
+  start = clock::now();
+  for (auto _ : state) {
+    auto n = fcalc::tokenize(expression);
+    fcalc::parse(n);
+    benchmark::DoNotOptimize(n);
+  }
+  std::chrono::duration<double, std::nano> run = clock::now() - start;
+
+  double marker_ns = marker.count() / markers;
+  double run_ns = run.count() / double(state.iterations());
+  double overhead = 100 * 2 * marker_ns / run_ns;
+#ifdef FCALC_TRACE
+  state.counters["compiled in"] = 1;
+#else
+  state.counters["compiled in"] = 0;
+#endif
+  state.counters["marker ns"] = marker_ns;
+  state.counters["overhead %"] = overhead;
+  if (overhead > 1.0)
+    state.SkipWithError("disabled trace markers cost more than 1%");
+}
+BENCHMARK(trace_overhead)->Ranges({{8 << 5, 8 << 10}, {2, 8}});
+
 BENCHMARK_MAIN();
\ No newline at end of file
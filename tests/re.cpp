@@ -0,0 +1,119 @@
+#include "re.hpp"
+
+#include <array>
+#include <fmt/core.h>
+#include <fmt/ranges.h>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+int failures = 0;
+
+constexpr std::string_view rule =
+    R"((\d+)(?:\.(\d+))?|([+\-*/^()=√])|(pi|tau|[ieπτ])|(\S))";
+
+// group 0 of every match, one at a time through the iterator
+std::vector<std::string> iterated(re::Pattern &p, std::string_view subject) {
+  std::vector<std::string> result;
+  for (auto m : p.match(subject))
+    result.emplace_back(m);
+  return result;
+}
+
+// the bulk path, through a buffer small enough that it has to resume
+void check_match_all(re::Pattern &p, std::string_view subject) {
+  std::array<re::Match, 3 * 6> out;
+  std::vector<std::string> got;
+  size_t offset = 0;
+  while (offset != std::string_view::npos) {
+    auto count = p.match_all(subject, out, offset);
+    for (size_t k = 0; k != count; ++k)
+      got.emplace_back(out[k * p.groups()].in(subject));
+  }
+  auto expected = iterated(p, subject);
+  if (got != expected) {
+    fmt::print("{}: expected {}, got {}\n", subject, expected, got);
+    ++failures;
+  }
+}
+
+void check_groups(re::Pattern &p) {
+  std::string_view subject = "12.5 x";
+  std::array<re::Match, 6 * 4> out;
+  size_t offset = 0;
+  auto count = p.match_all(subject, out, offset);
+  // 12.5 is a number with a decimal part and nothing else, x only hits \S
+  if (count != 2 || offset != std::string_view::npos ||
+      out[1].in(subject) != "12" || out[2].in(subject) != "5" ||
+      out[3].matched() || out[6 + 5].in(subject) != "x" ||
+      out[6 + 1].matched()) {
+    fmt::print("capture groups of {} are wrong\n", subject);
+    ++failures;
+  }
+}
+
+void check_subjects(re::Pattern &p) {
+  std::array<std::string_view, 4> subjects = {"1 + 2", "", "π τ", "x = 3"};
+  std::array<re::Match, 6 * 8> out;
+  std::array<size_t, 4> ends;
+  // 3 + 0 + 2 + 3 matches fill out exactly
+  auto done = p.match_all(subjects, out, ends);
+  if (done != 4 || ends[0] != 3 || ends[1] != 3 || ends[2] != 5 ||
+      ends[3] != 8 || out[3 * 6].in(subjects[2]) != "π") {
+    fmt::print("subjects: finished {}, ends {}\n", done,
+               std::span(ends).first(done));
+    ++failures;
+  }
+  // one match short, so the last subject doesn't fit
+  done = p.match_all(subjects, std::span(out).first(6 * 7), ends);
+  if (done != 3 || ends[2] != 5) {
+    fmt::print("subjects: finished {} of 4 with room for 7 matches\n", done);
+    ++failures;
+  }
+}
+
+// matches that fill out exactly still finish the subject, and out has to
+// hold at least one match
+void check_room(re::Pattern &p) {
+  std::string_view subject = "1 + 2";
+  std::array<re::Match, 6 * 3> out;
+  size_t offset = 0;
+  auto count = p.match_all(subject, out, offset);
+  if (count != 3 || offset != std::string_view::npos) {
+    fmt::print("{}: {} matches, offset {} with exactly enough room\n",
+               subject, count, offset);
+    ++failures;
+  }
+
+  bool threw = false;
+  offset = 0;
+  try {
+    p.match_all(subject, std::span(out).first(5), offset);
+  } catch (std::runtime_error &) {
+    threw = true;
+  }
+  if (!threw) {
+    fmt::print("room for less than one match should throw\n");
+    ++failures;
+  }
+}
+} // namespace
+
+int main() {
+  for (auto jit : {re::Jit::off, re::Jit::on}) {
+    re::Pattern p(rule, re::Options::utf, jit);
+    check_match_all(p, "v = 3 * 2 + 1 - aπb ^ 2 / i + 412.312");
+    check_match_all(p, "");
+    check_groups(p);
+    check_subjects(p);
+    check_room(p);
+
+    // empty matches have to step forward, also over multibyte characters
+    re::Pattern empty("x*", re::Options::utf, jit);
+    check_match_all(empty, "aπxxb");
+  }
+  return failures != 0;
+}
@@ -0,0 +1,77 @@
+#include <array>
+#include <benchmark/benchmark.h>
+#include <cstddef>
+#include <ctre-unicode.hpp>
+#include <re.hpp>
+#include <string>
+#include <string_view>
+#include <test/gen.hpp>
+
+namespace {
+// the fcalc lexer, once compiled in and once as a runtime rule
+constexpr auto lexer =
+    ctre::range<R"((\d+)(?:\.(\d+))?|([+\-*/^()=√])|(pi|tau|[ieπτ])|(\S))">;
+constexpr std::string_view rule =
+    R"((\d+)(?:\.(\d+))?|([+\-*/^()=√])|(pi|tau|[ieπτ])|(\S))";
+
+inline auto str_cast(std::string_view str) noexcept {
+  return std::u8string_view(reinterpret_cast<const char8_t *>(str.data()),
+                            str.size());
+}
+} // namespace
+
+void ctre_lex(benchmark::State &state) {
+  std::string expression = gen_expression(state.range(0), state.range(1));
+  for (auto _ : state) {
+    size_t matched = 0;
+    for (auto &&match : lexer(str_cast(expression)))
+      matched += match.to_view().size();
+    benchmark::DoNotOptimize(matched);
+  }
+  state.SetBytesProcessed(state.iterations() * expression.size());
+}
+BENCHMARK(ctre_lex)->Ranges({{8 << 5, 8 << 10}, {2, 8}});
+
+void pcre2_lex(benchmark::State &state, re::Jit jit) {
+  std::string expression = gen_expression(state.range(0), state.range(1));
+  re::Pattern pattern(rule, re::Options::utf, jit);
+  re::JitStack stack(32 << 10, 512 << 10);
+  for (auto _ : state) {
+    size_t matched = 0;
+    for (auto match : pattern.match(expression, &stack))
+      matched += match.size();
+    benchmark::DoNotOptimize(matched);
+  }
+  state.SetBytesProcessed(state.iterations() * expression.size());
+  state.counters["jit"] = pattern.jitted();
+}
+BENCHMARK_CAPTURE(pcre2_lex, interpreted, re::Jit::off)
+    ->Ranges({{8 << 5, 8 << 10}, {2, 8}});
+BENCHMARK_CAPTURE(pcre2_lex, jit, re::Jit::on)
+    ->Ranges({{8 << 5, 8 << 10}, {2, 8}});
+
+// the bulk api into a fixed buffer, reading every group like a lexer would
+void pcre2_match_all(benchmark::State &state, re::Jit jit) {
+  std::string expression = gen_expression(state.range(0), state.range(1));
+  re::Pattern pattern(rule, re::Options::utf, jit);
+  re::JitStack stack(32 << 10, 512 << 10);
+  std::array<re::Match, 6 * 256> out;
+  for (auto _ : state) {
+    size_t matched = 0;
+    size_t offset = 0;
+    while (offset != std::string_view::npos) {
+      auto count = pattern.match_all(expression, out, offset, &stack);
+      for (size_t k = 0; k != count * pattern.groups(); ++k)
+        matched += out[k].matched();
+    }
+    benchmark::DoNotOptimize(matched);
+  }
+  state.SetBytesProcessed(state.iterations() * expression.size());
+  state.counters["jit"] = pattern.jitted();
+}
+BENCHMARK_CAPTURE(pcre2_match_all, interpreted, re::Jit::off)
+    ->Ranges({{8 << 5, 8 << 10}, {2, 8}});
+BENCHMARK_CAPTURE(pcre2_match_all, jit, re::Jit::on)
+    ->Ranges({{8 << 5, 8 << 10}, {2, 8}});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,269 @@
+#include <fast_calc/server.hpp>
+#include <test/gen.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fmt/core.h>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// drives calc --serve with pipelined requests from a few connections and
+// reports latency percentiles and throughput. without --socket it starts a
+// server in process on a temporary socket, so it runs anywhere
+namespace {
+using clock_type = std::chrono::steady_clock;
+
+struct Options {
+  std::string socket;
+  unsigned connections = 4;
+  unsigned requests = 20000;
+  // expressions per batch, or rows per request with --rows
+  unsigned batch = 16;
+  unsigned depth = 8;
+  bool rows = false;
+};
+
+struct Result {
+  std::vector<double> latencies;
+  size_t failed = 0;
+};
+
+void usage() {
+  fmt::print("usage: serve_load [--socket path] [--connections n] "
+             "[--requests n] [--batch n] [--depth n] [--rows]\n");
+}
+
+// numbers and real constants only, so every expression evaluates
+std::string real_expression(auto &e, uint32_t terms) {
+  int_dist<uint32_t> rop(0, 3);
+  int_dist<uint32_t> rnum(1, 50);
+  std::string expression = std::to_string(rnum(e));
+  for (uint32_t i = 1; i != terms; ++i) {
+    expression.push_back(' ');
+    expression.push_back("+-*/"[rop(e)]);
+    expression.push_back(' ');
+    expression.append(rnum(e) % 5 == 0 ? "pi" : std::to_string(rnum(e)));
+  }
+  return expression;
+}
+
+int connect_to(const std::string &path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.data(),
+              std::min(path.size(), sizeof(addr.sun_path) - 1));
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 ||
+      connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+    throw std::runtime_error(fmt::format("Could not connect to {}", path));
+  return fd;
+}
+
+void write_all(int fd, const std::vector<char> &bytes) {
+  size_t sent = 0;
+  while (sent != bytes.size()) {
+    auto n = send(fd, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+      throw std::runtime_error("Server went away");
+    sent += n;
+  }
+}
+
+// the responses as they come in, one frame at a time
+struct Frames {
+  int fd;
+  std::vector<char> in;
+  size_t at = 0;
+
+  std::string_view next() {
+    for (;;) {
+      uint32_t size;
+      if (in.size() - at >= sizeof(size)) {
+        std::memcpy(&size, in.data() + at, sizeof(size));
+        if (in.size() - at - sizeof(size) >= size) {
+          std::string_view frame(in.data() + at + sizeof(size), size);
+          at += sizeof(size) + size;
+          return frame;
+        }
+      }
+      in.erase(in.begin(), in.begin() + at);
+      at = 0;
+      char buffer[64 << 10];
+      auto n = recv(fd, buffer, sizeof(buffer), 0);
+      if (n <= 0)
+        throw std::runtime_error("Server went away");
+      in.insert(in.end(), buffer, buffer + n);
+    }
+  }
+};
+
+bool ok(std::string_view frame) {
+  return !frame.empty() && frame[0] == char(fcalc::serve::Status::ok);
+}
+
+Result drive(const Options &o) {
+  std::random_device r;
+  std::default_random_engine e(r());
+  int fd = connect_to(o.socket);
+  Frames frames{fd, {}};
+  Result result;
+
+  // every request on a connection is the same, built once up front
+  std::vector<char> request;
+  if (o.rows) {
+    std::vector<char> define;
+    fcalc::serve::put_define(define, gen_formula(8, 4));
+    write_all(fd, define);
+    auto response = frames.next();
+    if (!ok(response))
+      throw std::runtime_error("Formula was rejected");
+    uint32_t formula, vars;
+    std::memcpy(&formula, response.data() + 1, sizeof(formula));
+    std::memcpy(&vars, response.data() + 5, sizeof(vars));
+    std::uniform_real_distribution<double> d(1.0, 10.0);
+    std::vector<std::vector<double>> columns(vars);
+    std::vector<const double *> ptrs;
+    for (auto &c : columns) {
+      for (unsigned i = 0; i != o.batch; ++i)
+        c.push_back(d(e));
+      ptrs.push_back(c.data());
+    }
+    fcalc::serve::put_rows(request, formula, o.batch, ptrs);
+  } else {
+    std::vector<std::string> expressions;
+    for (unsigned i = 0; i != o.batch; ++i)
+      expressions.push_back(real_expression(e, 8));
+    std::vector<std::string_view> views(expressions.begin(),
+                                        expressions.end());
+    fcalc::serve::put_batch(request, views);
+  }
+
+  std::deque<clock_type::time_point> sent;
+  result.latencies.reserve(o.requests);
+  for (unsigned done = 0, issued = 0; done != o.requests;) {
+    while (issued != o.requests && issued - done < o.depth) {
+      write_all(fd, request);
+      sent.push_back(clock_type::now());
+      ++issued;
+    }
+    auto response = frames.next();
+    std::chrono::duration<double, std::micro> latency =
+        clock_type::now() - sent.front();
+    sent.pop_front();
+    result.latencies.push_back(latency.count());
+    result.failed += !ok(response);
+    ++done;
+  }
+  close(fd);
+  return result;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+  return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Options o;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    auto value = [&]() -> std::string_view {
+      if (i + 1 == argc)
+        throw std::runtime_error(fmt::format("{} needs a value", arg));
+      return argv[++i];
+    };
+    auto number = [&] { return unsigned(std::stoul(std::string(value()))); };
+    try {
+      if (arg == "--socket")
+        o.socket = value();
+      else if (arg == "--connections")
+        o.connections = number();
+      else if (arg == "--requests")
+        o.requests = number();
+      else if (arg == "--batch")
+        o.batch = number();
+      else if (arg == "--depth")
+        o.depth = std::max(1u, number());
+      else if (arg == "--rows")
+        o.rows = true;
+      else {
+        usage();
+        return 1;
+      }
+    } catch (std::exception &e) {
+      fmt::print("{}\n", e.what());
+      usage();
+      return 1;
+    }
+  }
+
+  std::unique_ptr<fcalc::Server> server;
+  std::thread loop;
+  if (o.socket.empty()) {
+    o.socket = (std::filesystem::temp_directory_path() /
+                fmt::format("fcalc-load-{}.sock", getpid()))
+                   .string();
+    server = std::make_unique<fcalc::Server>(
+        o.socket, std::max(1u, std::thread::hardware_concurrency()));
+    loop = std::thread([&] { server->run(); });
+  }
+
+  std::vector<Result> results(o.connections);
+  std::vector<std::thread> clients;
+  auto start = clock_type::now();
+  for (unsigned c = 0; c != o.connections; ++c) {
+    clients.emplace_back([&, c] {
+      try {
+        results[c] = drive(o);
+      } catch (std::exception &e) {
+        fmt::print("connection {}: {}\n", c, e.what());
+        results[c].failed = o.requests;
+      }
+    });
+  }
+  for (auto &t : clients)
+    t.join();
+  std::chrono::duration<double> elapsed = clock_type::now() - start;
+
+  if (server) {
+    server->stop();
+    loop.join();
+  }
+
+  std::vector<double> latencies;
+  size_t failed = 0;
+  for (auto &r : results) {
+    latencies.insert(latencies.end(), r.latencies.begin(), r.latencies.end());
+    failed += r.failed;
+  }
+  if (latencies.empty()) {
+    fmt::print("no responses\n");
+    return 1;
+  }
+  std::ranges::sort(latencies);
+  double requests = latencies.size();
+  fmt::print("{} connections, depth {}, {} {} per request\n", o.connections,
+             o.depth, o.batch, o.rows ? "rows" : "expressions");
+  fmt::print("{:.0f} requests/s, {:.0f} {}/s\n", requests / elapsed.count(),
+             requests * o.batch / elapsed.count(),
+             o.rows ? "rows" : "expressions");
+  fmt::print("latency p50 {:.1f}us p99 {:.1f}us max {:.1f}us\n",
+             percentile(latencies, 0.5), percentile(latencies, 0.99),
+             latencies.back());
+  if (failed != 0)
+    fmt::print("{} requests failed\n", failed);
+  return failed != 0;
+}
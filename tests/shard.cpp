@@ -0,0 +1,271 @@
+#include "fast_calc/fcalc.hpp"
+#include "fast_calc/real_eval.hpp"
+#include "fast_calc/server.hpp"
+#include "fast_calc/shard.hpp"
+
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <fmt/core.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+int failures = 0;
+
+fcalc::Server *serving = nullptr;
+void on_signal(int) {
+  if (serving)
+    serving->stop();
+}
+
+// a server in its own process, like calc --serve. it's asked for address
+// and reports back the one it got, which has the port for tcp
+struct Worker {
+  pid_t pid;
+  std::string address;
+
+  explicit Worker(const std::string &listen) {
+    int fds[2];
+    if (pipe(fds) != 0)
+      throw std::runtime_error("Could not create a pipe");
+    pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      {
+        fcalc::Server server(listen, 2);
+        serving = &server;
+        std::signal(SIGTERM, on_signal);
+        auto &a = server.address();
+        if (write(fds[1], a.data(), a.size()) != ssize_t(a.size()))
+          _exit(1);
+        close(fds[1]);
+        server.run();
+      }
+      _exit(0);
+    }
+    close(fds[1]);
+    char buffer[256];
+    for (ssize_t n; (n = read(fds[0], buffer, sizeof(buffer))) > 0;)
+      address.append(buffer, n);
+    close(fds[0]);
+  }
+  ~Worker() {
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+  }
+};
+
+void check(bool ok, std::string_view what) {
+  if (!ok) {
+    fmt::print("{}\n", what);
+    ++failures;
+  }
+}
+
+// every line against evaluating it here, in input order, over shards small
+// enough that each worker gets several
+void check_batch(fcalc::Coordinator &c) {
+  std::vector<std::string> lines;
+  for (int i = 0; i != 1000; ++i) {
+    if (i % 97 == 5)
+      lines.push_back(fmt::format("{} + * 2", i));
+    else if (i % 89 == 3)
+      lines.push_back("x + 1");
+    else
+      lines.push_back(fmt::format("{} * 3 - √ {} / 7", i, i));
+  }
+  std::vector<std::string_view> views(lines.begin(), lines.end());
+  auto results = c.evaluate(views, 64);
+  check(results.size() == lines.size(), "batch: wrong number of results");
+  for (size_t i = 0; i != results.size(); ++i) {
+    auto &r = results[i];
+    auto local = fcalc::try_read(lines[i]);
+    if (!local) {
+      check(r.status == fcalc::serve::Status::parse_error &&
+                r.error.code == local.error().code &&
+                r.error.offset == local.error().offset,
+            fmt::format("batch: {} should be {}", lines[i],
+                        local.error().message(lines[i])));
+    } else if (i % 89 == 3) {
+      check(r.status == fcalc::serve::Status::error,
+            fmt::format("batch: {} should be an error", lines[i]));
+    } else {
+      check(r.status == fcalc::serve::Status::ok &&
+                r.value == fcalc::evaluate(*local),
+            fmt::format("batch: {} came back wrong", lines[i]));
+    }
+  }
+}
+
+// the columns are handed over in the other order from the worker's
+void check_rows(fcalc::Coordinator &c) {
+  std::string_view formula = "x * y - x / 3 + sin(y) + y ^ 2";
+  size_t rows = 10007;
+  std::vector<double> x, y;
+  for (size_t i = 0; i != rows; ++i) {
+    x.push_back(double(i) / 7);
+    y.push_back(std::sqrt(double(i)));
+  }
+  std::string_view names[] = {"y", "x"};
+  const double *columns[] = {y.data(), x.data()};
+  auto got = c.evaluate(formula, names, columns, rows, 1000);
+
+  auto a = fcalc::tokenize(formula);
+  fcalc::parse(a);
+  fcalc::Rewrites applied;
+  auto p = fcalc::compile(a, applied);
+  std::vector<const double *> vars;
+  for (auto &v : p.variables)
+    vars.push_back(v.view() == "x" ? x.data() : y.data());
+  std::vector<double> expected(rows);
+  fcalc::evaluate(p, vars, expected.data(), rows);
+  check(got == expected, "rows: results differ from evaluating here");
+
+  bool threw = false;
+  try {
+    c.evaluate("x + z", names, columns, rows);
+  } catch (std::runtime_error &) {
+    threw = true;
+  }
+  check(threw, "rows: a variable without a column should throw");
+
+  // every job gives its formula back, so one coordinator can run more of
+  // them than a connection can hold at once
+  bool same = true;
+  for (uint32_t i = 0; same && i != fcalc::serve::max_formulas + 10; ++i)
+    same = c.evaluate("x + y", names, columns, 10)[9] == x[9] + y[9];
+  check(same, "rows: later jobs on the same coordinator came back wrong");
+}
+
+// shards shrink to fit in a frame whatever size the caller asks for, and
+// an expression no frame can hold is turned down before anything is sent
+void check_frames(fcalc::Coordinator &c) {
+  namespace serve = fcalc::serve;
+  std::string padded = std::string(1 << 20, ' ') + "1";
+  std::vector<std::string_view> lines(70, padded);
+  auto results = c.evaluate(lines);
+  bool ok = results.size() == lines.size();
+  for (auto &r : results)
+    ok = ok && r.status == serve::Status::ok && r.value == 1;
+  check(ok, "frames: long lines came back wrong");
+
+  std::string huge(serve::max_frame, '1');
+  std::string_view one[] = {huge};
+  bool threw = false;
+  try {
+    c.evaluate(one);
+  } catch (std::runtime_error &) {
+    threw = true;
+  }
+  check(threw, "frames: an expression longer than a frame should throw");
+
+  size_t rows = serve::max_rows / 2 + 1;
+  std::vector<double> x(rows), y(rows);
+  for (size_t i = 0; i != rows; ++i) {
+    x[i] = double(i);
+    y[i] = double(i % 1000);
+  }
+  std::string_view names[] = {"x", "y"};
+  const double *columns[] = {x.data(), y.data()};
+  auto got = c.evaluate("x - y", names, columns, rows, rows);
+  bool same = got.size() == rows;
+  for (size_t i = 0; same && i != rows; ++i)
+    same = got[i] == x[i] - y[i];
+  check(same, "frames: a shard of more rows than fit came back wrong");
+}
+
+// requests sent before the client shuts down its side are all answered,
+// then the server closes the connection. rows and formulas are capped
+void check_connection(const std::string &address) {
+  namespace serve = fcalc::serve;
+  int fd = serve::connect(address);
+  std::vector<char> out;
+  std::string_view lines[] = {"1 + 2", "x"};
+  serve::put_batch(out, lines);
+  serve::put_define(out, "3 * 4");
+  serve::put_rows(out, 0, serve::max_rows + 1, {});
+  for (uint32_t i = 0; i != serve::max_formulas; ++i)
+    serve::put_define(out, "5");
+  serve::put_forget(out, 5);
+  serve::put_rows(out, 5, 1, {});
+  serve::put_define(out, "6");
+  serve::write_all(fd, out);
+  shutdown(fd, SHUT_WR);
+
+  std::vector<char> frame;
+  serve::read_frame(fd, frame);
+  double value;
+  std::memcpy(&value, frame.data() + 2, sizeof(value));
+  check(frame.size() == 1 + 2 * serve::result_size && value == 3,
+        "connection: the batch came back wrong");
+  serve::read_frame(fd, frame);
+  check(frame[0] == char(serve::Status::ok),
+        "connection: the define should work");
+  serve::read_frame(fd, frame);
+  check(frame[0] == char(serve::Status::error),
+        "connection: too many rows should be an error");
+  for (uint32_t i = 1; i != serve::max_formulas; ++i)
+    serve::read_frame(fd, frame);
+  check(frame[0] == char(serve::Status::ok),
+        "connection: the last formula that fits should be defined");
+  serve::read_frame(fd, frame);
+  check(frame[0] == char(serve::Status::error),
+        "connection: a formula past the cap should be an error");
+  serve::read_frame(fd, frame);
+  check(frame.size() == 1 && frame[0] == char(serve::Status::ok),
+        "connection: forgetting a formula should work");
+  serve::read_frame(fd, frame);
+  check(frame[0] == char(serve::Status::error),
+        "connection: a forgotten formula should be gone");
+  serve::read_frame(fd, frame);
+  uint32_t id = 0;
+  if (frame.size() >= 1 + sizeof(id))
+    std::memcpy(&id, frame.data() + 1, sizeof(id));
+  check(frame[0] == char(serve::Status::ok) && id == 5,
+        "connection: a forgotten id should be reused");
+  bool closed = false;
+  try {
+    serve::read_frame(fd, frame);
+  } catch (std::runtime_error &) {
+    closed = true;
+  }
+  check(closed, "connection: should close after the last answer");
+  close(fd);
+}
+} // namespace
+
+int main() {
+  auto socket = std::filesystem::temp_directory_path() /
+                fmt::format("fcalc-shard-test-{}.sock", getpid());
+  // forked before the coordinator starts any threads
+  Worker unix_worker(socket.string());
+  Worker tcp_worker("tcp:127.0.0.1:0");
+  if (!tcp_worker.address.starts_with("tcp:127.0.0.1:") ||
+      tcp_worker.address.ends_with(":0")) {
+    fmt::print("tcp worker is on {}\n", tcp_worker.address);
+    return 1;
+  }
+
+  {
+    std::string addresses[] = {unix_worker.address, tcp_worker.address};
+    fcalc::Coordinator c(addresses);
+    check_batch(c);
+  }
+  {
+    std::string addresses[] = {unix_worker.address, tcp_worker.address};
+    fcalc::Coordinator c(addresses);
+    check_rows(c);
+    check_frames(c);
+  }
+  check_connection(unix_worker.address);
+  check_connection(tcp_worker.address);
+  return failures != 0;
+}